@@ -0,0 +1,249 @@
+/*
+ * acl.c - layer-4 proxy destination access control module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <netinet/in.h>
+
+#include "utils.h"
+#include "lpm.h"
+#include "acl.h"
+
+typedef struct {
+    uint32_t        entry;
+    uint16_t        lo;
+    uint16_t        hi;
+    int             allow;
+} AclRule;
+
+/* One per distinct prefix, indexed by its lpm value. */
+typedef struct {
+    uint32_t        first;
+    uint32_t        count;
+    uint32_t        parent;
+} AclEntry;
+
+struct acl_t {
+    lpm_t           *lpm;
+    AclRule         *rules;
+    size_t          nrules;
+    size_t          rules_cap;
+    AclEntry        *entries;   /*  entries[0] is unused    */
+    uint32_t        nentries;
+    size_t          entries_cap;
+    int             default_allow;
+};
+
+Acl *acl_new(void) {
+    Acl *acl = (Acl*)calloc(1, sizeof(Acl));
+    if(NULL == acl) {
+        syslog(LOG_ERR, "acl: calloc: %m");
+        return NULL;
+    }
+    if(NULL == (acl->lpm = lpm_new()) ) {
+        free(acl);
+        return NULL;
+    }
+    acl->default_allow = 1;
+    acl->nentries = 1;
+    return acl;
+}
+
+void acl_delete(Acl *acl) {
+    if(NULL == acl)
+        return;
+    lpm_delete(acl->lpm);
+    free(acl->rules);
+    free(acl->entries);
+    free(acl);
+}
+
+static int parse_action(const char *str, int *allow) {
+    if(0 == strcmp(str, "allow"))
+        *allow = 1;
+    else if(0 == strcmp(str, "deny"))
+        *allow = 0;
+    else
+        return -1;
+    return 0;
+}
+
+int acl_set_default(Acl *acl, const char *action) {
+    return parse_action(action, &acl->default_allow);
+}
+
+static int parse_ports(const char *str, uint16_t *lo, uint16_t *hi) {
+    char *end;
+    unsigned long a, b;
+
+    if(NULL == str || 0 == strcmp(str, "*")) {
+        *lo = 0;
+        *hi = 65535;
+        return 0;
+    }
+    a = strtoul(str, &end, 10);
+    if(end == str)
+        return -1;
+    if('-' == *end) {
+        str = end + 1;
+        b = strtoul(str, &end, 10);
+        if(end == str)
+            return -1;
+    } else {
+        b = a;
+    }
+    if('\0' != *end || a > b || b > 65535)
+        return -1;
+    *lo = (uint16_t)a;
+    *hi = (uint16_t)b;
+    return 0;
+}
+
+int acl_add_rule(Acl *acl, const char *rule) {
+    char buf[256];
+    char *save, *action, *prefix, *ports;
+    unsigned char addr[16];
+    unsigned int plen;
+    int family;
+    AclRule r;
+
+    if(strlen(rule) >= sizeof(buf))
+        goto invalid;
+    strcpy(buf, rule);
+    action = strtok_r(buf, " \t", &save);
+    prefix = strtok_r(NULL, " \t", &save);
+    ports = strtok_r(NULL, " \t", &save);
+    if(NULL == action || NULL == prefix || NULL != strtok_r(NULL, " \t", &save))
+        goto invalid;
+    if(-1 == parse_action(action, &r.allow)
+            || -1 == lpm_parse_prefix(prefix, &family, addr, &plen)
+            || -1 == parse_ports(ports, &r.lo, &r.hi))
+        goto invalid;
+
+    if(acl->nentries >= acl->entries_cap) {
+        size_t cap = acl->entries_cap? acl->entries_cap * 2: 64;
+        AclEntry *p = (AclEntry*)realloc(acl->entries, cap * sizeof(AclEntry));
+        if(NULL == p)
+            goto nomem;
+        acl->entries = p;
+        acl->entries_cap = cap;
+    }
+    if(acl->nrules == acl->rules_cap) {
+        size_t cap = acl->rules_cap? acl->rules_cap * 2: 64;
+        AclRule *p = (AclRule*)realloc(acl->rules, cap * sizeof(AclRule));
+        if(NULL == p)
+            goto nomem;
+        acl->rules = p;
+        acl->rules_cap = cap;
+    }
+
+    if(0 == (r.entry = lpm_insert(acl->lpm, family, addr, plen, acl->nentries)) )
+        goto nomem;
+    if(r.entry == acl->nentries)
+        memset(&acl->entries[acl->nentries++], 0, sizeof(AclEntry));
+    acl->rules[acl->nrules++] = r;
+    return 0;
+
+invalid:
+    syslog(LOG_ERR, "acl: invalid rule '%s'", rule);
+    return -1;
+nomem:
+    syslog(LOG_ERR, "acl: out of memory");
+    return -1;
+}
+
+/* One rule per line; blank lines and '#' comments are skipped. */
+int acl_load_file(Acl *acl, const char *path) {
+    FILE *fp;
+    char line[256];
+    int lineno = 0, ret = 0;
+
+    if(NULL == (fp = fopen(path, "r")) ) {
+        syslog(LOG_ERR, "acl: couldn't open %s: %m", path);
+        return -1;
+    }
+    while(0 == ret && NULL != fgets(line, sizeof(line), fp)) {
+        char *p = line_strip(line);
+
+        ++lineno;
+        if('\0' == *p)
+            continue;
+        if(-1 == (ret = acl_add_rule(acl, p)) )
+            syslog(LOG_ERR, "acl: %s:%d: rejected", path, lineno);
+    }
+    fclose(fp);
+    return ret;
+}
+
+static void set_parent(void *arg, uint32_t value, uint32_t parent) {
+    ((Acl*)arg)->entries[value].parent = parent;
+}
+
+/* Groups rules by prefix, keeping their order, and compiles the trie.  */
+int acl_compile(Acl *acl) {
+    AclRule *sorted = NULL;
+    uint32_t e;
+    size_t i;
+
+    if(acl->nrules) {
+        if(NULL == (sorted = (AclRule*)malloc(acl->nrules * sizeof(AclRule))) ) {
+            syslog(LOG_ERR, "acl: malloc: %m");
+            return -1;
+        }
+        for(i = 0; i < acl->nrules; ++i)
+            ++acl->entries[acl->rules[i].entry].count;
+        for(e = 1, i = 0; e < acl->nentries; ++e) {
+            acl->entries[e].first = (uint32_t)i;
+            i += acl->entries[e].count;
+            acl->entries[e].count = 0;
+        }
+        for(i = 0; i < acl->nrules; ++i) {
+            AclEntry *entry = &acl->entries[acl->rules[i].entry];
+            sorted[entry->first + entry->count++] = acl->rules[i];
+        }
+        free(acl->rules);
+        acl->rules = sorted;
+    }
+
+    if(-1 == lpm_compile(acl->lpm, set_parent, acl))
+        return -1;
+    syslog(LOG_INFO, "acl: %zu rules over %u prefixes, default %s",
+            acl->nrules, acl->nentries - 1, acl->default_allow? "allow": "deny");
+    return 0;
+}
+
+/* Returns 0 if connecting to addr is allowed, -1 otherwise.    */
+int acl_check(const Acl *acl, const struct sockaddr *addr) {
+    uint32_t e = lpm_lookup(acl->lpm, addr);
+    uint16_t port;
+
+    if(0 == e)
+        return acl->default_allow? 0: -1;
+
+    if(AF_INET == addr->sa_family)
+        port = ntohs(((const struct sockaddr_in*)addr)->sin_port);
+    else
+        port = ntohs(((const struct sockaddr_in6*)addr)->sin6_port);
+
+    do {
+        const AclEntry *entry = &acl->entries[e];
+        const AclRule *r = &acl->rules[entry->first];
+        const AclRule *end = r + entry->count;
+        for(; r < end; ++r) {
+            if(port >= r->lo && port <= r->hi)
+                return r->allow? 0: -1;
+        }
+    } while(0 != (e = acl->entries[e].parent));
+
+    return acl->default_allow? 0: -1;
+}
@@ -0,0 +1,34 @@
+/*
+ * acl.h - layer-4 proxy destination access control module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef ACL_H
+#define ACL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Rules read "allow|deny PREFIX [PORT[-PORT]]". The longest prefix
+ * covering a destination decides; among its rules the first one whose
+ * port range matches wins, and if none does the next shorter prefix is
+ * consulted, down to the default action.
+ */
+typedef struct acl_t Acl;
+
+Acl *acl_new(void);
+void acl_delete(Acl *acl);
+
+int acl_set_default(Acl *acl, const char *action);
+int acl_add_rule(Acl *acl, const char *rule);
+int acl_load_file(Acl *acl, const char *path);
+int acl_compile(Acl *acl);
+
+int acl_check(const Acl *acl, const struct sockaddr *addr);
+
+#endif  /*  ACL_H   */
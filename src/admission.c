@@ -0,0 +1,320 @@
+/*
+ * admission.c - layer-4 proxy overload protection module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "proxy.h"
+#include "admission.h"
+
+#define ADMISSION_MAX_LISTENERS     16
+#define ADMISSION_FD_RESERVE        64
+#define ADMISSION_RETRY_INTERVAL    1.0
+#define ADMISSION_SHED_BATCH        64
+
+/* Why the listeners are paused, they resume once no reason is left. */
+#define ADMISSION_PAUSE_WATERMARK   0x01
+#define ADMISSION_PAUSE_ACCEPT      0x02
+
+static AdmissionLimits s_limits;
+
+static size_t s_conns;
+static size_t s_opened;
+static size_t s_bufmem;
+static size_t s_fds;
+
+static ev_io *s_listeners[ADMISSION_MAX_LISTENERS];
+static int s_nlisteners;
+static int s_paused;
+static ev_timer s_retry_timer;
+static ev_timer s_shed_timer;
+
+static void admission_evaluate(EV_P);
+static void admission_pause(EV_P_ int reason);
+static void admission_resume(EV_P_ int reason);
+static void admission_shed(EV_P);
+static void admission_shed_later(EV_P);
+static void retry_callback(EV_P_ ev_timer *watcher, int revents);
+static void shed_callback(EV_P_ ev_timer *watcher, int revents);
+
+void admission_limits_default(AdmissionLimits *limits) {
+    struct rlimit rl;
+
+    memset(limits, 0, sizeof(AdmissionLimits));
+    if(0 == getrlimit(RLIMIT_NOFILE, &rl)
+            && RLIM_INFINITY != rl.rlim_cur
+            && rl.rlim_cur > 2 * ADMISSION_FD_RESERVE) {
+        limits->fds.high = rl.rlim_cur - ADMISSION_FD_RESERVE;
+    }
+}
+
+static int parse_size(const char *str, char **end, size_t *value) {
+    errno = 0;
+    unsigned long long v = strtoull(str, end, 10);
+    if(errno || *end == str)
+        return -1;
+
+    switch(**end) {
+        case 'g': case 'G':     v <<= 10;   /*  fall through    */
+        case 'm': case 'M':     v <<= 10;   /*  fall through    */
+        case 'k': case 'K':     v <<= 10;
+                                ++*end;
+                                break;
+        default:                break;
+    }
+    *value = (size_t)v;
+    return 0;
+}
+
+/* Parses "HIGH[:LOW]"; LOW defaults to 90% of HIGH.    */
+int admission_parse_budget(AdmissionBudget *budget, const char *str) {
+    char *end;
+
+    if(-1 == parse_size(str, &end, &budget->high))
+        return -1;
+    if(':' == *end) {
+        if(-1 == parse_size(end + 1, &end, &budget->low))
+            return -1;
+    } else {
+        budget->low = 0;
+    }
+    if('\0' != *end)
+        return -1;
+    if(0 == budget->low || budget->low > budget->high)
+        budget->low = budget->high - budget->high / 10;
+    return 0;
+}
+
+static void budget_fixup(AdmissionBudget *budget) {
+    if(budget->high && (0 == budget->low || budget->low > budget->high))
+        budget->low = budget->high - budget->high / 10;
+}
+
+static void limits_set(const AdmissionLimits *limits) {
+    s_limits = *limits;
+    budget_fixup(&s_limits.conns);
+    budget_fixup(&s_limits.bufmem);
+    budget_fixup(&s_limits.fds);
+}
+
+void admission_init(const AdmissionLimits *limits) {
+    limits_set(limits);
+    ev_timer_init(&s_retry_timer, retry_callback,
+            ADMISSION_RETRY_INTERVAL, ADMISSION_RETRY_INTERVAL);
+    ev_timer_init(&s_shed_timer, shed_callback, 0., 0.);
+}
+
+/* New limits take effect at once, pausing or resuming the listeners. */
+void admission_set_limits(EV_P_ const AdmissionLimits *limits) {
+    limits_set(limits);
+    admission_evaluate(loop);
+}
+
+int admission_add_listener(EV_P_ ev_io *watcher) {
+    if(ADMISSION_MAX_LISTENERS == s_nlisteners)
+        return -1;
+
+    s_listeners[s_nlisteners++] = watcher;
+    if(s_paused)
+        ev_io_stop(loop, watcher);
+    return 0;
+}
+
+/* For good, so that overload recovery doesn't start them again. */
+void admission_close_listeners(EV_P) {
+    int i;
+
+    for(i = 0; i < s_nlisteners; ++i) {
+        ev_io_stop(loop, s_listeners[i]);
+        close_i(s_listeners[i]->fd);
+    }
+    s_nlisteners = 0;
+}
+
+void admission_context_opened(EV_P) {
+    ++s_conns;
+    ++s_opened;
+    admission_evaluate(loop);
+}
+
+void admission_context_closed(EV_P) {
+    --s_conns;
+    admission_evaluate(loop);
+}
+
+void admission_fd_opened(EV_P_ int count) {
+    s_fds += count;
+    admission_evaluate(loop);
+}
+
+void admission_fd_closed(EV_P_ int count) {
+    s_fds -= count;
+    admission_evaluate(loop);
+}
+
+void admission_buffer_alloc(EV_P_ size_t size) {
+    s_bufmem += size;
+    admission_evaluate(loop);
+}
+
+void admission_buffer_free(EV_P_ size_t size) {
+    s_bufmem -= size;
+    admission_evaluate(loop);
+}
+
+/*
+ * accept(2) failing for lack of resources leaves the connection in the
+ * backlog, so a level-triggered listener would spin. Back off until the
+ * retry timer fires.
+ */
+void admission_accept_failed(EV_P_ int err) {
+    switch(err) {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            syslog(LOG_WARNING, "admission: accept: %s, pausing listeners", strerror(err));
+            admission_pause(loop, ADMISSION_PAUSE_ACCEPT);
+            admission_shed_later(loop);
+            break;
+        default:
+            break;
+    }
+}
+
+static int budget_over(const AdmissionBudget *budget, size_t value) {
+    return budget->high && value >= budget->high;
+}
+
+static int budget_under(const AdmissionBudget *budget, size_t value) {
+    return 0 == budget->high || value < budget->low;
+}
+
+int admission_overloaded(void) {
+    return budget_over(&s_limits.conns, s_conns)
+        || budget_over(&s_limits.bufmem, s_bufmem)
+        || budget_over(&s_limits.fds, s_fds);
+}
+
+size_t admission_fds(void) {
+    return s_fds;
+}
+
+void admission_stats(AdmissionStats *stats) {
+    stats->conns = s_conns;
+    stats->opened = s_opened;
+    stats->bufmem = s_bufmem;
+    stats->fds = s_fds;
+    stats->paused = 0 != s_paused;
+}
+
+/*
+ * Called from the accounting hooks, often with a context half set up
+ * further up the stack: it only pauses and resumes, shedding is left
+ * to a watcher of its own.
+ */
+static void admission_evaluate(EV_P) {
+    if(!(s_paused & ADMISSION_PAUSE_WATERMARK)) {
+        if(admission_overloaded()) {
+            syslog(LOG_WARNING, "admission: high watermark crossed "
+                    "(conns %zu, bufmem %zu, fds %zu), pausing listeners",
+                    s_conns, s_bufmem, s_fds);
+            admission_pause(loop, ADMISSION_PAUSE_WATERMARK);
+            admission_shed_later(loop);
+        }
+    } else if(budget_under(&s_limits.conns, s_conns)
+            && budget_under(&s_limits.bufmem, s_bufmem)
+            && budget_under(&s_limits.fds, s_fds)) {
+        syslog(LOG_NOTICE, "admission: below low watermark "
+                "(conns %zu, bufmem %zu, fds %zu), resuming listeners",
+                s_conns, s_bufmem, s_fds);
+        admission_resume(loop, ADMISSION_PAUSE_WATERMARK);
+    }
+}
+
+static void admission_pause(EV_P_ int reason) {
+    int i;
+
+    if(0 == s_paused) {
+        for(i = 0; i < s_nlisteners; ++i)
+            ev_io_stop(loop, s_listeners[i]);
+    }
+    s_paused |= reason;
+    ev_timer_again(loop, &s_retry_timer);
+}
+
+static void admission_resume(EV_P_ int reason) {
+    int i;
+
+    s_paused &= ~reason;
+    if(s_paused)
+        return;
+    ev_timer_stop(loop, &s_retry_timer);
+    for(i = 0; i < s_nlisteners; ++i)
+        ev_io_start(loop, s_listeners[i]);
+}
+
+/* Closes the least recently active contexts to get back to the low watermark. */
+static void admission_shed(EV_P) {
+    size_t want = 0;
+
+    if(s_limits.shed_idle <= 0)
+        return;
+
+    if(s_limits.conns.high && s_conns > s_limits.conns.low)
+        want = s_conns - s_limits.conns.low;
+    if(s_limits.fds.high && s_fds > s_limits.fds.low
+            && (s_fds - s_limits.fds.low + 1) / 2 > want)
+        want = (s_fds - s_limits.fds.low + 1) / 2;
+    if(0 == want)
+        want = 1;
+    if(want > ADMISSION_SHED_BATCH)
+        want = ADMISSION_SHED_BATCH;
+
+    size_t shed = proxy_context_shed_idle(loop, want, s_limits.shed_idle);
+    if(shed)
+        syslog(LOG_WARNING, "admission: shed %zu idle connections", shed);
+}
+
+static void admission_shed_later(EV_P) {
+    if(s_limits.shed_idle > 0 && !ev_is_active(&s_shed_timer))
+        ev_timer_start(loop, &s_shed_timer);
+}
+
+static void shed_callback(EV_P_ ev_timer *watcher, int revents) {
+    admission_shed(loop);
+}
+
+static void retry_callback(EV_P_ ev_timer *watcher, int revents) {
+    if(!s_paused) {
+        ev_timer_stop(loop, watcher);
+        return;
+    }
+
+    if(admission_overloaded())
+        admission_shed(loop);
+
+    /*
+     * Paused because accept(2) ran out of resources; nothing we account
+     * for may have changed, so give the listeners another chance. A
+     * watermark pause holds until every budget is below its low mark.
+     */
+    if(s_paused & ADMISSION_PAUSE_ACCEPT) {
+        syslog(LOG_NOTICE, "admission: retrying accept");
+        admission_resume(loop, ADMISSION_PAUSE_ACCEPT);
+    }
+}
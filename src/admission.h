@@ -0,0 +1,60 @@
+/*
+ * admission.h - layer-4 proxy overload protection module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+/*
+ * Every budget has a high and a low watermark. Crossing a high watermark
+ * pauses all registered listeners; they are resumed once every budget is
+ * back below its low watermark. A zero high watermark disables the budget.
+ */
+typedef struct {
+    size_t      high;
+    size_t      low;
+} AdmissionBudget;
+
+typedef struct {
+    AdmissionBudget conns;      /*  live proxy contexts             */
+    AdmissionBudget bufmem;     /*  bytes held by relay buffers     */
+    AdmissionBudget fds;        /*  descriptors held by the proxy   */
+    double          shed_idle;  /*  shed contexts idle this long, 0 disables */
+} AdmissionLimits;
+
+/* Current usage, for the control socket. */
+typedef struct {
+    size_t      conns;
+    size_t      opened;     /*  contexts since start    */
+    size_t      bufmem;
+    size_t      fds;
+    int         paused;
+} AdmissionStats;
+
+void admission_limits_default(AdmissionLimits *limits);
+int admission_parse_budget(AdmissionBudget *budget, const char *str);
+void admission_init(const AdmissionLimits *limits);
+void admission_set_limits(EV_P_ const AdmissionLimits *limits);
+int admission_add_listener(EV_P_ ev_io *watcher);
+void admission_close_listeners(EV_P);
+
+void admission_context_opened(EV_P);
+void admission_context_closed(EV_P);
+void admission_fd_opened(EV_P_ int count);
+void admission_fd_closed(EV_P_ int count);
+void admission_buffer_alloc(EV_P_ size_t size);
+void admission_buffer_free(EV_P_ size_t size);
+
+void admission_accept_failed(EV_P_ int err);
+int admission_overloaded(void);
+size_t admission_fds(void);
+void admission_stats(AdmissionStats *stats);
+
+#endif  /*  ADMISSION_H */
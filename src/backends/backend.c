@@ -7,32 +7,62 @@
  * General Public License, version 3 or (at your option) any later version.
  */
 
+#include <stdlib.h>
 #include <string.h>
 
+#include <ev.h>
+
 #include "backend.h"
 
-static char *s_name;
-static getDestinationFn s_getdestination;
+#define BACKEND_MAX     8
+
+typedef struct {
+    char                    *name;
+    getDestinationFn        getdestination;
+    releaseDestinationFn    release;
+} Backend;
 
-int backend_getdestination(int fd, struct sockaddr_storage *addr) {
-    return (*s_getdestination)(fd, addr);
+static Backend s_backends[BACKEND_MAX];
+static size_t s_nbackends;
+static Backend *s_backend;
+
+int backend_getdestination(EV_P_ int fd, struct sockaddr_storage *addr) {
+    return (*s_backend->getdestination)(loop, fd, addr);
 }
 
-int backend_register(const char name[], getDestinationFn fn) {
-    if(s_name != NULL)
-        return -1;
+void backend_release(int token) {
+    if(BACKEND_NONE != token && s_backend->release)
+        (*s_backend->release)(token);
+}
+
+static Backend *backend_find(const char name[]) {
+    size_t i;
 
-    s_name = strdup(name);
-    s_getdestination = fn;
+    for(i = 0; i < s_nbackends; ++i) {
+        if(0 == strcmp(s_backends[i].name, name))
+            return &s_backends[i];
+    }
+    return NULL;
+}
+
+int backend_register(const char name[], getDestinationFn fn, releaseDestinationFn release) {
+    Backend *backend = &s_backends[s_nbackends];
+
+    if(BACKEND_MAX == s_nbackends || NULL != backend_find(name))
+        return -1;
+    if(NULL == (backend->name = strdup(name)) )
+        return -1;
+    backend->getdestination = fn;
+    backend->release = release;
+    ++s_nbackends;
     return 0;
 }
 
 int backend_switchto(const char name[]) {
-    if(NULL == s_name)
-        return -1;
+    Backend *backend = backend_find(name);
 
-    if(0 == strcmp(s_name, name))
-        return 0;
-    else
+    if(NULL == backend)
         return -1;
+    s_backend = backend;
+    return 0;
 }
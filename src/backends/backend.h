@@ -13,10 +13,20 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
-int backend_getdestination(int fd, struct sockaddr_storage *addr);
+/* No destination to release, it didn't come from the backend. */
+#define BACKEND_NONE    (-1)
 
-typedef int (*getDestinationFn)(int, struct sockaddr_storage*);
-int backend_register(const char name[], getDestinationFn);
+int backend_getdestination(EV_P_ int fd, struct sockaddr_storage *addr);
+void backend_release(int token);
+
+/*
+ * A backend fills in the destination for an accepted fd and returns -1
+ * on failure, or a token that is handed back to its release function
+ * once the connection is gone. The release function may be NULL.
+ */
+typedef int (*getDestinationFn)(EV_P_ int, struct sockaddr_storage*);
+typedef void (*releaseDestinationFn)(int);
+int backend_register(const char name[], getDestinationFn, releaseDestinationFn);
 int backend_switchto(const char name[]);
 
 #endif  /*  BACKENDS_BACKEND_H  */
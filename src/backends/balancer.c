@@ -0,0 +1,366 @@
+/*
+ * backends/balancer.c - layer-4 proxy load-balancing backend module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "../utils.h"
+#include "../netutil.h"
+#include "../health.h"
+#include "backend.h"
+#include "balancer.h"
+
+#define BALANCER_MAX_UPSTREAMS  256
+#define BALANCER_MAX_WEIGHT     100
+#define BALANCER_MAGLEV_SIZE    65537   /*  prime, >= 100 entries per upstream  */
+#define BALANCER_RING_POINTS    160     /*  per upstream of average weight      */
+#define BALANCER_EMPTY          0xffff
+
+enum {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,
+    BALANCE_P2C,
+    BALANCE_MAGLEV,
+    BALANCE_RING,
+};
+
+static const char *s_methods[] = {"round-robin", "least-conn", "p2c", "maglev", "ring"};
+
+typedef struct {
+    struct sockaddr_storage addr;
+    int                     weight;
+    int                     current;    /*  smooth weighted round-robin */
+    int                     active;     /*  connections relayed to it now   */
+    int                     health;     /*  its pinned health slot          */
+} Upstream;
+
+typedef struct {
+    uint64_t                hash;
+    uint16_t                upstream;
+} RingPoint;
+
+static Upstream s_upstreams[BALANCER_MAX_UPSTREAMS];
+static size_t s_nupstreams;
+static int s_method = BALANCE_ROUND_ROBIN;
+static int s_total_weight;
+static int s_cumulative[BALANCER_MAX_UPSTREAMS];    /*  for weighted random picks   */
+static size_t s_next;                               /*  where least-conn ties start */
+static uint64_t s_rand[2];
+
+static uint16_t *s_maglev;
+static RingPoint *s_ring;
+static size_t s_npoints;
+
+/* "HOST:PORT [weight=N]", weights range from 1 to 100. */
+int balancer_add_upstream(const char *spec) {
+    Upstream *up = &s_upstreams[s_nupstreams];
+    char buf[512], *hostport, *option, *save;
+
+    if(BALANCER_MAX_UPSTREAMS == s_nupstreams || strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf, spec);
+    if(NULL == (hostport = strtok_r(buf, " \t", &save))
+            || -1 == sockaddr_resolve(hostport, SOCK_STREAM, &up->addr))
+        return -1;
+
+    up->weight = 1;
+    while(NULL != (option = strtok_r(NULL, " \t", &save)) ) {
+        char *end;
+        long weight;
+
+        if(0 != strncmp(option, "weight=", 7))
+            return -1;
+        weight = strtol(option + 7, &end, 10);
+        if(end == option + 7 || '\0' != *end || weight < 1 || weight > BALANCER_MAX_WEIGHT)
+            return -1;
+        up->weight = (int)weight;
+    }
+    up->current = 0;
+    up->active = 0;
+    ++s_nupstreams;
+    return 0;
+}
+
+int balancer_set_method(const char *name) {
+    size_t i;
+
+    for(i = 0; i < sizeof(s_methods) / sizeof(s_methods[0]); ++i) {
+        if(0 == strcmp(name, s_methods[i])) {
+            s_method = (int)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t balancer_size(void) {
+    return s_nupstreams;
+}
+
+/* xorshift128+, good enough to spread picks. */
+static inline uint64_t rand64(void) {
+    uint64_t x = s_rand[0], y = s_rand[1];
+
+    s_rand[0] = y;
+    x ^= x << 23;
+    s_rand[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+    return s_rand[1] + y;
+}
+
+/*
+ * Hashes of addresses are unseeded, so that every instance and every
+ * restart maps a client to the same upstream.
+ */
+static uint64_t addr_hash(const struct sockaddr *addr, int with_port) {
+    unsigned char key[16] = {0};
+    uint16_t port = 0;
+    uint64_t w[2];
+
+    sockaddr_key(addr, key, &port);
+    memcpy(w, key, 16);
+    return hash_mix64(hash_mix64(w[0]) ^ w[1] ^ (with_port? port: 0));
+}
+
+#define usable(i)   health_usable(loop, s_upstreams[i].health)
+
+/*
+ * Nginx's smooth weighted round-robin, spreads heavy upstreams' turns
+ * out. Unusable upstreams sit their turns out.
+ */
+static int pick_round_robin(EV_P) {
+    size_t i;
+    int best = -1, total = 0;
+
+    for(i = 0; i < s_nupstreams; ++i) {
+        if(!usable(i))
+            continue;
+        s_upstreams[i].current += s_upstreams[i].weight;
+        total += s_upstreams[i].weight;
+        if(-1 == best || s_upstreams[i].current > s_upstreams[best].current)
+            best = (int)i;
+    }
+    if(-1 != best)
+        s_upstreams[best].current -= total;
+    return best;
+}
+
+/* a has fewer connections per unit of weight than b. */
+static inline int less_loaded(const Upstream *a, const Upstream *b) {
+    return (long)a->active * b->weight < (long)b->active * a->weight;
+}
+
+static int pick_least_conn(EV_P) {
+    size_t i, n = s_nupstreams;
+    int best = -1;
+
+    for(i = 0; i < n; ++i) {
+        int j = (int)((s_next + i) % n);
+        if(usable(j) && (-1 == best || less_loaded(&s_upstreams[j], &s_upstreams[best])) )
+            best = j;
+    }
+    s_next = best + 1;
+    return best;
+}
+
+static int pick_weighted_random(void) {
+    int r = (int)(rand64() % (uint64_t)s_total_weight);
+    size_t lo = 0, hi = s_nupstreams - 1;
+
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(s_cumulative[mid] > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return (int)lo;
+}
+
+/*
+ * Two weighted random candidates, the less loaded one wins. Draws that
+ * hit unusable upstreams are retried a few times before falling back to
+ * a full scan.
+ */
+static int pick_p2c(EV_P) {
+    int a = -1, b = -1, i, c;
+
+    for(i = 0; i < 8 && -1 == b; ++i) {
+        if(!usable(c = pick_weighted_random()))
+            continue;
+        if(-1 == a)
+            a = c;
+        else
+            b = c;
+    }
+    if(-1 == a)
+        return pick_least_conn(loop);
+    return -1 != b && less_loaded(&s_upstreams[b], &s_upstreams[a])? b: a;
+}
+
+/*
+ * Clients of an unusable upstream walk on through the table, which
+ * spreads them over the others while everyone else stays put.
+ */
+static int pick_maglev(EV_P_ const struct sockaddr *client) {
+    size_t slot = addr_hash(client, 0) % BALANCER_MAGLEV_SIZE, i;
+
+    for(i = 0; i < BALANCER_MAGLEV_SIZE; ++i, slot = (slot + 1) % BALANCER_MAGLEV_SIZE) {
+        if(usable(s_maglev[slot]))
+            return s_maglev[slot];
+    }
+    return -1;
+}
+
+static int pick_ring(EV_P_ const struct sockaddr *client) {
+    uint64_t h = addr_hash(client, 0);
+    size_t lo = 0, hi = s_npoints, i;
+
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(s_ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(i = 0; i < s_npoints; ++i, lo = lo + 1) {
+        if(lo >= s_npoints)
+            lo = 0;
+        if(usable(s_ring[lo].upstream))
+            return s_ring[lo].upstream;
+    }
+    return -1;
+}
+
+static int getdestination(EV_P_ int fd, struct sockaddr_storage *addr) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    int i;
+
+    switch(s_method) {
+        case BALANCE_ROUND_ROBIN:   i = pick_round_robin(loop);     break;
+        case BALANCE_LEAST_CONN:    i = pick_least_conn(loop);      break;
+        case BALANCE_P2C:           i = pick_p2c(loop);             break;
+        default:
+            if(-1 == getpeername(fd, (struct sockaddr*)&peer, &len))
+                return -1;
+            i = BALANCE_MAGLEV == s_method?
+                pick_maglev(loop, (struct sockaddr*)&peer): pick_ring(loop, (struct sockaddr*)&peer);
+    }
+    if(-1 == i) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    ++s_upstreams[i].active;
+    memcpy(addr, &s_upstreams[i].addr, sizeof(*addr));
+    return i;
+}
+
+static void release(int token) {
+    if(token >= 0 && (size_t)token < s_nupstreams && s_upstreams[token].active > 0)
+        --s_upstreams[token].active;
+}
+
+/*
+ * Fills the lookup table as in the Maglev paper: every upstream walks
+ * its own permutation of the slots and claims the next free one, as many
+ * times per round as its weight is to the largest weight.
+ */
+static int maglev_build(void) {
+    size_t n = s_nupstreams, i, filled = 0;
+    uint32_t offset[BALANCER_MAX_UPSTREAMS], skip[BALANCER_MAX_UPSTREAMS];
+    uint32_t next[BALANCER_MAX_UPSTREAMS];
+    int credit[BALANCER_MAX_UPSTREAMS];
+    int maxweight = 0;
+
+    if(NULL == (s_maglev = (uint16_t*)malloc(BALANCER_MAGLEV_SIZE * sizeof(uint16_t))) )
+        return -1;
+    memset(s_maglev, 0xff, BALANCER_MAGLEV_SIZE * sizeof(uint16_t));
+    for(i = 0; i < n; ++i) {
+        uint64_t h = addr_hash((struct sockaddr*)&s_upstreams[i].addr, 1);
+        offset[i] = (uint32_t)(h % BALANCER_MAGLEV_SIZE);
+        skip[i] = (uint32_t)((h >> 32) % (BALANCER_MAGLEV_SIZE - 1) + 1);
+        next[i] = 0;
+        credit[i] = 0;
+        if(s_upstreams[i].weight > maxweight)
+            maxweight = s_upstreams[i].weight;
+    }
+
+    for(;;) {
+        for(i = 0; i < n; ++i) {
+            for(credit[i] += s_upstreams[i].weight; credit[i] >= maxweight; credit[i] -= maxweight) {
+                uint32_t slot;
+                do {
+                    slot = (uint32_t)((offset[i] + (uint64_t)next[i]++ * skip[i]) % BALANCER_MAGLEV_SIZE);
+                } while(BALANCER_EMPTY != s_maglev[slot]);
+                s_maglev[slot] = (uint16_t)i;
+                if(BALANCER_MAGLEV_SIZE == ++filled)
+                    return 0;
+            }
+        }
+    }
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const RingPoint *pa = (const RingPoint*)a, *pb = (const RingPoint*)b;
+
+    return pa->hash < pb->hash? -1: pa->hash > pb->hash;
+}
+
+/* Each upstream gets points on the ring in proportion to its weight. */
+static int ring_build(void) {
+    size_t n = s_nupstreams, i, total = 0;
+    int j;
+
+    for(i = 0; i < n; ++i)
+        total += 1 + BALANCER_RING_POINTS * n * s_upstreams[i].weight / s_total_weight;
+    if(NULL == (s_ring = (RingPoint*)malloc(total * sizeof(RingPoint))) )
+        return -1;
+    for(i = 0; i < n; ++i) {
+        uint64_t h = addr_hash((struct sockaddr*)&s_upstreams[i].addr, 1);
+        int points = 1 + BALANCER_RING_POINTS * n * s_upstreams[i].weight / s_total_weight;
+        for(j = 0; j < points; ++j) {
+            s_ring[s_npoints].hash = hash_mix64(h + j);
+            s_ring[s_npoints++].upstream = (uint16_t)i;
+        }
+    }
+    qsort(s_ring, s_npoints, sizeof(RingPoint), point_cmp);
+    return 0;
+}
+
+int balancer_backend_register(const char name[]) {
+    size_t i;
+
+    if(NULL == name)
+        name = "balancer";
+    if(0 == s_nupstreams)
+        return -1;
+
+    for(s_total_weight = 0, i = 0; i < s_nupstreams; ++i) {
+        s_total_weight += s_upstreams[i].weight;
+        s_cumulative[i] = s_total_weight;
+        s_upstreams[i].health = health_track((struct sockaddr*)&s_upstreams[i].addr);
+    }
+    hash_seed(s_rand);
+    if((BALANCE_MAGLEV == s_method && -1 == maglev_build())
+            || (BALANCE_RING == s_method && -1 == ring_build())) {
+        syslog(LOG_ERR, "balancer: malloc: %m");
+        return -1;
+    }
+    syslog(LOG_INFO, "balancer: %zu upstreams, %s", s_nupstreams, s_methods[s_method]);
+    return backend_register(name, getdestination, release);
+}
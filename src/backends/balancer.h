@@ -0,0 +1,21 @@
+/*
+ * backends/balancer.h - layer-4 proxy load-balancing backend module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef BACKENDS_BALANCER_H
+#define BACKENDS_BALANCER_H
+
+#include <stddef.h>
+
+int balancer_add_upstream(const char *spec);
+int balancer_set_method(const char *name);
+size_t balancer_size(void);
+
+int balancer_backend_register(const char name[]);
+
+#endif  /*  BACKENDS_BALANCER_H */
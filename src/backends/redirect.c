@@ -8,13 +8,16 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <stddef.h>
 #include <netinet/in.h>
 
 #include <linux/netfilter_ipv4.h>
 
+#include <ev.h>
+
 #include "backend.h"
 
-static int getorigdest(int fd, struct sockaddr_storage *addr){
+static int getorigdest(EV_P_ int fd, struct sockaddr_storage *addr){
     socklen_t len = sizeof(*addr);
     return getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, addr, &len);
 }
@@ -22,5 +25,5 @@ static int getorigdest(int fd, struct sockaddr_storage *addr){
 int redirect_backend_register(const char name[]){
     if(NULL == name)
         name = "redirect";
-    return backend_register(name, getorigdest);
+    return backend_register(name, getorigdest, NULL);
 }
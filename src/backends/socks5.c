@@ -0,0 +1,394 @@
+/*
+ * backends/socks5.c - layer-4 proxy SOCKS5 front-end module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include "../utils.h"
+#include "../netutil.h"
+#include "../admission.h"
+#include "../resolver.h"
+#include "socks5.h"
+
+#define SOCKS5_VERSION          0x05
+#define SOCKS5_AUTH_VERSION     0x01
+#define SOCKS5_METHOD_NONE      0x00
+#define SOCKS5_METHOD_USERPASS  0x02
+#define SOCKS5_METHOD_REFUSED   0xff
+#define SOCKS5_CMD_CONNECT      0x01
+#define SOCKS5_ATYP_IPV4        0x01
+#define SOCKS5_ATYP_DOMAIN      0x03
+#define SOCKS5_ATYP_IPV6        0x04
+
+#define SOCKS5_MAX_MESSAGE      513     /*  username/password request   */
+#define SOCKS5_MAX_USERS        64
+
+enum { STATE_GREETING, STATE_AUTH, STATE_REQUEST };
+
+/*
+ * A client in the middle of the handshake. Exactly the bytes of the
+ * message expected next are read, so a client that sends data ahead of
+ * the reply leaves it queued in the socket for the relay.
+ */
+typedef struct {
+    ev_io                   io;
+    ev_timer                timer;
+    socks5RequestFn         done;
+    struct sockaddr_storage peer;
+    int                     state;
+    ResolverQuery           *query;     /*  while the domain is resolved    */
+    uint16_t                port;
+    size_t                  have;
+    unsigned char           buf[SOCKS5_MAX_MESSAGE];
+} Handshake;
+
+static char *s_users[SOCKS5_MAX_USERS];     /*  "USER:PASS"    */
+static size_t s_nusers;
+
+/* With users configured every client must authenticate as one of them. */
+int socks5_add_user(const char *userpass) {
+    const char *colon = strchr(userpass, ':');
+
+    if(NULL == colon || colon == userpass || colon - userpass > 255 || strlen(colon + 1) > 255)
+        return -1;
+    if(s_nusers == SOCKS5_MAX_USERS || NULL == (s_users[s_nusers] = strdup(userpass)) )
+        return -1;
+    ++s_nusers;
+    return 0;
+}
+
+static int user_valid(const unsigned char *user, size_t ulen, const unsigned char *pass, size_t plen) {
+    size_t i;
+
+    for(i = 0; i < s_nusers; ++i) {
+        const char *u = s_users[i];
+        if(ulen + 1 + plen == strlen(u) && ':' == u[ulen]
+                && 0 == memcmp(u, user, ulen) && 0 == memcmp(u + ulen + 1, pass, plen))
+            return 1;
+    }
+    return 0;
+}
+
+int socks5_reply_code(int err) {
+    switch(err) {
+        case ECONNREFUSED:  return SOCKS5_REP_CONNECTION_REFUSED;
+        case ENETUNREACH:   return SOCKS5_REP_NETWORK_UNREACHABLE;
+        case EHOSTUNREACH:  return SOCKS5_REP_HOST_UNREACHABLE;
+        case ETIMEDOUT:     return SOCKS5_REP_TTL_EXPIRED;
+        default:            return SOCKS5_REP_FAILURE;
+    }
+}
+
+/* A NULL bound address is sent as 0.0.0.0:0. */
+size_t socks5_build_reply(unsigned char *buf, int rep, const struct sockaddr *bound) {
+    buf[0] = SOCKS5_VERSION;
+    buf[1] = (unsigned char)rep;
+    buf[2] = 0;
+    if(bound && AF_INET6 == bound->sa_family) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)bound;
+        buf[3] = SOCKS5_ATYP_IPV6;
+        memcpy(buf + 4, &in6->sin6_addr, 16);
+        memcpy(buf + 20, &in6->sin6_port, 2);
+        return 22;
+    }
+    buf[3] = SOCKS5_ATYP_IPV4;
+    if(bound && AF_INET == bound->sa_family) {
+        const struct sockaddr_in *in = (const struct sockaddr_in*)bound;
+        memcpy(buf + 4, &in->sin_addr, 4);
+        memcpy(buf + 8, &in->sin_port, 2);
+    } else {
+        memset(buf + 4, 0, 6);
+    }
+    return 10;
+}
+
+/* For failures only, the connection is closed right after. */
+void socks5_send_reply(int fd, int rep, const struct sockaddr *bound) {
+    unsigned char buf[SOCKS5_MAX_REPLY];
+    size_t len = socks5_build_reply(buf, rep, bound);
+
+    if(-1 == send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT))
+        syslog(LOG_DEBUG, "socks5: send: %m");
+}
+
+/* Length of the message expected in state, as far as have bytes tell. */
+static ssize_t message_length(int state, const unsigned char *buf, size_t have) {
+    switch(state) {
+        case STATE_GREETING:
+            return have < 2? 2: 2 + buf[1];
+        case STATE_AUTH:
+            if(have < 2)
+                return 2;
+            if(have < 3 + (size_t)buf[1])
+                return 3 + buf[1];
+            return 3 + buf[1] + buf[2 + buf[1]];
+        case STATE_REQUEST:
+            if(have < 5)
+                return 5;
+            switch(buf[3]) {
+                case SOCKS5_ATYP_IPV4:      return 10;
+                case SOCKS5_ATYP_IPV6:      return 22;
+                case SOCKS5_ATYP_DOMAIN:    return 7 + buf[4];
+                default:                    return -1;
+            }
+        default:
+            return -1;
+    }
+}
+
+static void handshake_delete(EV_P_ Handshake *hs, int close_fd) {
+    if(hs->query)
+        resolver_cancel(hs->query);
+    ev_io_stop(loop, &hs->io);
+    ev_timer_stop(loop, &hs->timer);
+    if(close_fd) {
+        close_i(hs->io.fd);
+        admission_fd_closed(loop, 1);
+    }
+    free(hs);
+}
+
+static int send_all(int fd, const unsigned char *buf, size_t len) {
+    /*  the socket has sent nothing yet, a short reply always fits */
+    return (ssize_t)len == send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)? 0: -1;
+}
+
+static int on_greeting(Handshake *hs) {
+    unsigned char reply[2] = {SOCKS5_VERSION, SOCKS5_METHOD_REFUSED};
+    int want = s_nusers? SOCKS5_METHOD_USERPASS: SOCKS5_METHOD_NONE;
+    size_t i;
+
+    if(SOCKS5_VERSION != hs->buf[0])
+        return -1;
+    for(i = 0; i < hs->buf[1]; ++i) {
+        if(want == hs->buf[2 + i])
+            reply[1] = (unsigned char)want;
+    }
+    if(-1 == send_all(hs->io.fd, reply, sizeof(reply)) || SOCKS5_METHOD_REFUSED == reply[1])
+        return -1;
+    hs->state = SOCKS5_METHOD_USERPASS == want? STATE_AUTH: STATE_REQUEST;
+    return 0;
+}
+
+static int on_auth(Handshake *hs) {
+    unsigned char reply[2] = {SOCKS5_AUTH_VERSION, 0x01};
+    size_t ulen = hs->buf[1], plen = hs->buf[2 + ulen];
+    int ok = SOCKS5_AUTH_VERSION == hs->buf[0]
+        && user_valid(hs->buf + 2, ulen, hs->buf + 3 + ulen, plen);
+    char peer[SOCKADDR_STRLEN];
+
+    if(ok)
+        reply[1] = 0x00;
+    else
+        syslog(LOG_INFO, "socks5: authentication failed for %s",
+                sockaddr_ntop((struct sockaddr*)&hs->peer, peer, sizeof(peer)));
+    if(-1 == send_all(hs->io.fd, reply, sizeof(reply)) || !ok)
+        return -1;
+    hs->state = STATE_REQUEST;
+    return 0;
+}
+
+static void handshake_resolved(EV_P_ void *data, int status,
+        const struct sockaddr_storage *addrs, size_t naddrs);
+
+/*
+ * Fills dst from a CONNECT request. Returns 1 if the request names a
+ * domain, which is then resolved without holding up the loop.
+ */
+static int on_request(EV_P_ Handshake *hs, struct sockaddr_storage *dst) {
+    unsigned char *p = hs->buf + 4;
+    char name[256];
+    ResolverQuery *query;
+
+    if(SOCKS5_VERSION != hs->buf[0])
+        return -1;
+    if(SOCKS5_CMD_CONNECT != hs->buf[1]) {
+        socks5_send_reply(hs->io.fd, SOCKS5_REP_COMMAND_UNSUPPORTED, NULL);
+        return -1;
+    }
+
+    memset(dst, 0, sizeof(*dst));
+    struct sockaddr_in *in = (struct sockaddr_in*)dst;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6*)dst;
+    switch(hs->buf[3]) {
+        case SOCKS5_ATYP_IPV4:
+            in->sin_family = AF_INET;
+            memcpy(&in->sin_addr, p, 4);
+            memcpy(&in->sin_port, p + 4, 2);
+            return 0;
+        case SOCKS5_ATYP_IPV6:
+            in6->sin6_family = AF_INET6;
+            memcpy(&in6->sin6_addr, p, 16);
+            memcpy(&in6->sin6_port, p + 16, 2);
+            return 0;
+        case SOCKS5_ATYP_DOMAIN:
+            memcpy(name, p + 1, p[0]);
+            name[p[0]] = '\0';
+            if(1 == inet_pton(AF_INET, name, &in->sin_addr)) {
+                in->sin_family = AF_INET;
+                memcpy(&in->sin_port, p + 1 + p[0], 2);
+                return 0;
+            }
+            if(1 == inet_pton(AF_INET6, name, &in6->sin6_addr)) {
+                in6->sin6_family = AF_INET6;
+                memcpy(&in6->sin6_port, p + 1 + p[0], 2);
+                return 0;
+            }
+            /*  the handshake timer keeps running while resolving  */
+            memcpy(&hs->port, p + 1 + p[0], 2);
+            ev_io_stop(loop, &hs->io);
+            if(NULL != (query = resolver_resolve(loop, name, handshake_resolved, hs)) )
+                hs->query = query;  /*  otherwise answered and hs is gone   */
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+static void handshake_finish(EV_P_ Handshake *hs, const struct sockaddr_storage *dsts, size_t ndsts) {
+    int fd = hs->io.fd;
+    socks5RequestFn done = hs->done;
+    struct sockaddr_storage peer = hs->peer;
+
+    handshake_delete(loop, hs, 0);
+    (*done)(loop, fd, (struct sockaddr*)&peer, (struct sockaddr*)&dsts[0], dsts + 1, ndsts - 1);
+}
+
+/*
+ * Hands all addresses on, families interleaved as RFC 8305 section 4
+ * asks, starting with the resolver's first choice. The relay's ACL
+ * checks each of them as usual.
+ */
+static void handshake_resolved(EV_P_ void *data, int status,
+        const struct sockaddr_storage *addrs, size_t naddrs) {
+    Handshake *hs = (Handshake*)data;
+    struct sockaddr_storage dsts[RESOLVER_MAX_ADDRS];
+    size_t i, n, next[2] = {0, 0};
+    int family;
+    char peer[SOCKADDR_STRLEN];
+
+    hs->query = NULL;
+    if(0 == naddrs) {
+        syslog(LOG_INFO, "socks5: couldn't resolve the destination of %s",
+                sockaddr_ntop((struct sockaddr*)&hs->peer, peer, sizeof(peer)));
+        socks5_send_reply(hs->io.fd, RESOLVER_NOTFOUND == status?
+                SOCKS5_REP_HOST_UNREACHABLE: SOCKS5_REP_FAILURE, NULL);
+        handshake_delete(loop, hs, 1);
+        return;
+    }
+
+    for(n = 0, family = addrs[0].ss_family; n < naddrs; ++n) {
+        /*  the next address of the wanted family, or of any once it ran out */
+        int want = AF_INET == family;
+        for(i = next[want]; i < naddrs && (AF_INET == addrs[i].ss_family) != want; ++i)
+            ;
+        if(i == naddrs) {
+            want = !want;
+            for(i = next[want]; (AF_INET == addrs[i].ss_family) != want; ++i)
+                ;
+        }
+        next[want] = i + 1;
+        dsts[n] = addrs[i];
+        if(AF_INET == dsts[n].ss_family)
+            ((struct sockaddr_in*)&dsts[n])->sin_port = hs->port;
+        else
+            ((struct sockaddr_in6*)&dsts[n])->sin6_port = hs->port;
+        family = AF_INET == family? AF_INET6: AF_INET;
+    }
+    handshake_finish(loop, hs, dsts, naddrs);
+}
+
+static void handshake_read_callback(EV_P_ ev_io *watcher, int revents) {
+    Handshake *hs = (Handshake*)watcher;
+    struct sockaddr_storage dst;
+    ssize_t need, n;
+
+    for(;;) {
+        if(-1 == (need = message_length(hs->state, hs->buf, hs->have)) || need > SOCKS5_MAX_MESSAGE)
+            goto fail;
+        if(hs->have < (size_t)need) {
+            n = read(hs->io.fd, hs->buf + hs->have, need - hs->have);
+            if(-1 == n && (EAGAIN == errno || EWOULDBLOCK == errno))
+                return;
+            if(n <= 0)
+                goto fail;
+            hs->have += n;
+            continue;
+        }
+
+        switch(hs->state) {
+            case STATE_GREETING:
+                if(-1 == on_greeting(hs))
+                    goto fail;
+                break;
+            case STATE_AUTH:
+                if(-1 == on_auth(hs))
+                    goto fail;
+                break;
+            case STATE_REQUEST:
+                switch(on_request(loop, hs, &dst)) {
+                    case 0:
+                        handshake_finish(loop, hs, &dst, 1);
+                        return;
+                    case 1:
+                        return;     /*  hs may be gone already  */
+                    default:
+                        goto fail;
+                }
+        }
+        hs->have = 0;
+    }
+
+fail:
+    handshake_delete(loop, hs, 1);
+}
+
+static void handshake_timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    Handshake *hs = (Handshake*)watcher->data;
+    char peer[SOCKADDR_STRLEN];
+
+    syslog(LOG_INFO, "socks5: handshake with %s timed out",
+            sockaddr_ntop((struct sockaddr*)&hs->peer, peer, sizeof(peer)));
+    handshake_delete(loop, hs, 1);
+}
+
+/*
+ * Runs the method negotiation, the optional username/password
+ * subnegotiation (RFC 1929) and reads the request of a freshly accepted
+ * client, then hands it to done. Clients that take longer than timeout
+ * are closed.
+ */
+int socks5_handshake(EV_P_ int fd, const struct sockaddr *peer, ev_tstamp timeout, socks5RequestFn done) {
+    Handshake *hs = (Handshake*)malloc(sizeof(Handshake));
+    if(NULL == hs) {
+        syslog(LOG_ERR, "socks5: malloc: %m");
+        return -1;
+    }
+    hs->done = done;
+    hs->state = STATE_GREETING;
+    hs->query = NULL;
+    hs->have = 0;
+    memcpy(&hs->peer, peer, sockaddr_len(peer));
+
+    ev_io_init(&hs->io, handshake_read_callback, fd, EV_READ);
+    ev_timer_init(&hs->timer, handshake_timeout_callback, timeout, 0.);
+    hs->timer.data = hs;
+    ev_io_start(loop, &hs->io);
+    ev_timer_start(loop, &hs->timer);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * backends/socks5.h - layer-4 proxy SOCKS5 front-end module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef BACKENDS_SOCKS5_H
+#define BACKENDS_SOCKS5_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Reply codes, RFC 1928 section 6. */
+enum {
+    SOCKS5_REP_SUCCEEDED            = 0x00,
+    SOCKS5_REP_FAILURE              = 0x01,
+    SOCKS5_REP_NOT_ALLOWED          = 0x02,
+    SOCKS5_REP_NETWORK_UNREACHABLE  = 0x03,
+    SOCKS5_REP_HOST_UNREACHABLE     = 0x04,
+    SOCKS5_REP_CONNECTION_REFUSED   = 0x05,
+    SOCKS5_REP_TTL_EXPIRED          = 0x06,
+    SOCKS5_REP_COMMAND_UNSUPPORTED  = 0x07,
+    SOCKS5_REP_ATYP_UNSUPPORTED     = 0x08,
+};
+
+/* Longest reply, with an IPv6 bound address. */
+#define SOCKS5_MAX_REPLY    22
+
+/*
+ * Called once a client has asked to CONNECT to dst. A name with several
+ * addresses has the others in alts, in the order to try them. The relay
+ * sends the reply once the upstream connect has finished.
+ */
+typedef void (*socks5RequestFn)(EV_P_ int fd, const struct sockaddr *peer, const struct sockaddr *dst,
+        const struct sockaddr_storage *alts, size_t nalts);
+
+int socks5_add_user(const char *userpass);
+int socks5_handshake(EV_P_ int fd, const struct sockaddr *peer, ev_tstamp timeout, socks5RequestFn done);
+
+int socks5_reply_code(int err);
+size_t socks5_build_reply(unsigned char *buf, int rep, const struct sockaddr *bound);
+void socks5_send_reply(int fd, int rep, const struct sockaddr *bound);
+
+#endif  /*  BACKENDS_SOCKS5_H   */
@@ -0,0 +1,350 @@
+/*
+ * control.c - layer-4 proxy control socket module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "lpm.h"
+#include "admission.h"
+#include "httptunnel.h"
+#include "udprelay.h"
+#include "proxy.h"
+#include "control.h"
+
+#define CONTROL_IN_SIZE     256
+#define CONTROL_OUT_SIZE    16384
+#define CONTROL_LINE_MAX    256     /*  room kept for one more listed connection   */
+#define CONTROL_TIMEOUT     10.     /*  without progress, the client is dropped    */
+
+typedef struct control_client_t ControlClient;
+
+struct control_client_t {
+    ev_io           io;
+    ev_timer        timer;
+    char            in[CONTROL_IN_SIZE];
+    size_t          inlen;
+    char            out[CONTROL_OUT_SIZE];
+    size_t          outlen;
+    size_t          outpos;
+    int             listing;        /*  more lines to come  */
+    ProxyCursor     cursor;
+};
+
+typedef void (*controlCommandFn)(EV_P_ ControlClient *client, const char *arg);
+
+static ev_io s_listener;
+static int s_loglevel = LOG_DEBUG;
+static ev_tstamp s_drain_deadline;      /*  0 unless draining   */
+static size_t s_drain_conns;            /*  when it started     */
+
+static const char *s_levels[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+static void accept_callback(EV_P_ ev_io *watcher, int revents);
+static void read_callback(EV_P_ ev_io *watcher, int revents);
+static void write_callback(EV_P_ ev_io *watcher, int revents);
+static void timeout_callback(EV_P_ ev_timer *watcher, int revents);
+static void client_delete(EV_P_ ControlClient *client);
+
+static void cmd_list(EV_P_ ControlClient *client, const char *arg);
+static void cmd_kill(EV_P_ ControlClient *client, const char *arg);
+static void cmd_loglevel(EV_P_ ControlClient *client, const char *arg);
+static void cmd_stats(EV_P_ ControlClient *client, const char *arg);
+
+static const struct {
+    const char          *name;
+    controlCommandFn    fn;
+} s_commands[] = {
+    {"list",        cmd_list},
+    {"kill",        cmd_kill},
+    {"loglevel",    cmd_loglevel},
+    {"stats",       cmd_stats},
+};
+
+/* Takes over fd, a bound and listening Unix stream socket. */
+int control_start(EV_P_ int fd) {
+    ev_io_init(&s_listener, accept_callback, fd, EV_READ);
+    ev_io_start(loop, &s_listener);
+    return 0;
+}
+
+/* Clients already connected are still answered. */
+void control_stop(EV_P) {
+    if(!ev_is_active(&s_listener))
+        return;
+    ev_io_stop(loop, &s_listener);
+    close_i(s_listener.fd);
+}
+
+/* Shown by stats until the process exits. */
+void control_set_drain(ev_tstamp deadline) {
+    AdmissionStats stats;
+
+    admission_stats(&stats);
+    s_drain_deadline = deadline;
+    s_drain_conns = stats.conns;
+}
+
+static void accept_callback(EV_P_ ev_io *watcher, int revents) {
+    ControlClient *client;
+    int fd = accept4(watcher->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(-1 == fd) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno)
+            syslog(LOG_ERR, "control: accept4: %m");
+        return;
+    }
+    if(NULL == (client = (ControlClient*)malloc(sizeof(ControlClient))) ) {
+        syslog(LOG_ERR, "control: malloc failed");
+        close_i(fd);
+        return;
+    }
+    client->inlen = client->outlen = client->outpos = 0;
+    client->listing = 0;
+    ev_io_init(&client->io, read_callback, fd, EV_READ);
+    ev_io_start(loop, &client->io);
+    ev_init(&client->timer, timeout_callback);
+    client->timer.repeat = CONTROL_TIMEOUT;
+    client->timer.data = client;
+    ev_timer_again(loop, &client->timer);
+}
+
+static void client_delete(EV_P_ ControlClient *client) {
+    ev_io_stop(loop, &client->io);
+    ev_timer_stop(loop, &client->timer);
+    close_i(client->io.fd);
+    free(client);
+}
+
+static void timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    client_delete(loop, (ControlClient*)watcher->data);
+}
+
+static void out_printf(ControlClient *client, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(client->out + client->outlen, CONTROL_OUT_SIZE - client->outlen, fmt, ap);
+    va_end(ap);
+    if(n > 0)
+        client->outlen += (size_t)n < CONTROL_OUT_SIZE - client->outlen?
+            (size_t)n: CONTROL_OUT_SIZE - client->outlen - 1;
+}
+
+/* Runs the command once its line is complete, then answers it. */
+static void read_callback(EV_P_ ev_io *watcher, int revents) {
+    ControlClient *client = (ControlClient*)watcher;
+    char *line = client->in, *arg, *eol;
+    ssize_t n;
+    size_t i;
+
+    n = read(watcher->fd, client->in + client->inlen, CONTROL_IN_SIZE - 1 - client->inlen);
+    if(-1 == n) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            client_delete(loop, client);
+        return;
+    }
+    client->inlen += n;
+    client->in[client->inlen] = '\0';
+    if(NULL != (eol = strchr(line, '\n')) )
+        *eol = '\0';
+    else if(0 != n && CONTROL_IN_SIZE - 1 != client->inlen)
+        return;
+
+    line = line_strip(line);
+    arg = line + strcspn(line, " \t");
+    if('\0' != *arg)
+        *arg++ = '\0';
+    arg += strspn(arg, " \t");
+
+    for(i = 0; i < sizeof(s_commands) / sizeof(s_commands[0]); ++i) {
+        if(0 == strcmp(line, s_commands[i].name))
+            break;
+    }
+    if(sizeof(s_commands) / sizeof(s_commands[0]) == i)
+        out_printf(client, "unknown command, try list, kill, loglevel or stats\n");
+    else
+        (*s_commands[i].fn)(loop, client, arg);
+
+    ev_io_stop(loop, &client->io);
+    ev_io_init(&client->io, write_callback, client->io.fd, EV_WRITE);
+    ev_io_start(loop, &client->io);
+}
+
+/* Fills the buffer with as many listed connections as fit. */
+static void list_fill(EV_P_ ControlClient *client) {
+    ProxyContext *ctx;
+    ProxyInfo info;
+    char client_addr[64], remote_addr[64];
+
+    while(CONTROL_OUT_SIZE - client->outlen > CONTROL_LINE_MAX) {
+        if(NULL == (ctx = proxy_cursor_next(&client->cursor)) ) {
+            client->listing = 0;
+            return;
+        }
+        proxy_context_info(loop, ctx, &info);
+        if(AF_UNSPEC == info.client.ss_family)
+            strcpy(client_addr, "-");
+        else
+            sockaddr_ntop((struct sockaddr*)&info.client, client_addr, sizeof(client_addr));
+        if(AF_UNSPEC == info.remote.ss_family)
+            strcpy(remote_addr, "-");
+        else
+            sockaddr_ntop((struct sockaddr*)&info.remote, remote_addr, sizeof(remote_addr));
+        out_printf(client, "%llu %s %s up=%llu down=%llu buffered=%zu/%zu age=%.1f idle=%.1f\n",
+                (unsigned long long)info.id, client_addr, remote_addr,
+                (unsigned long long)info.bytes_up, (unsigned long long)info.bytes_down,
+                info.buffered_up, info.buffered_down, info.age, info.idle);
+    }
+}
+
+static void write_callback(EV_P_ ev_io *watcher, int revents) {
+    ControlClient *client = (ControlClient*)watcher;
+    ssize_t n;
+
+    if(client->outpos == client->outlen && client->listing) {
+        client->outpos = client->outlen = 0;
+        list_fill(loop, client);
+    }
+    if(client->outpos == client->outlen) {
+        client_delete(loop, client);
+        return;
+    }
+    if(-1 == (n = write(watcher->fd, client->out + client->outpos, client->outlen - client->outpos)) ) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            client_delete(loop, client);
+        return;
+    }
+    client->outpos += n;
+    ev_timer_again(loop, &client->timer);
+}
+
+/*
+ * Connections are listed a buffer at a time while the client reads, so
+ * a long list never has to be held in memory. "ID CLIENT REMOTE" come
+ * first, "-" stands for a side that isn't connected.
+ */
+static void cmd_list(EV_P_ ControlClient *client, const char *arg) {
+    proxy_cursor_open(&client->cursor);
+    client->listing = 1;
+    list_fill(loop, client);
+}
+
+/* IPv4 prefixes are matched v4-mapped, like sockaddr_key() stores them. */
+static int prefix_parse(const char *str, unsigned char key[16], unsigned int *plen) {
+    unsigned char addr[16];
+    int family;
+
+    if(-1 == lpm_parse_prefix(str, &family, addr, plen))
+        return -1;
+    if(AF_INET == family) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, addr, 4);
+        *plen += 96;
+    } else {
+        memcpy(key, addr, 16);
+    }
+    return 0;
+}
+
+static int prefix_match(const unsigned char key[16], unsigned int plen,
+        const struct sockaddr_storage *addr) {
+    unsigned char k[16];
+    unsigned int bytes = plen / 8, bits = plen % 8;
+
+    if(-1 == sockaddr_key((const struct sockaddr*)addr, k, NULL) || 0 != memcmp(k, key, bytes))
+        return 0;
+    return 0 == bits || 0 == ((k[bytes] ^ key[bytes]) & (0xff << (8 - bits)));
+}
+
+static void cmd_kill(EV_P_ ControlClient *client, const char *arg) {
+    ProxyCursor cursor;
+    ProxyContext *ctx;
+    ProxyInfo info;
+    unsigned char key[16];
+    unsigned int plen;
+    size_t killed = 0;
+    char *end;
+
+    if('\0' != *arg && '\0' == arg[strspn(arg, "0123456789")]) {
+        if(NULL == (ctx = proxy_context_find(strtoull(arg, &end, 10))) ) {
+            out_printf(client, "no connection %s\n", arg);
+            return;
+        }
+        proxy_context_kill(loop, ctx);
+        out_printf(client, "killed 1\n");
+        return;
+    }
+    if(-1 == prefix_parse(arg, key, &plen)) {
+        out_printf(client, "usage: kill ID|PREFIX\n");
+        return;
+    }
+
+    proxy_cursor_open(&cursor);
+    while(NULL != (ctx = proxy_cursor_next(&cursor)) ) {
+        proxy_context_info(loop, ctx, &info);
+        if(prefix_match(key, plen, &info.client) || prefix_match(key, plen, &info.remote)) {
+            proxy_context_kill(loop, ctx);
+            ++killed;
+        }
+    }
+    syslog(LOG_NOTICE, "control: killed %zu connections matching %s", killed, arg);
+    out_printf(client, "killed %zu\n", killed);
+}
+
+static void cmd_loglevel(EV_P_ ControlClient *client, const char *arg) {
+    int level;
+
+    if('\0' != *arg) {
+        for(level = 0; level <= LOG_DEBUG && 0 != strcmp(arg, s_levels[level]); ++level)
+            ;
+        if(level > LOG_DEBUG) {
+            out_printf(client, "usage: loglevel [emerg|alert|crit|err|warning|notice|info|debug]\n");
+            return;
+        }
+        s_loglevel = level;
+        setlogmask(LOG_UPTO(level));
+        syslog(LOG_NOTICE, "control: log level %s", s_levels[level]);
+    }
+    out_printf(client, "%s\n", s_levels[s_loglevel]);
+}
+
+static void cmd_stats(EV_P_ ControlClient *client, const char *arg) {
+    AdmissionStats stats;
+
+    admission_stats(&stats);
+    out_printf(client, "connections %zu\n", stats.conns);
+    out_printf(client, "opened %zu\n", stats.opened);
+    out_printf(client, "fds %zu\n", stats.fds);
+    out_printf(client, "buffer_bytes %zu\n", stats.bufmem);
+    out_printf(client, "paused %d\n", stats.paused);
+    out_printf(client, "pooled_tunnels %zu\n", httptunnel_pool_fds());
+    out_printf(client, "udp_flows %zu\n", udp_relay_flows());
+    out_printf(client, "draining %d\n", 0 != s_drain_deadline);
+    if(0 != s_drain_deadline) {
+        out_printf(client, "drain_connections_at_start %zu\n", s_drain_conns);
+        out_printf(client, "drain_seconds_left %.1f\n", s_drain_deadline > ev_now(loop)?
+                s_drain_deadline - ev_now(loop): 0.);
+    }
+}
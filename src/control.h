@@ -0,0 +1,26 @@
+/*
+ * control.h - layer-4 proxy control socket module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/*
+ * A Unix stream socket taking one command per connection, answered
+ * before the connection is closed:
+ *
+ *   list                   one line per connection
+ *   kill ID|PREFIX         connections by id, or by client or remote address
+ *   loglevel [LEVEL]       show or set the syslog level, "debug" to "emerg"
+ *   stats                  counters, one "name value" per line
+ */
+int control_start(EV_P_ int fd);
+void control_stop(EV_P);
+void control_set_drain(ev_tstamp deadline);
+
+#endif  /*  CONTROL_H   */
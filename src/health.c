@@ -0,0 +1,375 @@
+/*
+ * health.c - layer-4 proxy destination health checking module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "health.h"
+
+#define HEALTH_DEFAULT_SLOTS    4096
+#define HEALTH_MAX_PROBE        16
+#define HEALTH_MAX_CHECKS       64
+
+/*
+ * One slot per destination address and port. Like source slots, a slot
+ * that is idle - nothing in flight, no failures, not ejected and not
+ * pinned by a check or an upstream - may be taken over by another
+ * destination, and slots never become empty again.
+ */
+typedef struct {
+    unsigned char   addr[16];
+    uint16_t        port;
+    uint8_t         used;
+    uint8_t         pinned;
+    uint8_t         down;           /*  failed its active check */
+    uint32_t        pending;        /*  connects in flight      */
+    uint32_t        failures;       /*  in a row                */
+    uint32_t        ejections;      /*  in a row                */
+    ev_tstamp       ejected_until;
+} HealthSlot;
+
+/* An active check, a TCP connect to the destination every interval. */
+typedef struct {
+    ev_timer                timer;
+    ev_io                   io;
+    int                     slot;
+    struct sockaddr_storage addr;
+    ev_tstamp               interval;
+    ev_tstamp               timeout;
+    int                     rise;
+    int                     fall;
+    int                     successes;
+    int                     failures;
+} HealthCheck;
+
+static HealthConfig s_config;
+static HealthSlot *s_slots;
+static size_t s_mask;
+static uint64_t s_seed[2];
+static HealthCheck *s_checks[HEALTH_MAX_CHECKS];
+static size_t s_nchecks;
+
+static inline size_t slot_hash(const unsigned char addr[16], uint16_t port) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr, 8);
+    memcpy(&lo, addr + 8, 8);
+    return (size_t)hash_mix64(hash_mix64(hi ^ s_seed[0]) ^ lo ^ port ^ s_seed[1]);
+}
+
+static const char *slot_ntop(const HealthSlot *slot, char *buf, size_t size) {
+    struct sockaddr_in6 in6;
+
+    memset(&in6, 0, sizeof(in6));
+    in6.sin6_family = AF_INET6;
+    in6.sin6_port = slot->port;
+    memcpy(&in6.sin6_addr, slot->addr, 16);
+    if(IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr)) {
+        struct sockaddr_storage ss;
+        memcpy(&ss, &in6, sizeof(in6));
+        sockaddr_unmap(&ss);
+        return sockaddr_ntop((struct sockaddr*)&ss, buf, size);
+    }
+    return sockaddr_ntop((struct sockaddr*)&in6, buf, size);
+}
+
+static int slot_idle(const HealthSlot *slot, ev_tstamp now) {
+    return !slot->pinned && 0 == slot->pending && 0 == slot->failures
+        && slot->ejected_until <= now;
+}
+
+void health_config_default(HealthConfig *config) {
+    memset(config, 0, sizeof(HealthConfig));
+    config->eject_time = 10.;
+    config->max_eject_time = 300.;
+    config->slots = HEALTH_DEFAULT_SLOTS;
+}
+
+/* "HOST:PORT [interval=SECONDS] [timeout=SECONDS] [rise=N] [fall=N]" */
+int health_add_check(const char *spec) {
+    HealthCheck *check;
+    char buf[512], *hostport, *option, *save, *end;
+
+    if(HEALTH_MAX_CHECKS == s_nchecks || strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf, spec);
+    if(NULL == (check = (HealthCheck*)calloc(1, sizeof(HealthCheck))) )
+        return -1;
+    check->interval = 5.;
+    check->timeout = 2.;
+    check->rise = 2;
+    check->fall = 3;
+
+    if(NULL == (hostport = strtok_r(buf, " \t", &save))
+            || -1 == sockaddr_resolve(hostport, SOCK_STREAM, &check->addr))
+        goto fail;
+    while(NULL != (option = strtok_r(NULL, " \t", &save)) ) {
+        char *value = strchr(option, '=');
+        if(NULL == value)
+            goto fail;
+        *value++ = '\0';
+        if(0 == strcmp(option, "interval")) {
+            check->interval = strtod(value, &end);
+        } else if(0 == strcmp(option, "timeout")) {
+            check->timeout = strtod(value, &end);
+        } else if(0 == strcmp(option, "rise")) {
+            check->rise = (int)strtol(value, &end, 10);
+        } else if(0 == strcmp(option, "fall")) {
+            check->fall = (int)strtol(value, &end, 10);
+        } else {
+            goto fail;
+        }
+        if(end == value || '\0' != *end)
+            goto fail;
+    }
+    if(check->interval <= 0 || check->timeout <= 0 || check->rise < 1 || check->fall < 1)
+        goto fail;
+
+    s_checks[s_nchecks++] = check;
+    return 0;
+
+fail:
+    free(check);
+    return -1;
+}
+
+/*
+ * Finds the slot of addr, or takes over the first idle one within the
+ * probe window. Returns NULL if the window is full of busy slots.
+ */
+static HealthSlot *slot_get(const struct sockaddr *addr, ev_tstamp now) {
+    unsigned char key[16];
+    uint16_t port;
+    HealthSlot *reuse = NULL;
+    size_t i, pos;
+
+    if(-1 == sockaddr_key(addr, key, &port))
+        return NULL;
+
+    pos = slot_hash(key, port) & s_mask;
+    for(i = 0; i < HEALTH_MAX_PROBE; ++i, pos = (pos + 1) & s_mask) {
+        HealthSlot *cur = &s_slots[pos];
+        if(cur->used && cur->port == port && 0 == memcmp(cur->addr, key, 16))
+            return cur;
+        if(NULL == reuse && (!cur->used || slot_idle(cur, now)) )
+            reuse = cur;
+        if(!cur->used)
+            break;
+    }
+    if(NULL == reuse)
+        return NULL;
+
+    memset(reuse, 0, sizeof(HealthSlot));
+    memcpy(reuse->addr, key, 16);
+    reuse->port = port;
+    reuse->used = 1;
+    return reuse;
+}
+
+int health_init(const HealthConfig *config) {
+    size_t i, size = 1;
+
+    s_config = *config;
+    if(0 == s_config.eject_after && 0 == s_nchecks)
+        return 0;
+
+    while(size < s_config.slots)
+        size <<= 1;
+    if(NULL == (s_slots = (HealthSlot*)calloc(size, sizeof(HealthSlot))) ) {
+        syslog(LOG_ERR, "health: calloc: %m");
+        return -1;
+    }
+    s_mask = size - 1;
+    hash_seed(s_seed);
+
+    for(i = 0; i < s_nchecks; ++i) {
+        if(HEALTH_NONE == (s_checks[i]->slot = health_track((struct sockaddr*)&s_checks[i]->addr)) ) {
+            syslog(LOG_ERR, "health: no slot for a check");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pins the slot of addr, for destinations that are looked at often,
+ * like checked ones and balancer upstreams.
+ */
+int health_track(const struct sockaddr *addr) {
+    HealthSlot *slot;
+
+    if(NULL == s_slots || NULL == (slot = slot_get(addr, 0.)) )
+        return HEALTH_NONE;
+    slot->pinned = 1;
+    return (int)(slot - s_slots);
+}
+
+int health_usable(EV_P_ int slot) {
+    if(HEALTH_NONE == slot)
+        return 1;
+    return !s_slots[slot].down && s_slots[slot].ejected_until <= ev_now(loop);
+}
+
+/*
+ * Returns -1 if connecting to addr is pointless right now. Otherwise
+ * the connect is counted in flight, and its outcome goes to
+ * health_report() or, if it never finishes, health_release().
+ */
+int health_acquire(EV_P_ const struct sockaddr *addr, int *slot) {
+    HealthSlot *found;
+
+    *slot = HEALTH_NONE;
+    if(NULL == s_slots || NULL == (found = slot_get(addr, ev_now(loop))) )
+        return 0;
+    if(!health_usable(loop, (int)(found - s_slots)))
+        return -1;
+    ++found->pending;
+    *slot = (int)(found - s_slots);
+    return 0;
+}
+
+void health_release(int slot) {
+    if(HEALTH_NONE != slot && s_slots[slot].pending)
+        --s_slots[slot].pending;
+}
+
+static void eject(EV_P_ HealthSlot *slot) {
+    ev_tstamp t = s_config.eject_time;
+    uint32_t i;
+    char addr[SOCKADDR_STRLEN];
+
+    for(i = 0; i < slot->ejections && t < s_config.max_eject_time; ++i)
+        t *= 2;
+    if(t > s_config.max_eject_time)
+        t = s_config.max_eject_time;
+    slot->ejected_until = ev_now(loop) + t;
+    ++slot->ejections;
+    /*  one more failure after the ejection ejects it again  */
+    slot->failures = s_config.eject_after - 1;
+    syslog(LOG_NOTICE, "health: %s ejected for %.0fs after %d failed connects",
+            slot_ntop(slot, addr, sizeof(addr)), t, s_config.eject_after);
+}
+
+/*
+ * Passive outlier detection: eject_after connect failures in a row
+ * eject a destination. Failures of connects that were already in flight
+ * while it is ejected don't count again.
+ */
+void health_report(EV_P_ int slot, int ok) {
+    HealthSlot *s;
+    char addr[SOCKADDR_STRLEN];
+
+    if(HEALTH_NONE == slot)
+        return;
+    s = &s_slots[slot];
+    health_release(slot);
+    if(ok) {
+        if(s->ejections)
+            syslog(LOG_NOTICE, "health: %s is back", slot_ntop(s, addr, sizeof(addr)));
+        s->failures = 0;
+        s->ejections = 0;
+    } else if(s_config.eject_after && s->ejected_until <= ev_now(loop)
+            && ++s->failures >= (uint32_t)s_config.eject_after) {
+        eject(loop, s);
+    }
+}
+
+static void check_result(EV_P_ HealthCheck *check, int ok) {
+    HealthSlot *slot = &s_slots[check->slot];
+    char addr[SOCKADDR_STRLEN];
+
+    if(ok) {
+        check->failures = 0;
+        slot->failures = 0;
+        slot->ejections = 0;
+        slot->ejected_until = 0.;
+        if(slot->down && ++check->successes >= check->rise) {
+            slot->down = 0;
+            syslog(LOG_NOTICE, "health: %s is up", slot_ntop(slot, addr, sizeof(addr)));
+        }
+    } else {
+        check->successes = 0;
+        if(!slot->down && ++check->failures >= check->fall) {
+            slot->down = 1;
+            syslog(LOG_NOTICE, "health: %s is down", slot_ntop(slot, addr, sizeof(addr)));
+        }
+    }
+}
+
+static void probe_done(EV_P_ HealthCheck *check, int ok) {
+    ev_io_stop(loop, &check->io);
+    close_i(check->io.fd);
+    check_result(loop, check, ok);
+    ev_timer_set(&check->timer, check->interval, 0.);
+    ev_timer_start(loop, &check->timer);
+}
+
+static void probe_callback(EV_P_ ev_io *watcher, int revents) {
+    HealthCheck *check = (HealthCheck*)watcher->data;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if(-1 == getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &err, &errlen))
+        err = errno;
+    ev_timer_stop(loop, &check->timer);
+    probe_done(loop, check, 0 == err);
+}
+
+/* Starts a probe, or fails it if it is still running at its timeout. */
+static void check_timer_callback(EV_P_ ev_timer *watcher, int revents) {
+    HealthCheck *check = (HealthCheck*)watcher->data;
+    const struct sockaddr *addr = (struct sockaddr*)&check->addr;
+    int fd;
+
+    if(ev_is_active(&check->io)) {
+        probe_done(loop, check, 0);
+        return;
+    }
+
+    if(-1 == (fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) ) {
+        syslog(LOG_ERR, "health: socket: %m");
+        ev_timer_set(&check->timer, check->interval, 0.);
+        ev_timer_start(loop, &check->timer);
+        return;
+    }
+    if(-1 == connect(fd, addr, sockaddr_len(addr)) && EINPROGRESS != errno) {
+        close_i(fd);
+        check_result(loop, check, 0);
+        ev_timer_set(&check->timer, check->interval, 0.);
+        ev_timer_start(loop, &check->timer);
+        return;
+    }
+    ev_io_set(&check->io, fd, EV_WRITE);
+    ev_io_start(loop, &check->io);
+    ev_timer_set(&check->timer, check->timeout, 0.);
+    ev_timer_start(loop, &check->timer);
+}
+
+/* Checks run right away, then every interval. */
+void health_start(EV_P) {
+    size_t i;
+
+    for(i = 0; i < s_nchecks; ++i) {
+        HealthCheck *check = s_checks[i];
+        ev_init(&check->io, probe_callback);
+        check->io.data = check;
+        ev_timer_init(&check->timer, check_timer_callback, 0., 0.);
+        check->timer.data = check;
+        ev_timer_start(loop, &check->timer);
+    }
+}
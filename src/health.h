@@ -0,0 +1,39 @@
+/*
+ * health.h - layer-4 proxy destination health checking module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* For destinations that are not tracked. */
+#define HEALTH_NONE     (-1)
+
+typedef struct {
+    int             eject_after;    /*  consecutive connect failures, 0 = no passive tracking   */
+    ev_tstamp       eject_time;     /*  first ejection, doubled for each one in a row           */
+    ev_tstamp       max_eject_time;
+    size_t          slots;          /*  destinations tracked, rounded up to a power of 2        */
+} HealthConfig;
+
+void health_config_default(HealthConfig *config);
+int health_add_check(const char *spec);
+int health_init(const HealthConfig *config);
+void health_start(EV_P);
+
+int health_track(const struct sockaddr *addr);
+int health_usable(EV_P_ int slot);
+
+int health_acquire(EV_P_ const struct sockaddr *addr, int *slot);
+void health_report(EV_P_ int slot, int ok);
+void health_release(int slot);
+
+#endif  /*  HEALTH_H    */
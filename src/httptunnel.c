@@ -0,0 +1,357 @@
+/*
+ * httptunnel.c - layer-4 proxy HTTP CONNECT upstream module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "admission.h"
+#include "health.h"
+#include "httptunnel.h"
+
+#define HTTPTUNNEL_POOL_MAX     16      /*  ready tunnels per key           */
+#define HTTPTUNNEL_POOL_IDLE    15.     /*  seconds a ready tunnel is kept  */
+#define HTTPTUNNEL_POOL_BUCKETS 256
+#define HTTPTUNNEL_TIMEOUT      10.     /*  for a pooled tunnel's handshake */
+
+typedef struct tunnel_pool_t TunnelPool;
+
+struct tunnel_pool_t {
+    TunnelPool              *next;
+    struct sockaddr_storage proxy;
+    struct sockaddr_storage dst;
+    int                     ready[HTTPTUNNEL_POOL_MAX];
+    ev_tstamp               since[HTTPTUNNEL_POOL_MAX];
+    int                     nready;
+    int                     pending;
+    ev_tstamp               last_used;
+};
+
+/* A pooled tunnel still connecting or waiting for its response. */
+typedef struct {
+    ev_io                   io;
+    ev_timer                timer;
+    TunnelPool              *pool;
+    int                     health;     /*  slot of the proxy until connected  */
+    size_t                  have;
+    unsigned char           buf[HTTPTUNNEL_MAX_RESPONSE];
+} PendingTunnel;
+
+static TunnelPool *s_pools[HTTPTUNNEL_POOL_BUCKETS];
+static size_t s_nfds;               /*  ready and pending tunnels   */
+static uint64_t s_seed[2];
+static ev_timer s_sweep;
+
+/* "CONNECT HOST:PORT HTTP/1.1", with IPv6 hosts in brackets. */
+ssize_t httptunnel_build_request(const struct sockaddr *dst, char *buf, size_t size) {
+    struct sockaddr_storage addr;
+    char hostport[SOCKADDR_STRLEN];
+    int len;
+
+    memcpy(&addr, dst, sockaddr_len(dst));
+    sockaddr_unmap(&addr);
+    sockaddr_ntop((struct sockaddr*)&addr, hostport, sizeof(hostport));
+    len = snprintf(buf, size, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", hostport, hostport);
+    return len < 0 || (size_t)len >= size? -1: len;
+}
+
+/*
+ * Returns the length of the response header once buf holds all of it,
+ * 0 while it is incomplete and -1 if it isn't HTTP. Bytes after the
+ * header already belong to the tunnel.
+ */
+ssize_t httptunnel_parse_response(const unsigned char *buf, size_t len, int *status) {
+    const unsigned char *end;
+    size_t i;
+
+    if(0 != memcmp(buf, "HTTP/", len < 5? len: 5))
+        return -1;
+    for(end = NULL, i = 3; i < len; ++i) {
+        if('\n' == buf[i] && '\r' == buf[i - 1] && '\n' == buf[i - 2] && '\r' == buf[i - 3]) {
+            end = buf + i + 1;
+            break;
+        }
+    }
+    if(NULL == end)
+        return len >= HTTPTUNNEL_MAX_RESPONSE? -1: 0;
+
+    /*  "HTTP/1.1 200 Connection established"   */
+    const unsigned char *p = memchr(buf, ' ', end - buf);
+    if(NULL == p || end - p < 4 || p[1] < '1' || p[1] > '5'
+            || p[2] < '0' || p[2] > '9' || p[3] < '0' || p[3] > '9')
+        return -1;
+    *status = (p[1] - '0') * 100 + (p[2] - '0') * 10 + (p[3] - '0');
+    return end - buf;
+}
+
+static inline size_t pool_hash(const struct sockaddr *proxy, const struct sockaddr *dst) {
+    unsigned char a[16] = {0}, b[16] = {0};
+    uint16_t pa = 0, pb = 0;
+    uint64_t w[4];
+
+    sockaddr_key(proxy, a, &pa);
+    sockaddr_key(dst, b, &pb);
+    memcpy(w, a, 16);
+    memcpy(w + 2, b, 16);
+    uint64_t h = hash_mix64(w[0] ^ s_seed[0]);
+    h = hash_mix64(h ^ w[1]);
+    h = hash_mix64(h ^ w[2]);
+    h = hash_mix64(h ^ w[3] ^ s_seed[1]);
+    return (size_t)hash_mix64(h ^ ((uint64_t)pa << 16 | pb)) % HTTPTUNNEL_POOL_BUCKETS;
+}
+
+static int same_addr(const struct sockaddr *a, const struct sockaddr_storage *b) {
+    unsigned char ka[16], kb[16];
+    uint16_t pa, pb;
+
+    return 0 == sockaddr_key(a, ka, &pa) && 0 == sockaddr_key((const struct sockaddr*)b, kb, &pb)
+        && pa == pb && 0 == memcmp(ka, kb, 16);
+}
+
+static TunnelPool *pool_find(const struct sockaddr *proxy, const struct sockaddr *dst) {
+    TunnelPool *pool = s_pools[pool_hash(proxy, dst)];
+
+    while(pool && !(same_addr(proxy, &pool->proxy) && same_addr(dst, &pool->dst)))
+        pool = pool->next;
+    return pool;
+}
+
+static void close_tunnel(EV_P_ int fd) {
+    --s_nfds;
+    close_i(fd);
+    admission_fd_closed(loop, 1);
+}
+
+/* Drops ready tunnels nobody took in time, and pools nobody uses. */
+static void sweep_callback(EV_P_ ev_timer *watcher, int revents) {
+    ev_tstamp now = ev_now(loop);
+    size_t bucket;
+    int i, j;
+
+    for(bucket = 0; bucket < HTTPTUNNEL_POOL_BUCKETS; ++bucket) {
+        TunnelPool **pp = &s_pools[bucket];
+        while(*pp) {
+            TunnelPool *pool = *pp;
+            for(i = 0, j = 0; i < pool->nready; ++i) {
+                if(now - pool->since[i] >= HTTPTUNNEL_POOL_IDLE) {
+                    close_tunnel(loop, pool->ready[i]);
+                } else {
+                    pool->ready[j] = pool->ready[i];
+                    pool->since[j++] = pool->since[i];
+                }
+            }
+            pool->nready = j;
+            if(0 == pool->nready && 0 == pool->pending
+                    && now - pool->last_used >= HTTPTUNNEL_POOL_IDLE) {
+                *pp = pool->next;
+                free(pool);
+            } else {
+                pp = &pool->next;
+            }
+        }
+    }
+}
+
+/*
+ * Takes the most recently handshaken tunnel, skipping those the proxy
+ * has closed meanwhile. Returns -1 if there is none.
+ */
+int httptunnel_pool_get(EV_P_ const struct sockaddr *proxy, const struct sockaddr *dst) {
+    TunnelPool *pool = pool_find(proxy, dst);
+    char c;
+    ssize_t n;
+
+    if(NULL == pool)
+        return -1;
+    pool->last_used = ev_now(loop);
+    while(pool->nready) {
+        int fd = pool->ready[--pool->nready];
+        n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(0 == n || (-1 == n && EAGAIN != errno && EWOULDBLOCK != errno)) {
+            close_tunnel(loop, fd);
+            continue;
+        }
+        --s_nfds;
+        return fd;
+    }
+    return -1;
+}
+
+static void pending_delete(EV_P_ PendingTunnel *pt, int keep) {
+    TunnelPool *pool = pt->pool;
+
+    ev_io_stop(loop, &pt->io);
+    ev_timer_stop(loop, &pt->timer);
+    health_release(pt->health);
+    --pool->pending;
+    if(keep && pool->nready < HTTPTUNNEL_POOL_MAX) {
+        pool->since[pool->nready] = ev_now(loop);
+        pool->ready[pool->nready++] = pt->io.fd;
+    } else {
+        close_tunnel(loop, pt->io.fd);
+    }
+    free(pt);
+}
+
+static void pending_read_callback(EV_P_ ev_io *watcher, int revents) {
+    PendingTunnel *pt = (PendingTunnel*)watcher;
+    ssize_t n, len;
+    int status;
+
+    n = recv(pt->io.fd, pt->buf + pt->have, sizeof(pt->buf) - pt->have, MSG_PEEK);
+    if(-1 == n && (EAGAIN == errno || EWOULDBLOCK == errno))
+        return;
+    if(n <= 0) {
+        pending_delete(loop, pt, 0);
+        return;
+    }
+
+    /*  consume the header only, what follows is the tunnel's   */
+    len = httptunnel_parse_response(pt->buf, pt->have + n, &status);
+    if(-1 == len || -1 == read(pt->io.fd, pt->buf + pt->have, len? len - pt->have: (size_t)n)) {
+        pending_delete(loop, pt, 0);
+        return;
+    }
+    if(0 == len) {
+        pt->have += n;
+        return;
+    }
+    if(status / 100 != 2)
+        syslog(LOG_INFO, "httptunnel: pooled CONNECT refused with %d", status);
+    pending_delete(loop, pt, 2 == status / 100);
+}
+
+static void pending_connect_callback(EV_P_ ev_io *watcher, int revents) {
+    PendingTunnel *pt = (PendingTunnel*)watcher;
+    char request[HTTPTUNNEL_MAX_REQUEST];
+    ssize_t len;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if(-1 == getsockopt(pt->io.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+        syslog(LOG_INFO, "httptunnel: connect: %s", strerror(err? err: errno));
+        health_report(loop, pt->health, 0);
+        pt->health = HEALTH_NONE;
+        pending_delete(loop, pt, 0);
+        return;
+    }
+    health_report(loop, pt->health, 1);
+    pt->health = HEALTH_NONE;
+    len = httptunnel_build_request((struct sockaddr*)&pt->pool->dst, request, sizeof(request));
+    if(-1 == len || len != send(pt->io.fd, request, len, MSG_NOSIGNAL)) {
+        pending_delete(loop, pt, 0);
+        return;
+    }
+    ev_io_stop(loop, &pt->io);
+    ev_io_set(&pt->io, pt->io.fd, EV_READ);
+    ev_set_cb(&pt->io, pending_read_callback);
+    ev_io_start(loop, &pt->io);
+}
+
+static void pending_timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    PendingTunnel *pt = (PendingTunnel*)watcher->data;
+
+    syslog(LOG_INFO, "httptunnel: pooled CONNECT timed out");
+    health_report(loop, pt->health, 0);
+    pt->health = HEALTH_NONE;
+    pending_delete(loop, pt, 0);
+}
+
+/*
+ * Connects one more tunnel the way a client's connect through the proxy
+ * would be, profile and health included. Returns -1 to stop filling.
+ */
+static int pending_start(EV_P_ TunnelPool *pool, Profile *profile) {
+    PendingTunnel *pt;
+    int fd, health;
+
+    if(-1 == health_acquire(loop, (struct sockaddr*)&pool->proxy, &health))
+        return -1;
+    if(-1 == (fd = socket(pool->proxy.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) ) {
+        syslog(LOG_ERR, "httptunnel: socket: %m");
+        health_release(health);
+        return -1;
+    }
+    profile_apply_sockopts(profile, fd, pool->proxy.ss_family);
+    if(-1 == connect(fd, (struct sockaddr*)&pool->proxy, sockaddr_len((struct sockaddr*)&pool->proxy))
+            && EINPROGRESS != errno) {
+        syslog(LOG_INFO, "httptunnel: connect: %m");
+        health_report(loop, health, 0);
+        close_i(fd);
+        return -1;
+    }
+    if(NULL == (pt = (PendingTunnel*)malloc(sizeof(PendingTunnel))) ) {
+        health_release(health);
+        close_i(fd);
+        return -1;
+    }
+    admission_fd_opened(loop, 1);
+    ++s_nfds;
+    pt->pool = pool;
+    pt->health = health;
+    pt->have = 0;
+    ++pool->pending;
+
+    ev_io_init(&pt->io, pending_connect_callback, fd, EV_WRITE);
+    ev_timer_init(&pt->timer, pending_timeout_callback, HTTPTUNNEL_TIMEOUT, 0.);
+    pt->timer.data = pt;
+    ev_io_start(loop, &pt->io);
+    ev_timer_start(loop, &pt->timer);
+    return 0;
+}
+
+/* Starts enough handshakes to have the profile's pool size ready, at most 16. */
+void httptunnel_pool_fill(EV_P_ Profile *profile, const struct sockaddr *dst) {
+    const struct sockaddr *proxy = (struct sockaddr*)&profile->http_proxy;
+    int size = profile->http_proxy_pool;
+    TunnelPool *pool;
+
+    if(size > HTTPTUNNEL_POOL_MAX)
+        size = HTTPTUNNEL_POOL_MAX;
+    if(admission_overloaded())
+        return;
+
+    if(NULL == (pool = pool_find(proxy, dst)) ) {
+        if(!ev_is_active(&s_sweep)) {
+            hash_seed(s_seed);
+            ev_timer_init(&s_sweep, sweep_callback, HTTPTUNNEL_POOL_IDLE / 3, HTTPTUNNEL_POOL_IDLE / 3);
+            ev_timer_start(loop, &s_sweep);
+        }
+        if(NULL == (pool = (TunnelPool*)calloc(1, sizeof(TunnelPool))) ) {
+            syslog(LOG_ERR, "httptunnel: calloc: %m");
+            return;
+        }
+        memcpy(&pool->proxy, proxy, sockaddr_len(proxy));
+        memcpy(&pool->dst, dst, sockaddr_len(dst));
+        size_t bucket = pool_hash(proxy, dst);
+        pool->next = s_pools[bucket];
+        s_pools[bucket] = pool;
+    }
+    pool->last_used = ev_now(loop);
+
+    while(pool->nready + pool->pending < size) {
+        if(-1 == pending_start(loop, pool, profile))
+            break;
+    }
+}
+
+/* Descriptors held by pools, counted by admission like any others. */
+size_t httptunnel_pool_fds(void) {
+    return s_nfds;
+}
@@ -0,0 +1,35 @@
+/*
+ * httptunnel.h - layer-4 proxy HTTP CONNECT upstream module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef HTTPTUNNEL_H
+#define HTTPTUNNEL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "profile.h"
+
+/* Longest CONNECT response header accepted from an egress proxy. */
+#define HTTPTUNNEL_MAX_RESPONSE     1024
+#define HTTPTUNNEL_MAX_REQUEST      256
+
+ssize_t httptunnel_build_request(const struct sockaddr *dst, char *buf, size_t size);
+ssize_t httptunnel_parse_response(const unsigned char *buf, size_t len, int *status);
+
+/*
+ * Tunnels to dst through proxy that have already been handshaken are
+ * pooled, keyed by both addresses. A profile fills the pool for its
+ * egress proxy, whose sockets get the profile's socket options.
+ */
+int httptunnel_pool_get(EV_P_ const struct sockaddr *proxy, const struct sockaddr *dst);
+void httptunnel_pool_fill(EV_P_ Profile *profile, const struct sockaddr *dst);
+size_t httptunnel_pool_fds(void);
+
+#endif  /*  HTTPTUNNEL_H    */
@@ -0,0 +1,323 @@
+/*
+ * lpm.c - layer-4 proxy longest prefix match module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+
+#define LPM_STRIDE      8
+#define LPM_FANOUT      (1 << LPM_STRIDE)
+
+enum { LPM_V4, LPM_V6, LPM_FAMILIES };
+
+typedef struct lpm_bnode_t LpmBNode;
+
+/* Build-time binary trie node, one per bit. */
+struct lpm_bnode_t {
+    LpmBNode        *child[2];
+    uint32_t        value;
+};
+
+/*
+ * Compiled node. Bit i of child is set when slot i continues in another
+ * node; those are stored consecutively from child_base in slot order.
+ * Every other slot is a leaf, and bit i of leaf is set where a run of
+ * equal leaf values starts, so runs are stored once from leaf_base.
+ */
+typedef struct {
+    uint64_t        child[LPM_FANOUT / 64];
+    uint64_t        leaf[LPM_FANOUT / 64];
+    uint32_t        child_base;
+    uint32_t        leaf_base;
+} LpmNode;
+
+typedef struct {
+    LpmNode         *nodes;
+    size_t          nnodes;
+    size_t          nodes_cap;
+    uint32_t        *leaves;
+    size_t          nleaves;
+    size_t          leaves_cap;
+} LpmTable;
+
+struct lpm_t {
+    LpmBNode        *root[LPM_FAMILIES];
+    LpmTable        table[LPM_FAMILIES];
+    lpmParentFn     parent_fn;
+    void            *parent_arg;
+};
+
+typedef struct {
+    LpmBNode        *bnode;     /*  non-NULL if the slot needs a child node */
+    uint32_t        value;
+} LpmSlot;
+
+static const unsigned char s_v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+lpm_t *lpm_new(void) {
+    lpm_t *lpm = (lpm_t*)calloc(1, sizeof(lpm_t));
+    if(NULL == lpm) {
+        syslog(LOG_ERR, "lpm: calloc: %m");
+        return NULL;
+    }
+    return lpm;
+}
+
+static void bnode_delete(LpmBNode *node) {
+    if(NULL == node)
+        return;
+    bnode_delete(node->child[0]);
+    bnode_delete(node->child[1]);
+    free(node);
+}
+
+void lpm_delete(lpm_t *lpm) {
+    int f;
+
+    if(NULL == lpm)
+        return;
+    for(f = 0; f < LPM_FAMILIES; ++f) {
+        bnode_delete(lpm->root[f]);
+        free(lpm->table[f].nodes);
+        free(lpm->table[f].leaves);
+    }
+    free(lpm);
+}
+
+/* Parses "ADDR[/LEN]"; the host bits of ADDR must be zero. */
+int lpm_parse_prefix(const char *str, int *family, unsigned char addr[16], unsigned int *plen) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    char *slash, *end;
+    unsigned int maxlen, i;
+
+    if(strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    if(NULL != (slash = strchr(buf, '/')) )
+        *slash = '\0';
+
+    memset(addr, 0, 16);
+    if(1 == inet_pton(AF_INET, buf, addr)) {
+        *family = AF_INET;
+        maxlen = 32;
+    } else if(1 == inet_pton(AF_INET6, buf, addr)) {
+        *family = AF_INET6;
+        maxlen = 128;
+    } else {
+        return -1;
+    }
+
+    if(NULL == slash) {
+        *plen = maxlen;
+    } else {
+        *plen = (unsigned int)strtoul(slash + 1, &end, 10);
+        if(end == slash + 1 || '\0' != *end || *plen > maxlen)
+            return -1;
+    }
+
+    for(i = *plen; i < maxlen; ++i) {
+        if(addr[i / 8] & (0x80 >> (i % 8)))
+            return -1;
+    }
+    return 0;
+}
+
+uint32_t lpm_insert(lpm_t *lpm, int family, const unsigned char *addr, unsigned int plen, uint32_t value) {
+    int f = AF_INET == family? LPM_V4: LPM_V6;
+    LpmBNode **pnode = &lpm->root[f];
+    unsigned int i;
+
+    for(i = 0; ; ++i) {
+        if(NULL == *pnode && NULL == (*pnode = (LpmBNode*)calloc(1, sizeof(LpmBNode))) ) {
+            syslog(LOG_ERR, "lpm: calloc: %m");
+            return 0;
+        }
+        if(i == plen)
+            break;
+        pnode = &(*pnode)->child[(addr[i / 8] >> (7 - i % 8)) & 1];
+    }
+
+    if(0 == (*pnode)->value)
+        (*pnode)->value = value;
+    return (*pnode)->value;
+}
+
+static int table_reserve(LpmTable *t, size_t nodes, size_t leaves) {
+    if(t->nnodes + nodes > t->nodes_cap) {
+        size_t cap = t->nodes_cap? t->nodes_cap: 64;
+        while(cap < t->nnodes + nodes)
+            cap *= 2;
+        LpmNode *p = (LpmNode*)realloc(t->nodes, cap * sizeof(LpmNode));
+        if(NULL == p)
+            return -1;
+        t->nodes = p;
+        t->nodes_cap = cap;
+    }
+    if(t->nleaves + leaves > t->leaves_cap) {
+        size_t cap = t->leaves_cap? t->leaves_cap: 256;
+        while(cap < t->nleaves + leaves)
+            cap *= 2;
+        uint32_t *p = (uint32_t*)realloc(t->leaves, cap * sizeof(uint32_t));
+        if(NULL == p)
+            return -1;
+        t->leaves = p;
+        t->leaves_cap = cap;
+    }
+    return 0;
+}
+
+static uint32_t enter(lpm_t *lpm, LpmBNode *bnode, uint32_t best) {
+    if(NULL == bnode || 0 == bnode->value)
+        return best;
+    if(lpm->parent_fn)
+        (*lpm->parent_fn)(lpm->parent_arg, bnode->value, best);
+    return bnode->value;
+}
+
+/* Expands the LPM_STRIDE levels below bnode, already entered, into slots. */
+static void fill_slots(lpm_t *lpm, LpmSlot *slots, LpmBNode *bnode,
+        unsigned int level, unsigned int idx, uint32_t best) {
+    int bit;
+
+    for(bit = 0; bit < 2; ++bit) {
+        LpmBNode *c = bnode->child[bit];
+        unsigned int cidx = idx * 2 + bit;
+        uint32_t cbest = enter(lpm, c, best);
+
+        if(LPM_STRIDE == level + 1) {
+            slots[cidx].value = cbest;
+            slots[cidx].bnode = (c && (c->child[0] || c->child[1]))? c: NULL;
+        } else if(NULL == c) {
+            unsigned int span = 1 << (LPM_STRIDE - level - 1);
+            unsigned int i;
+            for(i = cidx * span; i < (cidx + 1) * span; ++i) {
+                slots[i].value = cbest;
+                slots[i].bnode = NULL;
+            }
+        } else {
+            fill_slots(lpm, slots, c, level + 1, cidx, cbest);
+        }
+    }
+}
+
+static int compile_node(lpm_t *lpm, LpmTable *t, size_t index, LpmBNode *bnode, uint32_t best) {
+    LpmSlot slots[LPM_FANOUT];
+    size_t nchild = 0, nleaf = 0, i;
+    uint32_t last = 0;
+    int have_last = 0;
+
+    fill_slots(lpm, slots, bnode, 0, 0, best);
+
+    for(i = 0; i < LPM_FANOUT; ++i) {
+        if(slots[i].bnode) {
+            ++nchild;
+        } else if(!have_last || slots[i].value != last) {
+            ++nleaf;
+            last = slots[i].value;
+            have_last = 1;
+        }
+    }
+    if(-1 == table_reserve(t, nchild, nleaf))
+        return -1;
+
+    LpmNode *node = &t->nodes[index];
+    memset(node, 0, sizeof(LpmNode));
+    node->child_base = (uint32_t)t->nnodes;
+    node->leaf_base = (uint32_t)t->nleaves;
+    t->nnodes += nchild;
+
+    have_last = 0;
+    for(i = 0; i < LPM_FANOUT; ++i) {
+        if(slots[i].bnode) {
+            node->child[i / 64] |= 1ULL << (i % 64);
+        } else if(!have_last || slots[i].value != last) {
+            node->leaf[i / 64] |= 1ULL << (i % 64);
+            t->leaves[t->nleaves++] = last = slots[i].value;
+            have_last = 1;
+        }
+    }
+
+    /*  children may realloc the table, so no node pointer past here   */
+    size_t base = t->nodes[index].child_base;
+    for(i = 0; i < LPM_FANOUT; ++i) {
+        if(slots[i].bnode) {
+            if(-1 == compile_node(lpm, t, base++, slots[i].bnode, slots[i].value))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compiles both families and releases the binary tries. fn, if given,
+ * is told the covering prefix of each value on the way.
+ */
+int lpm_compile(lpm_t *lpm, lpmParentFn fn, void *arg) {
+    static LpmBNode empty;
+    int f;
+
+    lpm->parent_fn = fn;
+    lpm->parent_arg = arg;
+    for(f = 0; f < LPM_FAMILIES; ++f) {
+        LpmTable *t = &lpm->table[f];
+        LpmBNode *root = lpm->root[f]? lpm->root[f]: &empty;
+
+        if(-1 == table_reserve(t, 1, 0)) {
+            syslog(LOG_ERR, "lpm: realloc: %m");
+            return -1;
+        }
+        t->nnodes = 1;
+        if(-1 == compile_node(lpm, t, 0, root, enter(lpm, root, 0))) {
+            syslog(LOG_ERR, "lpm: realloc: %m");
+            return -1;
+        }
+        bnode_delete(lpm->root[f]);
+        lpm->root[f] = NULL;
+    }
+    return 0;
+}
+
+/* Number of bits set in bm below bit i, or up to and including it. */
+static inline unsigned int rank(const uint64_t *bm, unsigned int i, int inclusive) {
+    unsigned int w = i / 64, n = 0, k;
+    for(k = 0; k < w; ++k)
+        n += __builtin_popcountll(bm[k]);
+    return n + __builtin_popcountll(bm[w] & (((inclusive? 2ULL: 1ULL) << (i % 64)) - 1));
+}
+
+static inline uint32_t table_lookup(const LpmTable *t, const unsigned char *key) {
+    const LpmNode *node = t->nodes;
+
+    for(;;) {
+        unsigned int i = *key++;
+        if(node->child[i / 64] & (1ULL << (i % 64))) {
+            node = &t->nodes[node->child_base + rank(node->child, i, 0)];
+        } else {
+            return t->leaves[node->leaf_base + rank(node->leaf, i, 1) - 1];
+        }
+    }
+}
+
+uint32_t lpm_lookup(const lpm_t *lpm, const struct sockaddr *addr) {
+    if(AF_INET == addr->sa_family) {
+        return table_lookup(&lpm->table[LPM_V4],
+                (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr);
+    } else if(AF_INET6 == addr->sa_family) {
+        const unsigned char *a = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+        if(0 == memcmp(a, s_v4mapped, sizeof(s_v4mapped)))
+            return table_lookup(&lpm->table[LPM_V4], a + 12);
+        return table_lookup(&lpm->table[LPM_V6], a);
+    }
+    return 0;
+}
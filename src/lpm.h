@@ -0,0 +1,39 @@
+/*
+ * lpm.h - layer-4 proxy longest prefix match module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef LPM_H
+#define LPM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Maps IPv4 and IPv6 prefixes to non-zero 32-bit values. Prefixes are
+ * inserted into a binary trie, then lpm_compile() turns it into a
+ * read-only multibit trie with 8-bit strides whose nodes are compressed
+ * with child and leaf bitmaps, so a lookup touches at most 4 (IPv4) or
+ * 16 (IPv6) nodes and does no allocation. IPv4-mapped IPv6 addresses are
+ * looked up as IPv4.
+ */
+typedef struct lpm_t lpm_t;
+
+/* Called for each stored value with the value of its closest covering prefix, or 0. */
+typedef void (*lpmParentFn)(void *arg, uint32_t value, uint32_t parent);
+
+lpm_t *lpm_new(void);
+void lpm_delete(lpm_t *lpm);
+
+int lpm_parse_prefix(const char *str, int *family, unsigned char addr[16], unsigned int *plen);
+uint32_t lpm_insert(lpm_t *lpm, int family, const unsigned char *addr, unsigned int plen, uint32_t value);
+int lpm_compile(lpm_t *lpm, lpmParentFn fn, void *arg);
+
+uint32_t lpm_lookup(const lpm_t *lpm, const struct sockaddr *addr);
+
+#endif  /*  LPM_H   */
@@ -14,9 +14,15 @@
 #include <errno.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -25,84 +31,760 @@
 
 #include "utils.h"
 #include "daemon.h"
+#include "admission.h"
+#include "srclimit.h"
+#include "lpm.h"
+#include "acl.h"
+#include "profile.h"
 #include "proxy.h"
+#include "proxyproto.h"
+#include "httptunnel.h"
+#include "netutil.h"
+#include "udprelay.h"
+#include "resolver.h"
+#include "health.h"
+#include "upgrade.h"
+#include "control.h"
 #include "backends/backend.h"
 #include "backends/redirect.h"
+#include "backends/socks5.h"
+#include "backends/balancer.h"
 
 static int setnonblocking(int);
-static int open_bind_socket(const char *addr, const char *port);
+static int open_bind_socket(const char *addr, const char *port, int socktype);
+static int open_listen_socket(const char *addr, const char *port);
+static int open_control_socket(const char *path);
 
+static int lock_pidfile(void);
+static void upgrade_notify(EV_P_ int event);
+static void terminate_callback(EV_P_ ev_signal *watcher, int revents);
+static void drain_start(EV_P);
+static void drain_callback(EV_P_ ev_timer *watcher, int revents);
+static void migrate_callback(EV_P_ ev_io *watcher, int revents);
+static void receive_callback(EV_P_ ev_io *watcher, int revents);
+static void loop_run(EV_P);
+static void loop_stop(EV_P);
+static void busy_acquire(EV_P);
+static void busy_invoke(EV_P);
 static void accept_callback(EV_P_ ev_io *watcher, int revents);
+static void socks_accept_callback(EV_P_ ev_io *watcher, int revents);
+static void relay_client(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *src, const struct sockaddr *dst);
+static void relay_socks_client(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *dst, const struct sockaddr_storage *alts, size_t nalts);
+static void relay_start(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *src, const struct sockaddr *dst,
+        const struct sockaddr_storage *alts, size_t nalts, int reply);
+
+static Acl *s_acl;
+static ProfileTable *s_profiles;
+static int s_accept_proxy;
+static lpm_t *s_accept_proxy_from;  /*  senders trusted with a header, NULL for all */
+static ev_tstamp s_accept_proxy_timeout;
+static ev_tstamp s_socks_timeout;
+static const char *s_pidfile;
+static int s_pidfd = -1;
+static ev_tstamp s_drain_timeout;
+static ev_tstamp s_drain_deadline;
+static ev_tstamp s_busy_poll;       /*  spun for after the last event, 0 to block  */
+static ev_tstamp s_busy_last;       /*  when the last event came    */
+static int s_busy_polled;           /*  events pending came from the backend    */
+static int s_stopped;
+static ev_timer s_drain_timer;
+static ev_signal s_terminate;
+static ev_signal s_interrupt;
+static ev_io s_migrate;     /*  connections to the next binary      */
+static ev_io s_receive;     /*  and from the previous one   */
+
+enum {
+    OPT_MAX_CONNS = 0x100,
+    OPT_MAX_BUFFER_MEM,
+    OPT_MAX_FDS,
+    OPT_SHED_IDLE,
+    OPT_SRC_MAX_CONNS,
+    OPT_SRC_RATE,
+    OPT_SRC_SLOTS,
+    OPT_ACL,
+    OPT_ACL_FILE,
+    OPT_ACL_DEFAULT,
+    OPT_PROFILE,
+    OPT_PROFILE_FILE,
+    OPT_SHAPE_GLOBAL,
+    OPT_NOTSENT_LOWAT,
+    OPT_UDP_PORT,
+    OPT_UDP_UPSTREAM,
+    OPT_UDP_TIMEOUT,
+    OPT_UDP_MAX_FLOWS,
+    OPT_UDP_GRO,
+    OPT_ACCEPT_PROXY,
+    OPT_ACCEPT_PROXY_TIMEOUT,
+    OPT_ACCEPT_PROXY_FROM,
+    OPT_SOCKS_PORT,
+    OPT_SOCKS_USER,
+    OPT_SOCKS_TIMEOUT,
+    OPT_DNS_SERVER,
+    OPT_UPSTREAM,
+    OPT_BALANCE,
+    OPT_EJECT_AFTER,
+    OPT_EJECT_TIME,
+    OPT_HEALTH_CHECK,
+    OPT_RACE_DELAY,
+    OPT_CONNECT_TIMEOUT,
+    OPT_DRAIN_TIMEOUT,
+    OPT_BUFFER_SIZE,
+    OPT_CONTROL,
+    OPT_EDGE_TRIGGERED,
+    OPT_ZEROCOPY,
+    OPT_BUSY_POLL,
+};
+
+static const struct option long_options[] = {
+    {"config",          required_argument,  NULL,   'c'},
+    {"listen",          required_argument,  NULL,   'l'},
+    {"port",            required_argument,  NULL,   'p'},
+    {"daemon",          no_argument,        NULL,   'd'},
+    {"pidfile",         required_argument,  NULL,   'P'},
+    {"max-conns",       required_argument,  NULL,   OPT_MAX_CONNS},
+    {"max-buffer-mem",  required_argument,  NULL,   OPT_MAX_BUFFER_MEM},
+    {"max-fds",         required_argument,  NULL,   OPT_MAX_FDS},
+    {"shed-idle",       required_argument,  NULL,   OPT_SHED_IDLE},
+    {"src-max-conns",   required_argument,  NULL,   OPT_SRC_MAX_CONNS},
+    {"src-rate",        required_argument,  NULL,   OPT_SRC_RATE},
+    {"src-slots",       required_argument,  NULL,   OPT_SRC_SLOTS},
+    {"acl",             required_argument,  NULL,   OPT_ACL},
+    {"acl-file",        required_argument,  NULL,   OPT_ACL_FILE},
+    {"acl-default",     required_argument,  NULL,   OPT_ACL_DEFAULT},
+    {"profile",         required_argument,  NULL,   OPT_PROFILE},
+    {"profile-file",    required_argument,  NULL,   OPT_PROFILE_FILE},
+    {"shape-global",    required_argument,  NULL,   OPT_SHAPE_GLOBAL},
+    {"notsent-lowat",   required_argument,  NULL,   OPT_NOTSENT_LOWAT},
+    {"udp-port",        required_argument,  NULL,   OPT_UDP_PORT},
+    {"udp-upstream",    required_argument,  NULL,   OPT_UDP_UPSTREAM},
+    {"udp-timeout",     required_argument,  NULL,   OPT_UDP_TIMEOUT},
+    {"udp-max-flows",   required_argument,  NULL,   OPT_UDP_MAX_FLOWS},
+    {"udp-gro",         no_argument,        NULL,   OPT_UDP_GRO},
+    {"accept-proxy",    no_argument,        NULL,   OPT_ACCEPT_PROXY},
+    {"accept-proxy-timeout", required_argument, NULL, OPT_ACCEPT_PROXY_TIMEOUT},
+    {"accept-proxy-from", required_argument, NULL, OPT_ACCEPT_PROXY_FROM},
+    {"socks-port",      required_argument,  NULL,   OPT_SOCKS_PORT},
+    {"socks-user",      required_argument,  NULL,   OPT_SOCKS_USER},
+    {"socks-timeout",   required_argument,  NULL,   OPT_SOCKS_TIMEOUT},
+    {"dns-server",      required_argument,  NULL,   OPT_DNS_SERVER},
+    {"upstream",        required_argument,  NULL,   OPT_UPSTREAM},
+    {"balance",         required_argument,  NULL,   OPT_BALANCE},
+    {"eject-after",     required_argument,  NULL,   OPT_EJECT_AFTER},
+    {"eject-time",      required_argument,  NULL,   OPT_EJECT_TIME},
+    {"health-check",    required_argument,  NULL,   OPT_HEALTH_CHECK},
+    {"race-delay",      required_argument,  NULL,   OPT_RACE_DELAY},
+    {"connect-timeout", required_argument,  NULL,   OPT_CONNECT_TIMEOUT},
+    {"drain-timeout",   required_argument,  NULL,   OPT_DRAIN_TIMEOUT},
+    {"buffer-size",     required_argument,  NULL,   OPT_BUFFER_SIZE},
+    {"control",         required_argument,  NULL,   OPT_CONTROL},
+    {"edge-triggered",  no_argument,        NULL,   OPT_EDGE_TRIGGERED},
+    {"zerocopy",        required_argument,  NULL,   OPT_ZEROCOPY},
+    {"busy-poll",       required_argument,  NULL,   OPT_BUSY_POLL},
+    {NULL,              0,                  NULL,   0}
+};
+
+/*
+ * Everything the command line and the config file set. Listeners, the
+ * UDP relay, the resolver, upstreams and health checks are set up once
+ * at start; SIGHUP builds new settings and swaps in the rest.
+ */
+typedef struct {
+    int             detach;
+    char            *host;
+    char            *port;
+    char            *pidfile;
+    char            *udpport;
+    char            *socksport;
+    char            *control;
+    UdpRelayConfig  udpconfig;
+    HealthConfig    healthconfig;
+
+    AdmissionLimits limits;
+    SrcLimits       srclimits;
+    Acl             *acl;
+    ProfileTable    *profiles;
+    double          global_rate;    /*  --shape-global, 0 if not given  */
+    double          global_burst;
+    int             lowat;
+    ev_tstamp       racedelay;
+    ev_tstamp       connect_timeout;
+    size_t          bufsize;
+    size_t          zerocopy;       /*  --zerocopy, 0 if not given  */
+    int             accept_proxy;
+    lpm_t           *accept_proxy_from;
+    ev_tstamp       accept_proxy_timeout;
+    ev_tstamp       socks_timeout;
+    ev_tstamp       drain_timeout;
+    int             edge;
+    int             busy_poll;      /*  microseconds, 0 to block when idle  */
+} Settings;
+
+static Settings *s_settings;
+static char *s_config;      /*  absolute, daemonize() changes directory    */
+static int s_argc;
+static char **s_argv;
+static ev_signal s_reload;
+static ev_async s_reloaded;
+static pthread_t s_reload_thread;
+static Settings *s_reload_set;  /*  the worker's result, NULL if it failed  */
+static int s_reloading;
+static int s_reload_again;      /*  SIGHUP while the worker was running     */
+
+static void settings_default(Settings *set) {
+    memset(set, 0, sizeof(Settings));
+    set->port = "1080";
+    set->pidfile = "/var/run/l4proxy/pidfile";
+    admission_limits_default(&set->limits);
+    srclimit_limits_default(&set->srclimits);
+    udp_relay_config_default(&set->udpconfig);
+    health_config_default(&set->healthconfig);
+    set->racedelay = PROXY_RACE_DELAY;
+    set->connect_timeout = PROXY_CONNECT_TIMEOUT;
+    set->bufsize = PROXY_BUFFER_SIZE;
+    set->accept_proxy_timeout = 3.;
+    set->socks_timeout = 10.;
+    set->drain_timeout = 30.;
+}
+
+static void settings_delete(Settings *set) {
+    acl_delete(set->acl);
+    profile_table_delete(set->profiles);
+    lpm_delete(set->accept_proxy_from);
+    free(set);
+}
+
+/* Trusts the senders in a prefix with PROXY headers. */
+static int settings_accept_proxy_from(Settings *set, const char *prefix) {
+    int family;
+    unsigned char addr[16];
+    unsigned int plen;
+
+    if(-1 == lpm_parse_prefix(prefix, &family, addr, &plen))
+        return -1;
+    if(NULL == set->accept_proxy_from && NULL == (set->accept_proxy_from = lpm_new()) )
+        return -1;
+    return 0 == lpm_insert(set->accept_proxy_from, family, addr, plen, 1)? -1: 0;
+}
+
+static Acl *settings_acl(Settings *set) {
+    if(NULL == set->acl)
+        set->acl = acl_new();
+    return set->acl;
+}
+
+static ProfileTable *settings_profiles(Settings *set) {
+    if(NULL == set->profiles)
+        set->profiles = profile_table_new();
+    return set->profiles;
+}
+
+/*
+ * Sets one option, returns -1 if its value is invalid. Options that
+ * are only used at start are skipped when reloading.
+ */
+static int settings_set(Settings *set, int opt, const char *arg, int reload) {
+    Acl *acl;
+    ProfileTable *profiles;
+
+    switch(opt) {
+        case 'l': case 'p': case 'd': case 'P':
+        case OPT_UDP_PORT: case OPT_UDP_UPSTREAM: case OPT_UDP_TIMEOUT:
+        case OPT_UDP_MAX_FLOWS: case OPT_UDP_GRO: case OPT_SOCKS_PORT:
+        case OPT_SOCKS_USER: case OPT_DNS_SERVER: case OPT_UPSTREAM:
+        case OPT_BALANCE: case OPT_EJECT_AFTER: case OPT_EJECT_TIME:
+        case OPT_HEALTH_CHECK: case OPT_SRC_SLOTS: case OPT_CONTROL:
+        case OPT_EDGE_TRIGGERED: case OPT_BUSY_POLL:
+            if(reload)
+                return 0;
+            break;
+        case 'c':
+            return 0;
+    }
+
+    switch(opt) {
+        case 'l':
+            set->host = strdup(arg);
+            break;
+        case 'p':
+            set->port = strdup(arg);
+            break;
+        case 'd':
+            set->detach = 1;
+            break;
+        case 'P':
+            set->pidfile = strdup(arg);
+            break;
+        case OPT_MAX_CONNS:
+            return admission_parse_budget(&set->limits.conns, arg);
+        case OPT_MAX_BUFFER_MEM:
+            return admission_parse_budget(&set->limits.bufmem, arg);
+        case OPT_MAX_FDS:
+            return admission_parse_budget(&set->limits.fds, arg);
+        case OPT_SHED_IDLE:
+            set->limits.shed_idle = atof(arg);
+            break;
+        case OPT_SRC_MAX_CONNS:
+            set->srclimits.max_conns = atoi(arg);
+            break;
+        case OPT_SRC_RATE:
+            return srclimit_parse_rate(&set->srclimits, arg);
+        case OPT_SRC_SLOTS:
+            set->srclimits.slots = strtoul(arg, NULL, 10);
+            break;
+        case OPT_ACL:
+            if(NULL == (acl = settings_acl(set)) )
+                return -1;
+            return acl_add_rule(acl, arg);
+        case OPT_ACL_FILE:
+            if(NULL == (acl = settings_acl(set)) )
+                return -1;
+            return acl_load_file(acl, arg);
+        case OPT_ACL_DEFAULT:
+            if(NULL == (acl = settings_acl(set)) )
+                return -1;
+            return acl_set_default(acl, arg);
+        case OPT_PROFILE:
+            if(NULL == (profiles = settings_profiles(set)) )
+                return -1;
+            return profile_table_add(profiles, arg);
+        case OPT_PROFILE_FILE:
+            if(NULL == (profiles = settings_profiles(set)) )
+                return -1;
+            return profile_table_load_file(profiles, arg);
+        case OPT_SHAPE_GLOBAL:
+            return shaper_parse_rate(arg, &set->global_rate, &set->global_burst);
+        case OPT_NOTSENT_LOWAT:
+            if(0 >= (set->lowat = atoi(arg)) )
+                return -1;
+            break;
+        case OPT_UDP_PORT:
+            set->udpport = strdup(arg);
+            break;
+        case OPT_UDP_UPSTREAM:
+            if(-1 == sockaddr_resolve(arg, SOCK_DGRAM, &set->udpconfig.upstream))
+                return -1;
+            set->udpconfig.has_upstream = 1;
+            break;
+        case OPT_UDP_TIMEOUT:
+            if(0 >= (set->udpconfig.idle_timeout = atof(arg)) )
+                return -1;
+            break;
+        case OPT_UDP_MAX_FLOWS:
+            set->udpconfig.max_flows = strtoul(arg, NULL, 10);
+            break;
+        case OPT_UDP_GRO:
+            set->udpconfig.gro = 1;
+            break;
+        case OPT_ACCEPT_PROXY:
+            set->accept_proxy = 1;
+            break;
+        case OPT_ACCEPT_PROXY_TIMEOUT:
+            if(0 >= (set->accept_proxy_timeout = atof(arg)) )
+                return -1;
+            break;
+        case OPT_ACCEPT_PROXY_FROM:
+            return settings_accept_proxy_from(set, arg);
+        case OPT_SOCKS_PORT:
+            set->socksport = strdup(arg);
+            break;
+        case OPT_SOCKS_USER:
+            return socks5_add_user(arg);
+        case OPT_SOCKS_TIMEOUT:
+            if(0 >= (set->socks_timeout = atof(arg)) )
+                return -1;
+            break;
+        case OPT_DNS_SERVER:
+            return resolver_add_server(arg);
+        case OPT_UPSTREAM:
+            return balancer_add_upstream(arg);
+        case OPT_BALANCE:
+            return balancer_set_method(arg);
+        case OPT_EJECT_AFTER:
+            if(0 > (set->healthconfig.eject_after = atoi(arg)) )
+                return -1;
+            break;
+        case OPT_EJECT_TIME:
+            if(0 >= (set->healthconfig.eject_time = atof(arg)) )
+                return -1;
+            if(set->healthconfig.max_eject_time < set->healthconfig.eject_time)
+                set->healthconfig.max_eject_time = set->healthconfig.eject_time;
+            break;
+        case OPT_HEALTH_CHECK:
+            return health_add_check(arg);
+        case OPT_RACE_DELAY:
+            if(0 > (set->racedelay = atof(arg)) )
+                return -1;
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            if(0 > (set->connect_timeout = atof(arg)) )
+                return -1;
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            if(0 > (set->drain_timeout = atof(arg)) )
+                return -1;
+            break;
+        case OPT_CONTROL:
+            set->control = strdup(arg);
+            break;
+        case OPT_BUFFER_SIZE:
+            set->bufsize = strtoul(arg, NULL, 10);
+            if(set->bufsize < PROXY_BUFFER_MIN || set->bufsize > PROXY_BUFFER_MAX)
+                return -1;
+            break;
+        case OPT_EDGE_TRIGGERED:
+            set->edge = 1;
+            break;
+        case OPT_ZEROCOPY:
+            set->zerocopy = strtoul(arg, NULL, 10);
+            if(set->zerocopy < PROXY_BUFFER_MIN || set->zerocopy > PROXY_BUFFER_MAX)
+                return -1;
+            break;
+        case OPT_BUSY_POLL:
+            set->busy_poll = atoi(arg);
+            if(set->busy_poll <= 0)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * One option per line, its long name followed by its value, e.g.
+ * "max-conns 10000" or "acl deny 10.0.0.0/8". Blank lines and '#'
+ * comments are skipped.
+ */
+static int settings_load_file(Settings *set, const char *path, int reload) {
+    FILE *fp;
+    char line[1024];
+    int lineno = 0, ret = 0;
+
+    if(NULL == (fp = fopen(path, "r")) ) {
+        syslog(LOG_ERR, "config: couldn't open %s: %m", path);
+        return -1;
+    }
+    while(0 == ret && NULL != fgets(line, sizeof(line), fp)) {
+        char *name = line_strip(line), *value;
+        const struct option *o;
+
+        ++lineno;
+        if('\0' == *name)
+            continue;
+        value = name + strcspn(name, " \t");
+        if('\0' != *value)
+            *value++ = '\0';
+        value += strspn(value, " \t");
+
+        for(o = long_options; o->name && 0 != strcmp(name, o->name); ++o)
+            ;
+        if(NULL == o->name || 'c' == o->val
+                || (required_argument == o->has_arg) != ('\0' != *value)
+                || -1 == settings_set(set, o->val, value, reload)) {
+            syslog(LOG_ERR, "config: %s:%d: invalid '%s'", path, lineno, name);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * The config file comes first, the command line then adds to it or
+ * overrides it, both on start and on reload.
+ */
+static int settings_parse(Settings *set, int reload) {
+    int opt;
+
+    settings_default(set);
+    if(s_config && -1 == settings_load_file(set, s_config, reload))
+        return -1;
+    optind = 0;
+    while(-1 != (opt = getopt_long(s_argc, s_argv, "l:p:dP:c:", long_options, NULL)) ) {
+        if(-1 == settings_set(set, opt, optarg, reload))
+            return -1;
+    }
+    if(set->acl && -1 == acl_compile(set->acl)) {
+        syslog(LOG_ERR, "Couldn't compile destination ACL!");
+        return -1;
+    }
+    if(set->profiles && -1 == profile_table_compile(set->profiles)) {
+        syslog(LOG_ERR, "Couldn't compile destination profiles!");
+        return -1;
+    }
+    if(set->accept_proxy_from && -1 == lpm_compile(set->accept_proxy_from, NULL, NULL)) {
+        syslog(LOG_ERR, "Couldn't compile trusted PROXY senders!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Connections that are open keep what they got, profiles included,
+ * everything new gets the new settings.
+ */
+static void settings_apply(EV_P_ const Settings *set, const Settings *old) {
+    admission_set_limits(loop, &set->limits);
+    if(-1 == srclimit_init(&set->srclimits))
+        syslog(LOG_ERR, "Couldn't allocate source limit table, sources aren't limited");
+    if(NULL == old || set->global_rate != old->global_rate
+            || set->global_burst != old->global_burst)
+        shaper_global_init(set->global_rate, set->global_burst);
+    proxy_set_notsent_lowat(set->lowat);
+    proxy_set_race_delay(set->racedelay);
+    proxy_set_connect_timeout(set->connect_timeout);
+    proxy_set_buffer_size(set->bufsize);
+    proxy_set_zerocopy(set->zerocopy);
+    udp_relay_set_acl(set->acl);
+
+    s_acl = set->acl;
+    s_profiles = set->profiles;
+    s_accept_proxy = set->accept_proxy;
+    s_accept_proxy_from = set->accept_proxy_from;
+    s_accept_proxy_timeout = set->accept_proxy_timeout;
+    s_socks_timeout = set->socks_timeout;
+    s_drain_timeout = set->drain_timeout;
+}
+
+/*
+ * Parses and compiles the new settings away from the loop, a large ACL
+ * takes long enough to stall relaying. Only the options that reload
+ * are read, they touch nothing but the new Settings.
+ */
+static void *reload_thread(void *arg) {
+    struct ev_loop *loop = (struct ev_loop*)arg;
+
+    if(-1 == settings_parse(s_reload_set, 1)) {
+        settings_delete(s_reload_set);
+        s_reload_set = NULL;
+    }
+    ev_async_send(loop, &s_reloaded);
+    return NULL;
+}
+
+/*
+ * SIGHUP reads the config file and the command line again. The new
+ * settings are complete before they replace the running ones, so a
+ * connection sees either, and a bad file changes nothing.
+ */
+static void reload_callback(EV_P_ ev_signal *watcher, int revents) {
+    sigset_t all, old;
+    int ret;
+
+    if(s_reloading) {
+        s_reload_again = 1;
+        return;
+    }
+    s_reload_set = (Settings*)malloc(sizeof(Settings));
+    if(NULL == s_reload_set) {
+        syslog(LOG_ERR, "reload: malloc failed");
+        return;
+    }
+    /*  signals stay with the loop  */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&s_reload_thread, NULL, reload_thread, loop);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(0 != ret) {
+        syslog(LOG_ERR, "reload: pthread_create: %s", strerror(ret));
+        free(s_reload_set);
+        s_reload_set = NULL;
+        return;
+    }
+    s_reloading = 1;
+    upgrade_hold(loop, 1);
+}
+
+/*
+ * Back on the loop, only the swap is left. An upgrade asked for while
+ * the worker ran starts now that it is gone.
+ */
+static void reloaded_callback(EV_P_ ev_async *watcher, int revents) {
+    Settings *set;
+
+    pthread_join(s_reload_thread, NULL);
+    s_reloading = 0;
+    set = s_reload_set;
+    s_reload_set = NULL;
+    if(NULL == set) {
+        syslog(LOG_ERR, "reload failed, keeping the running configuration");
+    } else {
+        settings_apply(loop, set, s_settings);
+        settings_delete(s_settings);
+        s_settings = set;
+        syslog(LOG_NOTICE, "configuration reloaded");
+    }
+    upgrade_hold(loop, 0);
+    if(s_reload_again) {
+        s_reload_again = 0;
+        reload_callback(loop, &s_reload, EV_SIGNAL);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-d] [-l LISTEN_ADDR] [-p LISTENT_PORT] [-P pidfile] [-c CONFIG]\n"
+            "       [--max-conns HIGH[:LOW]] [--max-buffer-mem BYTES[:LOW]]\n"
+            "       [--max-fds HIGH[:LOW]] [--shed-idle SECONDS]\n"
+            "       [--src-max-conns N] [--src-rate RATE[:BURST]] [--src-slots N]\n"
+            "       [--acl 'allow|deny PREFIX [PORT[-PORT]]'] [--acl-file FILE]\n"
+            "       [--acl-default allow|deny]\n"
+            "       [--profile 'PREFIX[,PREFIX...] key=value ...'] [--profile-file FILE]\n"
+            "       [--shape-global RATE[:BURST]] [--notsent-lowat BYTES]\n"
+            "       [--udp-port PORT] [--udp-upstream HOST:PORT] [--udp-timeout SECONDS]\n"
+            "       [--udp-max-flows N] [--udp-gro]\n"
+            "       [--accept-proxy] [--accept-proxy-timeout SECONDS]\n"
+            "       [--accept-proxy-from PREFIX]\n"
+            "       [--socks-port PORT] [--socks-user USER:PASS] [--socks-timeout SECONDS]\n"
+            "       [--dns-server ADDR[:PORT]]\n"
+            "       [--upstream 'HOST:PORT [weight=N]']\n"
+            "       [--balance round-robin|least-conn|p2c|maglev|ring]\n"
+            "       [--connect-timeout SECONDS] [--eject-after N] [--eject-time SECONDS]\n"
+            "       [--health-check 'HOST:PORT [interval=S] [timeout=S] [rise=N] [fall=N]']\n"
+            "       [--race-delay SECONDS] [--drain-timeout SECONDS]\n"
+            "       [--buffer-size BYTES] [--control PATH] [--edge-triggered]\n"
+            "       [--zerocopy BYTES] [--busy-poll USECS]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
 
 int
 main(int argc, char *argv[]) {
     int opt;
-    int detach = 0;
-    char *host = NULL; 
-    char *port = "1080";
-    char *pidfile = "/var/run/l4proxy/pidfile";
-
-    while((opt = getopt(argc, argv, "l:p:dP:")) != -1) {
-        switch(opt) {
-            case 'l':
-                host = strdup(optarg);
-                break;
-            case 'p':
-                port = strdup(optarg);
-                break;
-            case 'd':
-                detach = 1;
-                break;
-            case 'P':
-                pidfile = strdup(optarg);
-                break;
-            default:
-                fprintf(stderr,
-                        "Usage: %s [-d] [-l LISTEN_ADDR] [-p LISTENT_PORT] [-P pidfile]\n",
-                        argv[0]);
-                exit(EXIT_FAILURE);
+    Settings *set;
+
+    s_argc = argc;
+    s_argv = argv;
+    opterr = 0;
+    while(-1 != (opt = getopt_long(argc, argv, "l:p:dP:c:", long_options, NULL)) ) {
+        if('c' == opt && NULL == (s_config = realpath(optarg, NULL)) ) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], optarg, strerror(errno));
+            exit(EXIT_FAILURE);
         }
     }
+    opterr = 1;
 
-    if(detach)
+    openlog("l4proxy", LOG_PID|LOG_PERROR, LOG_DAEMON);
+    if(NULL == (s_settings = set = (Settings*)malloc(sizeof(Settings)))
+            || -1 == settings_parse(set, 0))
+        usage(argv[0]);
+
+    upgrade_init(argv);
+    if(set->detach)
         daemonize();
 
-    openlog("l4proxy", LOG_PID|LOG_PERROR, LOG_DAEMON);
     syslog(LOG_NOTICE, "l4proxy started");
 
     set_signal_handler(SIGPIPE, SIG_IGN);
 
-    if(pidfile){
-        int pidfd;
-        struct flock pidfl;
-        char buf[64];
-        pidfl.l_type = F_WRLCK;
-        pidfl.l_whence = SEEK_SET;
-        pidfl.l_start = 0;
-        pidfl.l_len = 0;
-        if((pidfd = open(pidfile, O_RDWR|O_CREAT, 0600)) < 0){
-            syslog(LOG_CRIT, "Couldn't open pidfile %s", pidfile);
-            exit(EXIT_FAILURE);
-        }
-        if(fcntl(pidfd, F_SETLK, &pidfl) < 0){
-            syslog(LOG_CRIT, "Couldn't lock pidfile %s", pidfile);
-            exit(EXIT_FAILURE);
-        }
-        ftruncate(pidfd, 0);
-        snprintf(buf, sizeof(buf), "%lu\n", (unsigned long) getpid());
-        write(pidfd, buf, strlen(buf));
+    if((s_pidfile = set->pidfile) && -1 == lock_pidfile())
+        exit(EXIT_FAILURE);
+
+    if(-1 == resolver_init()) {
+        syslog(LOG_CRIT, "Couldn't set up the resolver!");
+        exit(EXIT_FAILURE);
+    }
+
+    if(-1 == health_init(&set->healthconfig)) {
+        syslog(LOG_CRIT, "Couldn't set up health checking!");
+        exit(EXIT_FAILURE);
     }
 
     if(0 != redirect_backend_register("redirect")) {
         syslog(LOG_CRIT, "Couldn't register 'redirect' backend!");
         exit(EXIT_FAILURE);
     }
-    if(0 != backend_switchto("redirect")) {
-        syslog(LOG_CRIT, "Couldn't register 'redirect' backend!");
+    if(balancer_size() && 0 != balancer_backend_register("balancer")) {
+        syslog(LOG_CRIT, "Couldn't register 'balancer' backend!");
         exit(EXIT_FAILURE);
     }
+    if(0 != backend_switchto(balancer_size()? "balancer": "redirect")) {
+        syslog(LOG_CRIT, "Couldn't switch to the backend!");
+        exit(EXIT_FAILURE);
+    }
+
+    int listenfd = open_listen_socket(set->host, set->port);
+
+    struct ev_loop *loop = EV_DEFAULT;
+    ev_io listen_watcher;
+    ev_io socks_watcher;
+
+    admission_init(&set->limits);
+    if(-1 == srclimit_init(&set->srclimits)) {
+        syslog(LOG_CRIT, "Couldn't allocate source limit table!");
+        exit(EXIT_FAILURE);
+    }
+    settings_apply(loop, set, NULL);
+    if(set->edge && -1 == proxy_set_edge_triggered(loop)) {
+        syslog(LOG_CRIT, "Couldn't set up edge-triggered relaying!");
+        exit(EXIT_FAILURE);
+    }
+    proxy_set_busy_poll(set->busy_poll);
+    s_busy_poll = set->busy_poll / 1e6;
+    ev_signal_init(&s_reload, reload_callback, SIGHUP);
+    ev_signal_start(loop, &s_reload);
+    ev_async_init(&s_reloaded, reloaded_callback);
+    ev_async_start(loop, &s_reloaded);
+    health_start(loop);
+
+    ev_io_init(&listen_watcher, accept_callback, listenfd, EV_READ);
+    ev_io_start(loop, &listen_watcher);
+    admission_add_listener(loop, &listen_watcher);
+
+    if(set->socksport) {
+        ev_io_init(&socks_watcher, socks_accept_callback, open_listen_socket(set->host, set->socksport), EV_READ);
+        ev_io_start(loop, &socks_watcher);
+        admission_add_listener(loop, &socks_watcher);
+    }
+
+    if(set->udpport) {
+        int udpfd = open_bind_socket(set->host, set->udpport, SOCK_DGRAM);
+        if(udpfd < 0) {
+            syslog(LOG_CRIT, "Couldn't bind() UDP socket!");
+            exit(EXIT_FAILURE);
+        }
+        if(-1 == setnonblocking(udpfd)) {
+            syslog(LOG_CRIT, "setnonblocking: %m");
+            exit(EXIT_FAILURE);
+        }
+        set->udpconfig.acl = s_acl;
+        if(-1 == udp_relay_start(loop, udpfd, &set->udpconfig)) {
+            syslog(LOG_CRIT, "Couldn't start UDP relay!");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    int listenfd = open_bind_socket(host, port);
+    if(set->control) {
+        int controlfd = open_control_socket(set->control);
+        if(-1 == controlfd || -1 == control_start(loop, controlfd)) {
+            syslog(LOG_CRIT, "Couldn't open control socket %s!", set->control);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int migratefd = upgrade_migrate_fd();
+    if(-1 != migratefd) {
+        ev_io_init(&s_receive, receive_callback, migratefd, EV_READ);
+        ev_io_start(loop, &s_receive);
+    }
+    ev_signal_init(&s_terminate, terminate_callback, SIGTERM);
+    ev_signal_start(loop, &s_terminate);
+    ev_signal_init(&s_interrupt, terminate_callback, SIGINT);
+    ev_signal_start(loop, &s_interrupt);
+    upgrade_start(loop, upgrade_notify);
+    upgrade_ready();
+    loop_run(loop);
+
+    return 0;
+}
+
+/* A non-blocking TCP listener, the process exits if it can't get one. */
+static int open_listen_socket(const char *addr, const char *port) {
+    int opt = 1;
+    int listenfd = open_bind_socket(addr, port, SOCK_STREAM);
     if(listenfd < 0) {
         syslog(LOG_CRIT, "Couldn't bind() socket!");
         exit(EXIT_FAILURE);
@@ -116,29 +798,31 @@ main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    opt = 1;
     setsockopt(listenfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
-
-    struct ev_loop *loop = EV_DEFAULT;
-    ev_io listen_watcher;
-
-    ev_io_init(&listen_watcher, accept_callback, listenfd, EV_READ);
-    ev_io_start(loop, &listen_watcher);
-
-    ev_run(loop, 0);
-
-    return 0;
+    return listenfd;
 }
 
-static int open_bind_socket(const char *addr, const char *port) {
+/*
+ * Bound sockets are passed on to upgraded binaries under their type and
+ * address, and taken over from the previous binary if it had the same.
+ */
+static int open_bind_socket(const char *addr, const char *port, int socktype) {
     int ret, socketfd;
     struct addrinfo hints;
     struct addrinfo *result, *rp;
+    char name[128];
+
+    snprintf(name, sizeof(name), "%s:%s:%s", SOCK_STREAM == socktype? "tcp": "udp",
+            addr? addr: "*", port);
+    if(-1 != (socketfd = upgrade_inherit(name)) ) {
+        upgrade_pass(name, socketfd);
+        return socketfd;
+    }
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_flags = AI_PASSIVE;
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
 
     if(0 != (ret = getaddrinfo(addr, port, &hints, &result)) ) {
         syslog(LOG_CRIT, "getaddrinfo: %s", gai_strerror(ret));
@@ -168,10 +852,51 @@ static int open_bind_socket(const char *addr, const char *port) {
         syslog(LOG_CRIT, "Couldn't bind %s:%s", addr, port);
         return -1;
     } else {
+        upgrade_pass(name, socketfd);
         return socketfd;
     }
 }
 
+/*
+ * Only the owner may connect. A socket file left behind by an earlier
+ * run is replaced, unless the previous binary passed the socket on.
+ */
+static int open_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    char name[128];
+    mode_t mask;
+    int fd, ret;
+
+    snprintf(name, sizeof(name), "unix:%s", path);
+    if(-1 != (fd = upgrade_inherit(name)) ) {
+        upgrade_pass(name, fd);
+        return fd;
+    }
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_CRIT, "control socket path %s is too long", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(-1 == (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) ) {
+        syslog(LOG_CRIT, "socket: %m");
+        return -1;
+    }
+    unlink(path);
+    mask = umask(0077);
+    ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if(-1 == ret || -1 == listen(fd, 16)) {
+        syslog(LOG_CRIT, "bind %s: %m", path);
+        close_i(fd);
+        return -1;
+    }
+    upgrade_pass(name, fd);
+    return fd;
+}
+
 int setnonblocking(int fd)
 {
     int flags;
@@ -181,53 +906,389 @@ int setnonblocking(int fd)
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+/* The lock is held for as long as the process runs, or until it upgrades. */
+static int lock_pidfile(void) {
+    struct flock pidfl;
+    char buf[64];
+    pidfl.l_type = F_WRLCK;
+    pidfl.l_whence = SEEK_SET;
+    pidfl.l_start = 0;
+    pidfl.l_len = 0;
+    if((s_pidfd = open(s_pidfile, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0){
+        syslog(LOG_CRIT, "Couldn't open pidfile %s", s_pidfile);
+        return -1;
+    }
+    if(fcntl(s_pidfd, F_SETLK, &pidfl) < 0){
+        syslog(LOG_CRIT, "Couldn't lock pidfile %s", s_pidfile);
+        close_i(s_pidfd);
+        s_pidfd = -1;
+        return -1;
+    }
+    ftruncate(s_pidfd, 0);
+    snprintf(buf, sizeof(buf), "%lu\n", (unsigned long) getpid());
+    write(s_pidfd, buf, strlen(buf));
+    return 0;
+}
+
+/*
+ * The new binary takes the pidfile over, and once it accepts this one
+ * stops and drains. If it never got that far, the pidfile is taken back.
+ */
+static void upgrade_notify(EV_P_ int event) {
+    switch(event) {
+        case UPGRADE_EXEC:
+            if(-1 != s_pidfd) {
+                close_i(s_pidfd);
+                s_pidfd = -1;
+            }
+            break;
+        case UPGRADE_FAILED:
+            if(s_pidfile && -1 == lock_pidfile())
+                syslog(LOG_WARNING, "running without a pidfile");
+            break;
+        case UPGRADE_DONE:
+            control_stop(loop);
+            drain_start(loop);
+            break;
+    }
+}
+
+/*
+ * SIGTERM and SIGINT drain like an upgrade, except that there is nobody
+ * to hand connections to. Another one while draining doesn't wait for
+ * the drain timeout any longer.
+ */
+static void terminate_callback(EV_P_ ev_signal *watcher, int revents) {
+    const char *name = SIGTERM == watcher->signum? "SIGTERM": "SIGINT";
+
+    if(ev_is_active(&s_drain_timer)) {
+        syslog(LOG_NOTICE, "%s while draining, closing connections now", name);
+        s_drain_deadline = ev_now(loop);
+        drain_callback(loop, &s_drain_timer, EV_TIMER);
+        return;
+    }
+    syslog(LOG_NOTICE, "%s, draining", name);
+    drain_start(loop);
+}
+
+/*
+ * Closes the listeners, hands established connections to the new
+ * binary, if there is one, and waits, for at most the drain timeout,
+ * until every client descriptor is closed. Pooled tunnels don't count.
+ * Connections that weren't established yet are tried again on every
+ * tick. An upgrade finishing while draining only adds the migration.
+ */
+static void drain_start(EV_P) {
+    int migratefd = upgrade_migrate_fd();
+
+    if(!ev_is_active(&s_drain_timer)) {
+        admission_close_listeners(loop);
+        udp_relay_stop(loop);
+        ev_io_init(&s_migrate, migrate_callback, -1, EV_WRITE);
+        s_drain_deadline = ev_now(loop) + s_drain_timeout;
+        control_set_drain(s_drain_deadline);
+        ev_timer_init(&s_drain_timer, drain_callback, 0., 1.);
+        ev_timer_start(loop, &s_drain_timer);
+    }
+    if(-1 != migratefd) {
+        ev_io_set(&s_migrate, migratefd, EV_WRITE);
+        migrate_callback(loop, &s_migrate, EV_WRITE);
+    }
+}
+
+/* Past the deadline, what is left is flushed as far as it goes and closed. */
+static void drain_callback(EV_P_ ev_timer *watcher, int revents) {
+    size_t left;
+
+    if(-1 != s_migrate.fd && !ev_is_active(&s_migrate))
+        migrate_callback(loop, &s_migrate, EV_WRITE);
+    left = admission_fds() - httptunnel_pool_fds();
+
+    if(0 == left) {
+        syslog(LOG_NOTICE, "drained, exiting");
+        loop_stop(loop);
+    } else if(ev_now(loop) >= s_drain_deadline) {
+        syslog(LOG_NOTICE, "drain timeout, %zu descriptors left", left);
+        syslog(LOG_NOTICE, "closed %zu connections", proxy_close_all(loop));
+        loop_stop(loop);
+    }
+}
+
+/*
+ * With --busy-poll the loop is run without blocking for as long as
+ * events keep coming, and for the given time after the last one, and
+ * only then blocks until the next. Otherwise it simply runs. Polls that
+ * found nothing yield, which costs nothing on a core of our own but
+ * lets the peers we wait for run on a shared one.
+ */
+static void loop_run(EV_P) {
+    ev_tstamp last;
+    int flags;
+
+    if(0. == s_busy_poll) {
+        ev_run(loop, 0);
+        return;
+    }
+    ev_set_loop_release_cb(loop, NULL, busy_acquire);
+    ev_set_invoke_pending_cb(loop, busy_invoke);
+    s_busy_last = ev_now(loop);
+    while(!s_stopped) {
+        last = s_busy_last;
+        flags = ev_now(loop) - last < s_busy_poll? EVRUN_NOWAIT: EVRUN_ONCE;
+        if(!ev_run(loop, flags))
+            break;
+        if(EVRUN_NOWAIT == flags && last == s_busy_last)
+            sched_yield();
+    }
+}
+
+/* ev_break() only ends the current iteration of a busy polled loop. */
+static void loop_stop(EV_P) {
+    s_stopped = 1;
+    ev_break(loop, EVBREAK_ALL);
+}
+
+/* Called once the backend returned, prepare watchers run before. */
+static void busy_acquire(EV_P) {
+    s_busy_polled = 1;
+}
+
+static void busy_invoke(EV_P) {
+    if(s_busy_polled && ev_pending_count(loop))
+        s_busy_last = ev_now(loop);
+    s_busy_polled = 0;
+    ev_invoke_pending(loop);
+}
+
+/* Waits for room while the socket is full, gives up once it broke. */
+static void migrate_callback(EV_P_ ev_io *watcher, int revents) {
+    if(0 == proxy_migrate(loop, watcher->fd)) {
+        ev_io_stop(loop, watcher);
+    } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
+        ev_io_start(loop, watcher);
+    } else {
+        syslog(LOG_WARNING, "can't migrate connections, draining them");
+        ev_io_stop(loop, watcher);
+        close_i(watcher->fd);
+        ev_io_set(watcher, -1, EV_WRITE);
+    }
+}
+
+static void receive_callback(EV_P_ ev_io *watcher, int revents) {
+    if(-1 == proxy_receive(loop, watcher->fd, s_profiles)) {
+        syslog(LOG_INFO, "previous binary is done migrating");
+        ev_io_stop(loop, watcher);
+        close_i(watcher->fd);
+    }
+}
+
 static void accept_callback(EV_P_ ev_io *watcher, int revents) {
     int listenfd = watcher->fd;
-    struct sockaddr_storage destaddr;
+    struct sockaddr_storage peeraddr;
+    socklen_t peerlen = sizeof(peeraddr);
 
-    int clientfd = accept(listenfd, NULL, NULL);
+    int clientfd = accept4(listenfd, (struct sockaddr*)&peeraddr, &peerlen, SOCK_NONBLOCK);
     if(-1 == clientfd) {
-        syslog(LOG_ERR, "accept: %m");
+        if(EAGAIN != errno && EWOULDBLOCK != errno) {
+            syslog(LOG_ERR, "accept4: %m");
+            admission_accept_failed(loop, errno);
+        }
         return;
     }
-    if(-1 == setnonblocking(clientfd)) {
-        syslog(LOG_ERR, "setnonblocking: %m");
-        close_i(clientfd);
+    admission_fd_opened(loop, 1);
+
+    /*  a header from anyone else could pick any source, so it isn't read  */
+    if(s_accept_proxy && (NULL == s_accept_proxy_from
+                || lpm_lookup(s_accept_proxy_from, (struct sockaddr*)&peeraddr))) {
+        if(-1 == proxyproto_accept(loop, clientfd, (struct sockaddr*)&peeraddr,
+                    s_accept_proxy_timeout, relay_client)) {
+            close_rst(clientfd);
+            admission_fd_closed(loop, 1);
+        }
+        return;
+    }
+    relay_client(loop, clientfd, (struct sockaddr*)&peeraddr, NULL, NULL);
+}
+
+static void socks_accept_callback(EV_P_ ev_io *watcher, int revents) {
+    struct sockaddr_storage peeraddr;
+    socklen_t peerlen = sizeof(peeraddr);
+
+    int clientfd = accept4(watcher->fd, (struct sockaddr*)&peeraddr, &peerlen, SOCK_NONBLOCK);
+    if(-1 == clientfd) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno) {
+            syslog(LOG_ERR, "accept4: %m");
+            admission_accept_failed(loop, errno);
+        }
+        return;
+    }
+    admission_fd_opened(loop, 1);
+
+    if(-1 == socks5_handshake(loop, clientfd, (struct sockaddr*)&peeraddr,
+                s_socks_timeout, relay_socks_client)) {
+        close_rst(clientfd);
+        admission_fd_closed(loop, 1);
+    }
+}
+
+/*
+ * src and dst are the addresses from a PROXY header, if the client sent
+ * one; otherwise the peer address is the source and the backend finds
+ * the destination.
+ */
+static void relay_client(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *src, const struct sockaddr *dst) {
+    relay_start(loop, clientfd, peer, src, dst, NULL, 0, PROXY_REPLY_NONE);
+}
+
+static void relay_socks_client(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *dst, const struct sockaddr_storage *alts, size_t nalts) {
+    relay_start(loop, clientfd, peer, NULL, dst, alts, nalts, PROXY_REPLY_SOCKS5);
+}
+
+/*
+ * Connects an accepted client to its destination, or to the one the
+ * backend finds if dst is NULL. Other addresses of the destination in
+ * alts are raced against it. reply is owed to the client once the
+ * upstream is connected.
+ */
+static void relay_start(EV_P_ int clientfd, const struct sockaddr *peer,
+        const struct sockaddr *src, const struct sockaddr *dst,
+        const struct sockaddr_storage *alts, size_t nalts, int reply) {
+    struct sockaddr_storage destaddr;
+    struct sockaddr_storage addrs[PROXY_RACE_MAX];
+    size_t naddrs = 1, i;
+    int srcslot;
+    int backend = BACKEND_NONE;
+    int healthslot = HEALTH_NONE;
+    Profile *profile = NULL;
+
+    if(-1 == srclimit_acquire(loop, src? src: peer, &srcslot)) {
+        close_rst(clientfd);
+        admission_fd_closed(loop, 1);
         return;
     }
 
-    if(-1 == backend_getdestination(clientfd, &destaddr)){
+    if(dst) {
+        memcpy(&destaddr, dst, sockaddr_len(dst));
+    } else if(-1 == (backend = backend_getdestination(loop, clientfd, &destaddr)) ){
         syslog(LOG_INFO, "backend_getdestination: %m");
-        close_i(clientfd);
+        backend = BACKEND_NONE;
+        goto close_client;
+    }
+    if(s_acl && -1 == acl_check(s_acl, (struct sockaddr*)&destaddr)) {
+        syslog(LOG_DEBUG, "relay_start: destination denied by ACL.");
+        if(PROXY_REPLY_SOCKS5 == reply) {
+            /*  a reset could discard the reply    */
+            socks5_send_reply(clientfd, SOCKS5_REP_NOT_ALLOWED, NULL);
+            close_i(clientfd);
+        } else {
+            close_rst(clientfd);
+        }
+        admission_fd_closed(loop, 1);
+        srclimit_release(srcslot);
+        backend_release(backend);
+        return;
     }
 
-    int destfd = socket(destaddr.ss_family, SOCK_STREAM, 0);
-    if(-1 == destfd) {
-        syslog(LOG_ERR, "accept: %m");
+    /*  other addresses the ACL denies are left out of the race  */
+    addrs[0] = destaddr;
+    for(i = 0; i < nalts && naddrs < PROXY_RACE_MAX; ++i) {
+        if(NULL == s_acl || -1 != acl_check(s_acl, (struct sockaddr*)&alts[i]))
+            addrs[naddrs++] = alts[i];
+    }
+
+    if(s_profiles)
+        profile = profile_table_lookup(s_profiles, (struct sockaddr*)&destaddr);
+
+    /*  an egress proxy takes the connect, or a pooled tunnel skips it  */
+    int tunnel = profile && profile->has_http_proxy;
+    const struct sockaddr *connaddr = tunnel?
+        (struct sockaddr*)&profile->http_proxy: (struct sockaddr*)&destaddr;
+    int destfd = -1;
+
+    if(tunnel && -1 != (destfd = httptunnel_pool_get(loop,
+                    (struct sockaddr*)&profile->http_proxy, (struct sockaddr*)&destaddr)) ) {
+        tunnel = 0;
+        goto connected;
+    }
+
+    /*  the proxy context races several addresses itself  */
+    if(!tunnel && naddrs > 1)
+        goto connected;
+
+    /*  an ejected or down destination fails fast, before any socket  */
+    if(-1 == health_acquire(loop, connaddr, &healthslot)) {
+        syslog(LOG_DEBUG, "relay_start: destination is unhealthy.");
+        if(PROXY_REPLY_SOCKS5 == reply) {
+            socks5_send_reply(clientfd, SOCKS5_REP_HOST_UNREACHABLE, NULL);
+            close_i(clientfd);
+        } else {
+            close_rst(clientfd);
+        }
+        admission_fd_closed(loop, 1);
+        srclimit_release(srcslot);
+        backend_release(backend);
         return;
     }
 
-    if(-1 == setnonblocking(destfd)) {
-        syslog(LOG_ERR, "setnonblocking: %m");
-        close_i(clientfd);
-        close_i(destfd);
+    destfd = socket(connaddr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(-1 == destfd) {
+        syslog(LOG_ERR, "socket: %m");
+        admission_accept_failed(loop, errno);
+        goto close_client;
     }
+    admission_fd_opened(loop, 1);
 
-    syslog(LOG_DEBUG, "accept_callback: connection accepted.");
-    if(-1 == connect(destfd, (struct sockaddr *)(&destaddr), sizeof(destaddr))) {
+    if(profile)
+        profile_apply_sockopts(profile, destfd, connaddr->sa_family);
+
+    syslog(LOG_DEBUG, "relay_start: connection accepted.");
+    if(-1 == connect(destfd, connaddr, sockaddr_len(connaddr))) {
         if(EINPROGRESS != errno) {
             syslog(LOG_ERR, "connect: %m");
-            close_i(clientfd);
-            close_i(destfd);
+            health_report(loop, healthslot, 0);
+            healthslot = HEALTH_NONE;
+            goto close_both;
         }
     }
 
+connected:
+    if(profile && profile->http_proxy_pool)
+        httptunnel_pool_fill(loop, profile, (struct sockaddr*)&destaddr);
+
     ProxyContext *ctx = NULL;
     if(-1 == proxy_context_new(&ctx, clientfd, destfd)) {
         syslog(LOG_ERR, "Couldn't create proxy context!");
-        close_i(clientfd);
-        close_i(destfd);
-        return;
+        admission_accept_failed(loop, ENOMEM);
+        goto close_both;
     }
+    proxy_context_set_source(ctx, srcslot);
+    proxy_context_set_backend(ctx, backend);
+    proxy_context_set_health(ctx, healthslot);
+    proxy_context_set_profile(ctx, profile);
+    proxy_context_set_reply(ctx, reply);
+    if(-1 == proxy_context_set_origin(ctx, src? src: peer, (struct sockaddr*)&destaddr)
+            || (-1 == destfd && -1 == proxy_context_set_race(ctx, addrs, naddrs)) ) {
+        proxy_context_free(ctx);
+        goto close_both;
+    }
+    if(tunnel)
+        proxy_context_set_tunnel(ctx);
     proxy_context_start(loop, ctx);
+    return;
+
+close_both:
+    if(-1 != destfd) {
+        close_i(destfd);
+        admission_fd_closed(loop, 1);
+    }
+close_client:
+    if(PROXY_REPLY_SOCKS5 == reply)
+        socks5_send_reply(clientfd, SOCKS5_REP_FAILURE, NULL);
+    close_i(clientfd);
+    admission_fd_closed(loop, 1);
+    srclimit_release(srcslot);
+    backend_release(backend);
+    health_release(healthslot);
 }
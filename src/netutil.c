@@ -0,0 +1,123 @@
+/*
+ * netutil.c - layer-4 proxy socket address helpers
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "netutil.h"
+
+socklen_t sockaddr_len(const struct sockaddr *addr) {
+    switch(addr->sa_family) {
+        case AF_INET:   return sizeof(struct sockaddr_in);
+        case AF_INET6:  return sizeof(struct sockaddr_in6);
+        default:        return sizeof(struct sockaddr_storage);
+    }
+}
+
+/* Formats addr as "IP:PORT" or "[IP6]:PORT" for logging. */
+const char *sockaddr_ntop(const struct sockaddr *addr, char *buf, size_t size) {
+    char host[INET6_ADDRSTRLEN];
+
+    if(AF_INET == addr->sa_family) {
+        const struct sockaddr_in *in = (const struct sockaddr_in*)addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(buf, size, "%s:%u", host, ntohs(in->sin_port));
+    } else if(AF_INET6 == addr->sa_family) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(buf, size, "[%s]:%u", host, ntohs(in6->sin6_port));
+    } else {
+        snprintf(buf, size, "<family %d>", addr->sa_family);
+    }
+    return buf;
+}
+
+/*
+ * Stores the address as 16 bytes, IPv4 v4-mapped, so both families share
+ * one key space; port, if not NULL, gets the port in network order.
+ */
+int sockaddr_key(const struct sockaddr *addr, unsigned char key[16], uint16_t *port) {
+    switch(addr->sa_family) {
+        case AF_INET:
+            memset(key, 0, 10);
+            key[10] = key[11] = 0xff;
+            memcpy(key + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+            if(port)
+                *port = ((const struct sockaddr_in*)addr)->sin_port;
+            return 0;
+        case AF_INET6:
+            memcpy(key, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+            if(port)
+                *port = ((const struct sockaddr_in6*)addr)->sin6_port;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/* Turns a v4-mapped AF_INET6 address into plain AF_INET, in place. */
+void sockaddr_unmap(struct sockaddr_storage *addr) {
+    struct sockaddr_in6 in6;
+    struct sockaddr_in *in = (struct sockaddr_in*)addr;
+
+    if(AF_INET6 != addr->ss_family)
+        return;
+    memcpy(&in6, addr, sizeof(in6));
+    if(!IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr))
+        return;
+    memset(addr, 0, sizeof(*addr));
+    in->sin_family = AF_INET;
+    in->sin_port = in6.sin6_port;
+    memcpy(&in->sin_addr, &in6.sin6_addr.s6_addr[12], 4);
+}
+
+/*
+ * Resolves "HOST:PORT" or "[IPV6]:PORT" with getaddrinfo(3), taking the
+ * first result. This blocks, so it is only meant for configuration.
+ */
+int sockaddr_resolve(const char *hostport, int socktype, struct sockaddr_storage *addr) {
+    char buf[256];
+    char *host, *port;
+    struct addrinfo hints, *result;
+    int ret;
+
+    if(strlen(hostport) >= sizeof(buf))
+        return -1;
+    strcpy(buf, hostport);
+
+    if('[' == buf[0]) {
+        host = buf + 1;
+        if(NULL == (port = strchr(host, ']')) || ':' != port[1])
+            return -1;
+        *port = '\0';
+        port += 2;
+    } else {
+        host = buf;
+        if(NULL == (port = strrchr(buf, ':')) )
+            return -1;
+        *port++ = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    if(0 != (ret = getaddrinfo(host, port, &hints, &result)) ) {
+        syslog(LOG_ERR, "getaddrinfo %s: %s", hostport, gai_strerror(ret));
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    return 0;
+}
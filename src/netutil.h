@@ -0,0 +1,27 @@
+/*
+ * netutil.h - layer-4 proxy socket address helpers
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef NETUTIL_H
+#define NETUTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Long enough for "[IPV6%SCOPE]:PORT".   */
+#define SOCKADDR_STRLEN     80
+
+socklen_t sockaddr_len(const struct sockaddr *addr);
+const char *sockaddr_ntop(const struct sockaddr *addr, char *buf, size_t size);
+int sockaddr_key(const struct sockaddr *addr, unsigned char key[16], uint16_t *port);
+void sockaddr_unmap(struct sockaddr_storage *addr);
+int sockaddr_resolve(const char *hostport, int socktype, struct sockaddr_storage *addr);
+
+#endif  /*  NETUTIL_H   */
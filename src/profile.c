@@ -0,0 +1,346 @@
+/*
+ * profile.c - layer-4 proxy per-destination profile module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "lpm.h"
+#include "profile.h"
+#include "proxyproto.h"
+#include "netutil.h"
+
+struct profile_table_t {
+    lpm_t           *lpm;
+    Profile         **profiles;     /*  lpm value N maps to profiles[N - 1] */
+    size_t          nprofiles;
+    size_t          cap;
+    size_t          refs;           /*  profiles held by connections    */
+    int             deleted;        /*  freed with the last of them     */
+};
+
+typedef int (*profileKeyFn)(Profile *profile, const char *value);
+
+static int key_rate(Profile *profile, const char *value) {
+    return shaper_parse_rate(value, &profile->rate, &profile->burst);
+}
+
+static int key_class_rate(Profile *profile, const char *value) {
+    double rate, burst;
+    int dir;
+
+    if(-1 == shaper_parse_rate(value, &rate, &burst))
+        return -1;
+    for(dir = 0; dir < SHAPER_DIRECTIONS; ++dir)
+        token_bucket_init(&profile->klass[dir], rate, burst);
+    return 0;
+}
+
+static int key_pacing(Profile *profile, const char *value) {
+    if(0 == strcmp(value, "hard"))
+        profile->pacing_hard = 1;
+    else if(0 == strcmp(value, "soft"))
+        profile->pacing_hard = 0;
+    else
+        return -1;
+    return 0;
+}
+
+static int key_congestion(Profile *profile, const char *value) {
+    if('\0' == *value || strlen(value) >= sizeof(profile->congestion))
+        return -1;
+    strcpy(profile->congestion, value);
+    profile->sockopts |= PROFILE_SOCKOPT_CONGESTION;
+    return 0;
+}
+
+static int parse_int(const char *value, int min, int max, int *out) {
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(value, &end, 0);
+    if(errno || end == value || v < min || v > max)
+        return -1;
+    switch(*end) {
+        case 'k': case 'K':     v <<= 10;   ++end;  break;
+        case 'm': case 'M':     v <<= 20;   ++end;  break;
+        default:                break;
+    }
+    if('\0' != *end || v > max)
+        return -1;
+    *out = (int)v;
+    return 0;
+}
+
+#define DEFINE_INT_KEY(name, field, bit, min, max)                      \
+    static int name(Profile *profile, const char *value) {              \
+        if(-1 == parse_int(value, min, max, &profile->field))           \
+            return -1;                                                  \
+        profile->sockopts |= bit;                                       \
+        return 0;                                                       \
+    }
+
+static int key_proxy_protocol(Profile *profile, const char *value) {
+    int version = proxyproto_parse_version(value);
+    if(-1 == version)
+        return -1;
+    profile->proxy_protocol = version;
+    return 0;
+}
+
+static int key_http_proxy(Profile *profile, const char *value) {
+    if(-1 == sockaddr_resolve(value, SOCK_STREAM, &profile->http_proxy))
+        return -1;
+    profile->has_http_proxy = 1;
+    return 0;
+}
+
+static int key_http_proxy_pool(Profile *profile, const char *value) {
+    return parse_int(value, 0, 16, &profile->http_proxy_pool);
+}
+
+DEFINE_INT_KEY(key_mss,           mss,            PROFILE_SOCKOPT_MSS,            88, 65535)
+DEFINE_INT_KEY(key_window_clamp,  window_clamp,   PROFILE_SOCKOPT_WINDOW_CLAMP,   0, 1 << 30)
+DEFINE_INT_KEY(key_notsent_lowat, notsent_lowat,  PROFILE_SOCKOPT_NOTSENT_LOWAT,  0, 1 << 30)
+DEFINE_INT_KEY(key_sndbuf,        sndbuf,         PROFILE_SOCKOPT_SNDBUF,         0, 1 << 30)
+DEFINE_INT_KEY(key_rcvbuf,        rcvbuf,         PROFILE_SOCKOPT_RCVBUF,         0, 1 << 30)
+DEFINE_INT_KEY(key_tos,           tos,            PROFILE_SOCKOPT_TOS,            0, 255)
+DEFINE_INT_KEY(key_ttl,           ttl,            PROFILE_SOCKOPT_TTL,            1, 255)
+
+static const struct {
+    const char      *key;
+    profileKeyFn    fn;
+} s_keys[] = {
+    {"rate",            key_rate},
+    {"class-rate",      key_class_rate},
+    {"pacing",          key_pacing},
+    {"congestion",      key_congestion},
+    {"mss",             key_mss},
+    {"window-clamp",    key_window_clamp},
+    {"notsent-lowat",   key_notsent_lowat},
+    {"sndbuf",          key_sndbuf},
+    {"rcvbuf",          key_rcvbuf},
+    {"tos",             key_tos},
+    {"ttl",             key_ttl},
+    {"proxy-protocol",  key_proxy_protocol},
+    {"http-proxy",      key_http_proxy},
+    {"http-proxy-pool", key_http_proxy_pool},
+};
+
+ProfileTable *profile_table_new(void) {
+    ProfileTable *table = (ProfileTable*)calloc(1, sizeof(ProfileTable));
+    if(NULL == table) {
+        syslog(LOG_ERR, "profile: calloc: %m");
+        return NULL;
+    }
+    if(NULL == (table->lpm = lpm_new()) ) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/*
+ * A table replaced by a reload is deleted while connections still use
+ * its profiles; it is only freed once the last of them released it.
+ */
+void profile_table_delete(ProfileTable *table) {
+    size_t i;
+
+    if(NULL == table)
+        return;
+    if(table->refs) {
+        table->deleted = 1;
+        return;
+    }
+    for(i = 0; i < table->nprofiles; ++i)
+        free(table->profiles[i]);
+    free(table->profiles);
+    lpm_delete(table->lpm);
+    free(table);
+}
+
+static int profile_set(Profile *profile, char *option) {
+    char *value = strchr(option, '=');
+    size_t i;
+
+    if(NULL == value)
+        return -1;
+    *value++ = '\0';
+    for(i = 0; i < sizeof(s_keys) / sizeof(s_keys[0]); ++i) {
+        if(0 == strcmp(option, s_keys[i].key))
+            return (*s_keys[i].fn)(profile, value);
+    }
+    return -1;
+}
+
+int profile_table_add(ProfileTable *table, const char *spec) {
+    char buf[512];
+    char *save, *prefixes, *option, *prefix;
+    unsigned char addr[16];
+    unsigned int plen;
+    int family;
+    Profile *profile;
+
+    if(strlen(spec) >= sizeof(buf))
+        goto invalid;
+    strcpy(buf, spec);
+    if(NULL == (prefixes = strtok_r(buf, " \t", &save)) )
+        goto invalid;
+
+    if(table->nprofiles == table->cap) {
+        size_t cap = table->cap? table->cap * 2: 16;
+        Profile **p = (Profile**)realloc(table->profiles, cap * sizeof(Profile*));
+        if(NULL == p)
+            goto nomem;
+        table->profiles = p;
+        table->cap = cap;
+    }
+    if(NULL == (profile = (Profile*)calloc(1, sizeof(Profile))) )
+        goto nomem;
+    table->profiles[table->nprofiles++] = profile;
+    profile->table = table;
+
+    while(NULL != (option = strtok_r(NULL, " \t", &save)) ) {
+        if(-1 == profile_set(profile, option))
+            goto invalid;
+    }
+
+    for(prefix = strtok_r(prefixes, ",", &save); prefix; prefix = strtok_r(NULL, ",", &save)) {
+        if(-1 == lpm_parse_prefix(prefix, &family, addr, &plen))
+            goto invalid;
+        uint32_t value = lpm_insert(table->lpm, family, addr, plen, table->nprofiles);
+        if(0 == value)
+            goto nomem;
+        if(value != table->nprofiles) {
+            syslog(LOG_ERR, "profile: %s is already covered by another profile", prefix);
+            return -1;
+        }
+    }
+    return 0;
+
+invalid:
+    syslog(LOG_ERR, "profile: invalid profile '%s'", spec);
+    return -1;
+nomem:
+    syslog(LOG_ERR, "profile: out of memory");
+    return -1;
+}
+
+/* One profile per line; blank lines and '#' comments are skipped. */
+int profile_table_load_file(ProfileTable *table, const char *path) {
+    FILE *fp;
+    char line[512];
+    int lineno = 0, ret = 0;
+
+    if(NULL == (fp = fopen(path, "r")) ) {
+        syslog(LOG_ERR, "profile: couldn't open %s: %m", path);
+        return -1;
+    }
+    while(0 == ret && NULL != fgets(line, sizeof(line), fp)) {
+        char *p = line_strip(line);
+
+        ++lineno;
+        if('\0' == *p)
+            continue;
+        if(-1 == (ret = profile_table_add(table, p)) )
+            syslog(LOG_ERR, "profile: %s:%d: rejected", path, lineno);
+    }
+    fclose(fp);
+    return ret;
+}
+
+int profile_table_compile(ProfileTable *table) {
+    if(-1 == lpm_compile(table->lpm, NULL, NULL))
+        return -1;
+    syslog(LOG_INFO, "profile: %zu destination profiles", table->nprofiles);
+    return 0;
+}
+
+Profile *profile_table_lookup(const ProfileTable *table, const struct sockaddr *addr) {
+    uint32_t value = lpm_lookup(table->lpm, addr);
+    return value? table->profiles[value - 1]: NULL;
+}
+
+/* Keeps the profile, and its class buckets, alive for a connection. */
+void profile_hold(Profile *profile) {
+    ++profile->table->refs;
+}
+
+void profile_release(Profile *profile) {
+    ProfileTable *table = profile->table;
+
+    if(0 == --table->refs && table->deleted)
+        profile_table_delete(table);
+}
+
+static void apply(Profile *profile, int fd, unsigned int bit, const char *name,
+        int level, int optname, const void *val, socklen_t len) {
+    if(0 == setsockopt(fd, level, optname, val, len))
+        return;
+    if(!(profile->sockopts_warned & bit)) {
+        syslog(LOG_WARNING, "profile: setsockopt(%s): %m", name);
+        profile->sockopts_warned |= bit;
+    }
+}
+
+/*
+ * Applies the profile's options to a fresh upstream socket, before
+ * connect() so that those affecting the handshake (MSS, window clamp,
+ * buffer sizes) take effect. Failures are logged once per option.
+ */
+void profile_apply_sockopts(Profile *profile, int fd, int family) {
+    unsigned int opts = profile->sockopts;
+    int v6 = AF_INET6 == family;
+
+    if(opts & PROFILE_SOCKOPT_CONGESTION)
+        apply(profile, fd, PROFILE_SOCKOPT_CONGESTION, "TCP_CONGESTION", IPPROTO_TCP, TCP_CONGESTION,
+                profile->congestion, strlen(profile->congestion));
+    if(opts & PROFILE_SOCKOPT_MSS)
+        apply(profile, fd, PROFILE_SOCKOPT_MSS, "TCP_MAXSEG", IPPROTO_TCP, TCP_MAXSEG,
+                &profile->mss, sizeof(int));
+    if(opts & PROFILE_SOCKOPT_WINDOW_CLAMP)
+        apply(profile, fd, PROFILE_SOCKOPT_WINDOW_CLAMP, "TCP_WINDOW_CLAMP", IPPROTO_TCP, TCP_WINDOW_CLAMP,
+                &profile->window_clamp, sizeof(int));
+    if(opts & PROFILE_SOCKOPT_NOTSENT_LOWAT)
+        apply(profile, fd, PROFILE_SOCKOPT_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &profile->notsent_lowat, sizeof(int));
+    if(opts & PROFILE_SOCKOPT_SNDBUF)
+        apply(profile, fd, PROFILE_SOCKOPT_SNDBUF, "SO_SNDBUF", SOL_SOCKET, SO_SNDBUF,
+                &profile->sndbuf, sizeof(int));
+    if(opts & PROFILE_SOCKOPT_RCVBUF)
+        apply(profile, fd, PROFILE_SOCKOPT_RCVBUF, "SO_RCVBUF", SOL_SOCKET, SO_RCVBUF,
+                &profile->rcvbuf, sizeof(int));
+    if(opts & PROFILE_SOCKOPT_TOS) {
+        if(v6)
+            apply(profile, fd, PROFILE_SOCKOPT_TOS, "IPV6_TCLASS", IPPROTO_IPV6, IPV6_TCLASS,
+                    &profile->tos, sizeof(int));
+        else
+            apply(profile, fd, PROFILE_SOCKOPT_TOS, "IP_TOS", IPPROTO_IP, IP_TOS,
+                    &profile->tos, sizeof(int));
+    }
+    if(opts & PROFILE_SOCKOPT_TTL) {
+        if(v6)
+            apply(profile, fd, PROFILE_SOCKOPT_TTL, "IPV6_UNICAST_HOPS", IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+                    &profile->ttl, sizeof(int));
+        else
+            apply(profile, fd, PROFILE_SOCKOPT_TTL, "IP_TTL", IPPROTO_IP, IP_TTL,
+                    &profile->ttl, sizeof(int));
+    }
+}
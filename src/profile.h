@@ -0,0 +1,78 @@
+/*
+ * profile.h - layer-4 proxy per-destination profile module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "shaper.h"
+
+/* Bits of Profile.sockopts. */
+enum {
+    PROFILE_SOCKOPT_CONGESTION      = 1 << 0,
+    PROFILE_SOCKOPT_MSS             = 1 << 1,
+    PROFILE_SOCKOPT_WINDOW_CLAMP    = 1 << 2,
+    PROFILE_SOCKOPT_NOTSENT_LOWAT   = 1 << 3,
+    PROFILE_SOCKOPT_SNDBUF          = 1 << 4,
+    PROFILE_SOCKOPT_RCVBUF          = 1 << 5,
+    PROFILE_SOCKOPT_TOS             = 1 << 6,
+    PROFILE_SOCKOPT_TTL             = 1 << 7,
+};
+
+/*
+ * A profile holds the settings for every destination covered by one of
+ * its prefixes, written "PREFIX[,PREFIX...] key=value ...". The longest
+ * matching prefix picks the profile.
+ */
+typedef struct profile_t {
+    /*  shaping */
+    double          rate;           /*  per flow and direction, bytes/s */
+    double          burst;
+    int             pacing_hard;    /*  SO_MAX_PACING_RATE for the flow */
+    TokenBucket     klass[SHAPER_DIRECTIONS];
+
+    /*  upstream socket options, each applied if its bit is in sockopts */
+    unsigned int    sockopts;
+    unsigned int    sockopts_warned;
+    char            congestion[16];
+    int             mss;
+    int             window_clamp;
+    int             notsent_lowat;
+    int             sndbuf;
+    int             rcvbuf;
+    int             tos;
+    int             ttl;
+
+    int             proxy_protocol; /*  PROXYPROTO_V1/V2 header to the upstream */
+
+    /*  reach the destination through an HTTP CONNECT egress proxy  */
+    int             has_http_proxy;
+    struct sockaddr_storage http_proxy;
+    int             http_proxy_pool;    /*  handshaken tunnels kept ready   */
+
+    struct profile_table_t *table;  /*  the profile belongs to  */
+} Profile;
+
+typedef struct profile_table_t ProfileTable;
+
+ProfileTable *profile_table_new(void);
+void profile_table_delete(ProfileTable *table);
+
+int profile_table_add(ProfileTable *table, const char *spec);
+int profile_table_load_file(ProfileTable *table, const char *path);
+int profile_table_compile(ProfileTable *table);
+
+Profile *profile_table_lookup(const ProfileTable *table, const struct sockaddr *addr);
+void profile_hold(Profile *profile);
+void profile_release(Profile *profile);
+void profile_apply_sockopts(Profile *profile, int fd, int family);
+
+#endif  /*  PROFILE_H   */
@@ -8,6 +8,7 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,234 +17,1148 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #include <ev.h>
 
 #include "utils.h"
+#include "netutil.h"
 #include "fifobuf.h"
+#include "admission.h"
+#include "srclimit.h"
+#include "profile.h"
+#include "shaper.h"
+#include "proxyproto.h"
+#include "httptunnel.h"
+#include "health.h"
 #include "proxy.h"
+#include "backends/backend.h"
+#include "backends/socks5.h"
 
-#define PROXY_BUFFER_SIZE   2048
+#define PROXY_BUFFER_BYTES(buf)     (sizeof(fifobuf_t) + (buf)->size)
 
-typedef struct read_context_t ReadContext;
-typedef struct write_context_t WriteContext;
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL         69
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY                 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY                0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
+#endif
 
-struct read_context_t {
-    ev_io           io;
-    fifobuf_t       *buf;
-    WriteContext    *dst;
-    ProxyContext    *proxy;
-    int             connected;
-};
+/* Zerocopy sends in flight per connection, each pinning one buffer. */
+#define PROXY_ZEROCOPY_PINNED       16
+/* How long buffers are kept once their socket closed before completing. */
+#define PROXY_ZEROCOPY_LINGER       30.
 
-struct write_context_t {
-    ev_io           io;
-    fifobuf_t       *buf;
-    ReadContext     *src;
-    ProxyContext    *proxy;
-    int             connected;
-};
+/*
+ * Connect racing, after RFC 8305: the addresses of a destination are
+ * tried in order, the next one starting once the last one failed or
+ * hasn't connected within the race delay. The first one to connect
+ * becomes the remote socket, the others are closed.
+ */
+typedef struct {
+    ev_io           io;         /*  fd is -1 unless connecting  */
+    ev_timer        timer;      /*  gives up on it after the connect timeout    */
+    int             health;
+} RaceAttempt;
+
+typedef struct {
+    ev_timer                timer;      /*  starts the next attempt */
+    struct sockaddr_storage addrs[PROXY_RACE_MAX];
+    RaceAttempt             attempts[PROXY_RACE_MAX];
+    size_t                  naddrs;
+    size_t                  next;       /*  first address not tried yet */
+    size_t                  running;
+    int                     err;        /*  of the last failed attempt  */
+} Race;
+
+/*
+ * A remote socket's connect, timed by its place in s_connecting. Every
+ * one waits for the same timeout, so they time out in the order they
+ * started.
+ */
+typedef struct {
+    uint64_t        id;
+    ev_tstamp       since;
+} Connecting;
+
+/*
+ * A connection handed to the next binary: one SOCK_SEQPACKET message
+ * carrying the client and remote sockets as SCM_RIGHTS, this record,
+ * the destination profiles are looked up by, and what either buffer
+ * held, client to remote first.
+ */
+typedef struct {
+    uint32_t        dstlen;
+    uint32_t        up;         /*  bytes client to remote      */
+    uint32_t        down;       /*  bytes remote to client      */
+    uint32_t        idle_ms;    /*  since last active           */
+} MigrateRecord;
+
+/*
+ * A relay buffer sent from with MSG_ZEROCOPY. The kernel keeps reading
+ * it until the completion for the send shows up on the socket's error
+ * queue, so nothing is read into or shifted around in it until then.
+ */
+typedef struct pinned_buffer_t {
+    struct pinned_buffer_t  *next;
+    fifobuf_t               *buf;
+    uint32_t                id;         /*  of the send, as the kernel counts them  */
+    ev_tstamp               until;      /*  freed then if the socket closed first   */
+} PinnedBuffer;
+
+/*
+ * The remote socket's zerocopy sends, oldest first. Completions may be
+ * reported out of order, so those past the first one missing are kept
+ * as bits until the gap is filled.
+ */
+typedef struct {
+    PinnedBuffer            *head;
+    PinnedBuffer            **tail;
+    uint32_t                next;       /*  id of the next send */
+    uint32_t                done;       /*  every send before completed */
+    uint32_t                acked;      /*  completed from done on, a bit each  */
+} ZeroCopy;
+
+/* The client's addresses, kept for headers and requests sent upstream. */
+typedef struct {
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+} ProxyOrigin;
+
+/*
+ * Each socket of a connection is polled by one watcher for both
+ * directions, its data pointing back to the connection. Bytes read from
+ * the client go up, through buf[SHAPER_UP], to the remote, and the other
+ * way round. Per-side flags are bitmasks of SIDE_BIT(side).
+ */
+enum { SIDE_CLIENT, SIDE_REMOTE, SIDES };
+
+#define SIDE_BIT(side)      (1u << (side))
+#define SIDE_BOTH           (SIDE_BIT(SIDE_CLIENT) | SIDE_BIT(SIDE_REMOTE))
+#define SIDE_OTHER(side)    (SIDES - 1 - (side))
+#define SIDE_IN(side)       (SIDE_CLIENT == (side)? SHAPER_UP: SHAPER_DOWN)
+#define SIDE_OUT(side)      (SIDE_CLIENT == (side)? SHAPER_DOWN: SHAPER_UP)
+
+#define PROXY_CACHE_LINE    64
 
+/*
+ * Everything a read or write touches besides its watcher is in the first
+ * cache line, what only setup, teardown and the control socket need
+ * comes last. Contexts are allocated on cache line boundaries.
+ */
 struct proxy_context_t {
-    ReadContext     client_read_ctx;
-    WriteContext    client_write_ctx;
-    ReadContext     remote_read_ctx;
-    WriteContext    remote_write_ctx;
+    fifobuf_t       *buf[SHAPER_DIRECTIONS];
+    Shaper          *shaper;
+    ProxyContext    *lru_prev;  /*  least recently active first, for shedding   */
+    ProxyContext    *lru_next;
+    ev_tstamp       last_active;
+    unsigned        can_read:2;     /*  sides not closed for reading    */
+    unsigned        can_write:2;    /*  nor for writing, the remote once connected  */
+    unsigned        throttled:2;    /*  sides not read until the shaper refilled    */
+    unsigned        lowat:1;        /*  read only into empty buffers    */
+    unsigned        corked:1;       /*  upstream held until payload follows */
+    unsigned        tunnel:1;       /*  waiting for the CONNECT response    */
+    unsigned        reply:2;        /*  PROXY_REPLY_* owed to the client    */
+    unsigned        readable:2;     /*  edge-triggered: sides not read to EAGAIN    */
+    unsigned        writable:2;     /*  nor written to EAGAIN   */
+    unsigned        queued:1;       /*  on the ready list   */
+    unsigned        nozerocopy:1;   /*  upstream writes always copied   */
+    unsigned        connecting:1;   /*  queued in s_connecting  */
+    int             header_left;    /*  PROXY header bytes not written  */
+    uint32_t        slot;           /*  in s_slots, with its generation the id  */
+
+    ev_io           io[SIDES];
+    uint64_t        bytes[SHAPER_DIRECTIONS];   /*  read from either side   */
+
+    ev_tstamp       opened;
+    Profile         *profile;
+    ProxyOrigin     *origin;
+    Race            *race;          /*  connect attempts, until one won     */
+    int             srcslot;
+    int             backend;        /*  token for backend_release()     */
+    int             health;         /*  slot the connect is reported to */
+    ZeroCopy        *zerocopy;      /*  from the first zerocopy send on */
 };
 
+#define PROXY_CONTEXT_LINES     4
+#define PROXY_CONTEXT_ALLOC     (PROXY_CONTEXT_LINES * PROXY_CACHE_LINE)
+
+_Static_assert(offsetof(ProxyContext, io) <= PROXY_CACHE_LINE,
+        "hot ProxyContext fields don't fit into the first cache line");
+_Static_assert(sizeof(ProxyContext) <= PROXY_CONTEXT_ALLOC,
+        "ProxyContext grew beyond PROXY_CONTEXT_LINES cache lines");
+
+/*
+ * Every context has a slot in one array, from proxy_context_new() until
+ * it is freed, so that all of them can be walked without chasing
+ * pointers and found by id at once. Free slots are chained and reused
+ * latest first. A slot's generation changes as its context goes, so an
+ * id never finds the context that took the slot over.
+ */
+typedef struct {
+    ProxyContext    *ctx;       /*  NULL while free */
+    uint32_t        gen;
+    uint32_t        next_free;
+} ProxySlot;
+
+#define PROXY_SLOTS_MIN     256
+#define PROXY_SLOTS_MAX     (1u << 31)  /*  a side fits next to the slot    */
+#define PROXY_SLOT_NONE     UINT32_MAX
+
+static ProxySlot *s_slots;
+static uint32_t s_nslots;       /*  ever used, free or not  */
+static uint32_t s_capacity;
+static uint32_t s_free_slot = PROXY_SLOT_NONE;
+
+static ProxyContext *s_lru_head;
+static ProxyContext *s_lru_tail;
+
+/*
+ * In edge-triggered mode both sockets of every context are added once to
+ * a private epoll set, which libev polls like any other descriptor.
+ * What epoll reports is kept per side until a read or write runs into
+ * EAGAIN, and contexts that can get further are queued by id and relayed
+ * a step per pass, so interest never has to change in between.
+ */
+#define PROXY_EDGE_EVENTS   256
+
+static int s_edge_fd = -1;
+static ev_io s_edge;
+static ev_prepare s_edge_prepare;
+static ev_idle s_edge_idle;         /*  keeps the loop from blocking while queued  */
+static uint64_t *s_ready;
+static size_t s_nready;
+static size_t s_ready_size;
+static int s_ready_lost;            /*  a push failed, rescan before blocking  */
+
+/*
+ * Remote connects that aren't raced, oldest first. The timer is only set
+ * for the first one, contexts that connected or went meanwhile are
+ * skipped once they come up. Race attempts have their own timers.
+ */
+static Connecting *s_connecting;
+static size_t s_connecting_head;    /*  first one still timed   */
+static size_t s_nconnecting;
+static size_t s_connecting_size;
+static ev_timer s_connect_timer;
+
+static PinnedBuffer *s_limbo;       /*  of sockets closed before completing */
+static PinnedBuffer **s_limbo_tail = &s_limbo;
+static ev_timer s_limbo_timer;
+
+static int s_notsent_lowat;
+static size_t s_zerocopy;           /*  smallest write sent zerocopy, 0 for none    */
+static int s_busy_poll;             /*  SO_BUSY_POLL microseconds, 0 for none   */
+static int s_prefer_busy_poll;      /*  SO_PREFER_BUSY_POLL along with it   */
+static ev_tstamp s_race_delay = PROXY_RACE_DELAY;
+static ev_tstamp s_connect_timeout = PROXY_CONNECT_TIMEOUT;
+static size_t s_buffer_size = PROXY_BUFFER_SIZE;
+
 static int proxy_context_delete(EV_P_ ProxyContext *ctx);
 static void state_transist(EV_P_ ProxyContext *ctx);
+static void close_side(EV_P_ ProxyContext *proxy, int side);
+static void watch(EV_P_ ev_io *io, int events);
+static int wanted(const ProxyContext *ctx, int side);
+
+static int edge_add(ProxyContext *proxy, int side, int ready);
+static void edge_callback(EV_P_ ev_io *watcher, int revents);
+static void edge_prepare_callback(EV_P_ ev_prepare *watcher, int revents);
+static void edge_idle_callback(EV_P_ ev_idle *watcher, int revents);
+static void ready_push(ProxyContext *proxy);
+static void ready_rescan(void);
 
-static void read_callback(EV_P_ ev_io *watcher, int revents);
-static void write_callback(EV_P_ ev_io *watcher, int revents);
+static int slot_insert(ProxyContext *ctx);
+static void slot_remove(ProxyContext *ctx);
+static uint64_t context_id(const ProxyContext *ctx);
 
-static void connect_callback(EV_P_ ev_io *watcher, int revents);
-static void disconnect_callback(EV_P_ ev_io *watcher, int revents);
+static void lru_unlink(ProxyContext *ctx);
+static void lru_append(ProxyContext *ctx);
+static void lru_touch(EV_P_ ProxyContext *ctx);
+
+static void io_callback(EV_P_ ev_io *watcher, int revents);
+static void read_ready(EV_P_ ProxyContext *proxy, int side);
+static void write_ready(EV_P_ ProxyContext *proxy, int side);
+
+static int relay_setup(EV_P_ ProxyContext *proxy, size_t size);
+static void connect_callback(EV_P_ ProxyContext *proxy);
+static void connecting_push(EV_P_ ProxyContext *proxy);
+static void connect_timer_callback(EV_P_ ev_timer *watcher, int revents);
+static void disconnect(EV_P_ ProxyContext *proxy, int side, int events);
+
+static int send_proxy_header(ProxyContext *proxy);
+static void uncork(ProxyContext *proxy, size_t written);
+static void queue_socks5_reply(ProxyContext *proxy);
+static void upstream_ready(EV_P_ ProxyContext *proxy);
+static void upstream_failed(EV_P_ ProxyContext *proxy, int socks5_rep);
+static void tunnel_read(EV_P_ ProxyContext *proxy);
+static void remote_lowat(ProxyContext *proxy);
+static void busy_poll(int fd);
+
+static void race_next(EV_P_ ProxyContext *proxy);
+static void race_delete(EV_P_ ProxyContext *proxy);
+static int race_stop(EV_P_ Race *race, RaceAttempt *attempt, int ok);
+static void race_failed(EV_P_ ProxyContext *proxy, int fd, int err);
+static void race_callback(EV_P_ ev_io *watcher, int revents);
+static void race_timer_callback(EV_P_ ev_timer *watcher, int revents);
+static void race_timeout_callback(EV_P_ ev_timer *watcher, int revents);
+
+static void throttle(EV_P_ ProxyContext *proxy, int side, size_t want);
+static void throttle_callback(EV_P_ ev_timer *watcher, int revents);
+
+static ssize_t zerocopy_send(EV_P_ ProxyContext *proxy);
+static void zerocopy_reap(EV_P_ ProxyContext *proxy);
+static void zerocopy_close(EV_P_ ProxyContext *proxy);
+static void pinned_free(EV_P_ PinnedBuffer *pin);
+static void limbo_callback(EV_P_ ev_timer *watcher, int revents);
 
 int proxy_context_new(ProxyContext **pctx, int fd0, int fd1) {
-    ProxyContext *ctx = (ProxyContext*)malloc(sizeof(ProxyContext));
+    ProxyContext *ctx = (ProxyContext*)aligned_alloc(PROXY_CACHE_LINE, PROXY_CONTEXT_ALLOC);
     if(NULL == ctx) {
-        syslog(LOG_ERR, "malloc failed");
+        syslog(LOG_ERR, "aligned_alloc failed");
         *pctx = NULL;
         return -1;
     }
     memset(ctx, 0, sizeof(ProxyContext));
+    if(-1 == slot_insert(ctx)) {
+        syslog(LOG_ERR, "realloc failed");
+        free(ctx);
+        *pctx = NULL;
+        return -1;
+    }
+    ctx->srcslot = SRCLIMIT_NONE;
+    ctx->backend = BACKEND_NONE;
+    ctx->health = HEALTH_NONE;
 
-    ctx->client_read_ctx.dst = &ctx->remote_write_ctx;
-    ctx->client_write_ctx.src = &ctx->remote_read_ctx;
-    ctx->remote_read_ctx.dst = &ctx->client_write_ctx;
-    ctx->remote_write_ctx.src = &ctx->client_read_ctx;
+    ev_io_init(&ctx->io[SIDE_CLIENT], &io_callback, fd0, EV_READ);
+    ev_io_init(&ctx->io[SIDE_REMOTE], &io_callback, fd1, EV_WRITE);
+    ctx->io[SIDE_CLIENT].data = ctx;
+    ctx->io[SIDE_REMOTE].data = ctx;
 
-    ctx->client_read_ctx.proxy = ctx;
-    ctx->client_write_ctx.proxy = ctx;
-    ctx->remote_read_ctx.proxy = ctx;
-    ctx->remote_write_ctx.proxy = ctx;
+    *pctx = ctx;
+    return 0;
+}
 
-    ev_io_init(&ctx->client_read_ctx.io, &read_callback, fd0, EV_READ);
-    ev_io_init(&ctx->client_write_ctx.io, &write_callback, fd0, EV_WRITE);
-    ev_io_init(&ctx->remote_read_ctx.io, &read_callback, fd1, EV_READ);
-    ev_io_init(&ctx->remote_write_ctx.io, &write_callback, fd1, EV_WRITE);
+void proxy_context_set_source(ProxyContext *ctx, int srcslot) {
+    ctx->srcslot = srcslot;
+}
 
-    *pctx = ctx;
+/*
+ * With a non-zero lowat both sockets of every context get
+ * TCP_NOTSENT_LOWAT, so they only poll writable once the kernel is
+ * close to sending what it has. Readers then only run while the buffer
+ * they fill is empty, and what they read is written through at once;
+ * anything the peer can't take stays unread in the source socket,
+ * where TCP flow control pushes back on the sender.
+ */
+void proxy_set_notsent_lowat(int lowat) {
+    s_notsent_lowat = lowat;
+}
+
+/* A delay of 0 only tries the next address once the last one failed. */
+void proxy_set_race_delay(ev_tstamp delay) {
+    s_race_delay = delay;
+}
+
+/*
+ * A timeout of 0 leaves connects to the kernel's SYN retries. Attempts
+ * of a race keep the timeout they started with.
+ */
+void proxy_set_connect_timeout(ev_tstamp timeout) {
+    s_connect_timeout = timeout;
+}
+
+/* Connections keep the buffers they got, new ones get this size. */
+void proxy_set_buffer_size(size_t size) {
+    s_buffer_size = size;
+}
+
+void proxy_set_zerocopy(size_t threshold) {
+    s_zerocopy = threshold;
+}
+
+void proxy_set_busy_poll(int usecs) {
+    s_busy_poll = usecs;
+    s_prefer_busy_poll = 0 != usecs;
+}
+
+/* Must come before the first context is started. */
+int proxy_set_edge_triggered(EV_P) {
+    if(-1 == (s_edge_fd = epoll_create1(EPOLL_CLOEXEC)) ) {
+        syslog(LOG_ERR, "epoll_create1: %m");
+        return -1;
+    }
+    ev_io_init(&s_edge, edge_callback, s_edge_fd, EV_READ);
+    ev_io_start(loop, &s_edge);
+    ev_prepare_init(&s_edge_prepare, edge_prepare_callback);
+    ev_prepare_start(loop, &s_edge_prepare);
+    ev_idle_init(&s_edge_idle, edge_idle_callback);
     return 0;
 }
 
+void proxy_context_set_backend(ProxyContext *ctx, int token) {
+    ctx->backend = token;
+}
+
+void proxy_context_set_health(ProxyContext *ctx, int slot) {
+    ctx->health = slot;
+}
+
+void proxy_context_set_profile(ProxyContext *ctx, Profile *profile) {
+    if(profile)
+        profile_hold(profile);
+    ctx->profile = profile;
+}
+
+void proxy_context_set_reply(ProxyContext *ctx, int reply) {
+    ctx->reply = reply;
+}
+
+/*
+ * Keeps the client's source and destination, which may have come from a
+ * PROXY header, for a PROXY header or CONNECT request sent upstream.
+ * They are only kept if the profile asks for either.
+ */
+int proxy_context_set_origin(ProxyContext *ctx, const struct sockaddr *src, const struct sockaddr *dst) {
+    if(!(ctx->profile && (ctx->profile->proxy_protocol || ctx->profile->has_http_proxy)))
+        return 0;
+    if(NULL == (ctx->origin = (ProxyOrigin*)malloc(sizeof(ProxyOrigin))) ) {
+        syslog(LOG_ERR, "<%p> malloc failed", ctx);
+        return -1;
+    }
+    memcpy(&ctx->origin->src, src, sockaddr_len(src));
+    memcpy(&ctx->origin->dst, dst, sockaddr_len(dst));
+    return 0;
+}
+
+/* The remote socket goes to an HTTP proxy, CONNECT once it is up. */
+void proxy_context_set_tunnel(ProxyContext *ctx) {
+    ctx->tunnel = 1;
+}
+
+/*
+ * Races connects to addrs instead of connecting the remote socket, which
+ * must have been -1. It stays that way until one of them won.
+ */
+int proxy_context_set_race(ProxyContext *ctx, const struct sockaddr_storage *addrs, size_t naddrs) {
+    Race *race;
+    size_t i;
+
+    if(naddrs > PROXY_RACE_MAX)
+        naddrs = PROXY_RACE_MAX;
+    if(NULL == (race = (Race*)malloc(sizeof(Race))) ) {
+        syslog(LOG_ERR, "<%p> malloc failed", ctx);
+        return -1;
+    }
+    memcpy(race->addrs, addrs, naddrs * sizeof(struct sockaddr_storage));
+    for(i = 0; i < naddrs; ++i) {
+        ev_io_init(&race->attempts[i].io, race_callback, -1, EV_WRITE);
+        race->attempts[i].io.data = ctx;
+        ev_init(&race->attempts[i].timer, race_timeout_callback);
+        race->attempts[i].timer.data = ctx;
+        race->attempts[i].health = HEALTH_NONE;
+    }
+    ev_init(&race->timer, race_timer_callback);
+    race->timer.data = ctx;
+    race->naddrs = naddrs;
+    race->next = 0;
+    race->running = 0;
+    race->err = EHOSTUNREACH;   /*  if every address is unhealthy   */
+    ctx->race = race;
+    return 0;
+}
+
+/* For contexts that were never started, their sockets stay with the caller. */
+void proxy_context_free(ProxyContext *ctx) {
+    if(ctx->profile)
+        profile_release(ctx->profile);
+    slot_remove(ctx);
+    free(ctx->race);
+    free(ctx->origin);
+    free(ctx);
+}
+
 int proxy_context_start(EV_P_ ProxyContext *ctx) {
-    ctx->client_read_ctx.connected = 1;
-    ctx->client_write_ctx.connected = 1;
+    ctx->can_read = ctx->can_write = SIDE_BIT(SIDE_CLIENT);
+
+    ctx->opened = ctx->last_active = ev_now(loop);
+    lru_append(ctx);
+    admission_context_opened(loop);
+
+    if(s_notsent_lowat) {
+        setsockopt(ctx->io[SIDE_CLIENT].fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &s_notsent_lowat, sizeof(s_notsent_lowat));
+        ctx->lowat = 1;
+    }
+
+    if(ctx->race) {
+        if(-1 != s_edge_fd && -1 == edge_add(ctx, SIDE_CLIENT, 1)) {
+            proxy_context_delete(loop, ctx);
+            return -1;
+        }
+        race_next(loop, ctx);
+        if(0 == ctx->race->running) {
+            upstream_failed(loop, ctx, socks5_reply_code(ctx->race->err));
+            return -1;
+        }
+        return 0;
+    }
+    remote_lowat(ctx);
+    connecting_push(loop, ctx);
 
-    assert(EV_WRITE & ctx->remote_write_ctx.io.events);
-    ev_io_start(loop, &ctx->remote_write_ctx.io);
+    if(-1 != s_edge_fd) {
+        /*  the connect reports its edge once it finished  */
+        if(-1 == edge_add(ctx, SIDE_CLIENT, 1) || -1 == edge_add(ctx, SIDE_REMOTE, 0)) {
+            proxy_context_delete(loop, ctx);
+            return -1;
+        }
+        return 0;
+    }
+    assert(EV_WRITE & ctx->io[SIDE_REMOTE].events);
+    ev_io_start(loop, &ctx->io[SIDE_REMOTE]);
     return 0;
 }
 
-static void read_callback(EV_P_ ev_io *watcher, int revents) {
-    ReadContext *ctx = (ReadContext*)watcher;
-    ProxyContext *proxy = ctx->proxy;
+/* A profile's notsent-lowat takes precedence on the remote socket. */
+static void remote_lowat(ProxyContext *proxy) {
+    if(proxy->lowat && !(proxy->profile && (proxy->profile->sockopts & PROFILE_SOCKOPT_NOTSENT_LOWAT)))
+        setsockopt(proxy->io[SIDE_REMOTE].fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &s_notsent_lowat, sizeof(s_notsent_lowat));
+}
+
+/*
+ * Raising SO_BUSY_POLL above net.core.busy_read, and SO_PREFER_BUSY_POLL
+ * at all, take CAP_NET_ADMIN. Either option that fails is left to the
+ * sysctls from then on, the other one is still set.
+ */
+static void busy_poll(int fd) {
+    int opt = 1;
+
+    if(s_busy_poll && -1 == setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                &s_busy_poll, sizeof(s_busy_poll))) {
+        syslog(LOG_WARNING, "busy_poll: SO_BUSY_POLL: %m, left to net.core.busy_read");
+        s_busy_poll = 0;
+    }
+    if(s_prefer_busy_poll && -1 == setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                &opt, sizeof(opt))) {
+        syslog(LOG_WARNING, "busy_poll: SO_PREFER_BUSY_POLL: %m, not preferred");
+        s_prefer_busy_poll = 0;
+    }
+}
+
+/*
+ * Writes go first, they make room for reads. The context may be gone
+ * after either, which its id tells without touching it.
+ */
+static void io_callback(EV_P_ ev_io *watcher, int revents) {
+    ProxyContext *proxy = (ProxyContext*)watcher->data;
+    int side = (int)(watcher - proxy->io);
+    uint64_t id = context_id(proxy);
+
+    /*  completions raise POLLERR until read    */
+    if(SIDE_REMOTE == side && proxy->zerocopy && proxy->zerocopy->head)
+        zerocopy_reap(loop, proxy);
+    if(EV_WRITE & revents) {
+        write_ready(loop, proxy, side);
+        if(proxy != proxy_context_find(id))
+            return;
+    }
+    if((EV_READ & revents) && ev_is_active(watcher) && (EV_READ & watcher->events))
+        read_ready(loop, proxy, side);
+}
+
+static void read_ready(EV_P_ ProxyContext *proxy, int side) {
+    int dir = SIDE_IN(side);
+    fifobuf_t *buf = proxy->buf[dir];
+    size_t want = fifobuf_capacity(buf);
+
+    if(proxy->tunnel) {
+        tunnel_read(loop, proxy);
+        return;
+    }
+    if(proxy->shaper && 0 == (want = shaper_allowance(loop, proxy->shaper, dir, want)) ) {
+        throttle(loop, proxy, side, fifobuf_capacity(buf));
+        return;
+    }
 
     ssize_t nread;
-    if(-1 == (nread = read(ctx->io.fd, fifobuf_space(ctx->buf), fifobuf_capacity(ctx->buf))) ) {
+    if(-1 == (nread = read(proxy->io[side].fd, fifobuf_space(buf), want)) ) {
         if(EAGAIN == errno || EWOULDBLOCK == errno) {
-            /*  do nothing  */
+            proxy->readable &= ~SIDE_BIT(side);
         } else {
             syslog(LOG_ERR, "<%p> read: %m", proxy);
             proxy_context_delete(loop, proxy);
             return;
         }
     } else if(0 == nread) {
-        disconnect_callback(loop, watcher, revents);
+        disconnect(loop, proxy, side, EV_READ);
         return;
     } else {
-        fifobuf_push_back(ctx->buf, NULL, nread);
+        fifobuf_push_back(buf, NULL, nread);
+        proxy->bytes[dir] += nread;
+        if(proxy->shaper)
+            shaper_consume(proxy->shaper, dir, nread);
+        lru_touch(loop, proxy);
+        if(proxy->lowat) {
+            /*  the buffer was empty, so the peer was ready for more   */
+            write_ready(loop, proxy, SIDE_OTHER(side));
+            return;
+        }
         state_transist(loop, proxy);
     }
 }
 
-static void write_callback(EV_P_ ev_io *watcher, int revents) {
-    WriteContext *ctx = (WriteContext*)watcher;
-    ProxyContext *proxy = ctx->proxy;
+static void write_ready(EV_P_ ProxyContext *proxy, int side) {
+    fifobuf_t *buf = proxy->buf[SIDE_OUT(side)];
 
-    if(!ctx->connected) {
-        connect_callback(loop, watcher, revents);
+    if(!(proxy->can_write & SIDE_BIT(side))) {
+        connect_callback(loop, proxy);
         return;
     }
 
     ssize_t nwrite;
-    if(-1 == (nwrite = write(ctx->io.fd, fifobuf_buf(ctx->buf), fifobuf_amount(ctx->buf))) ) {
+    if(SIDE_REMOTE == side && s_zerocopy && fifobuf_amount(buf) >= s_zerocopy && !proxy->nozerocopy)
+        nwrite = zerocopy_send(loop, proxy);
+    else if(-1 != (nwrite = write(proxy->io[side].fd, fifobuf_buf(buf), fifobuf_amount(buf))) )
+        fifobuf_pop_front(buf, NULL, nwrite);
+    if(-1 == nwrite) {
         if(EPIPE == errno) {
-            disconnect_callback(loop, watcher, revents);
+            disconnect(loop, proxy, side, EV_WRITE);
             return;
         } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
-            /*  do nothing  */
+            /*  written through from read_ready(), wait for the socket */
+            proxy->writable &= ~SIDE_BIT(side);
+            state_transist(loop, proxy);
         } else {
             syslog(LOG_ERR, "<%p> write: %m", proxy);
             proxy_context_delete(loop, proxy);
             return;
         }
     } else {
-        fifobuf_pop_front(ctx->buf, NULL, nwrite);
+        if(proxy->corked && SIDE_REMOTE == side)
+            uncork(proxy, nwrite);
+        lru_touch(loop, proxy);
         state_transist(loop, proxy);
     }
 }
 
-static void connect_callback(EV_P_ ev_io *watcher, int revents) {
-    WriteContext *ctx = (WriteContext*)watcher;
-    ProxyContext *proxy = ctx->proxy;
+/* Buffers and shaper, once both sides are connected. */
+static int relay_setup(EV_P_ ProxyContext *proxy, size_t size) {
+    int dir;
+
+    for(dir = 0; dir < SHAPER_DIRECTIONS; ++dir) {
+        if(NULL == (proxy->buf[dir] = fifobuf_new(size)) ) {
+            syslog(LOG_ERR, "<%p> fifobuf_new failed! Cleaning up...", proxy);
+            return -1;
+        }
+        admission_buffer_alloc(loop, PROXY_BUFFER_BYTES(proxy->buf[dir]));
+    }
+    if(s_busy_poll || s_prefer_busy_poll) {
+        busy_poll(proxy->io[SIDE_CLIENT].fd);
+        busy_poll(proxy->io[SIDE_REMOTE].fd);
+    }
+
+    if(-1 == shaper_new(loop, &proxy->shaper, proxy->profile,
+                proxy->io[SIDE_CLIENT].fd, proxy->io[SIDE_REMOTE].fd))
+        return -1;
+    if(proxy->shaper) {
+        ev_init(&proxy->shaper->timer, throttle_callback);
+        proxy->shaper->timer.data = proxy;
+    }
+    return 0;
+}
 
+static void connect_callback(EV_P_ ProxyContext *proxy) {
     int err = 0;
     socklen_t errlen = sizeof(err);
-    if(-1 == getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &err, &errlen)) {
+    if(-1 == getsockopt(proxy->io[SIDE_REMOTE].fd, SOL_SOCKET, SO_ERROR, &err, &errlen)) {
         syslog(LOG_ERR, "<%p> getsockopt: %m", proxy);
         proxy_context_delete(loop, proxy);
         return;
     }
+    health_report(loop, proxy->health, 0 == err);
+    proxy->health = HEALTH_NONE;
+    proxy->connecting = 0;
     if(err) {
         syslog(LOG_INFO, "<%p> connect: %s", proxy, strerror(err));
-        proxy_context_delete(loop, proxy);
+        upstream_failed(loop, proxy, socks5_reply_code(err));
         return;
     }
 
-    proxy->remote_read_ctx.connected = 1;
-    proxy->remote_write_ctx.connected = 1;
+    proxy->can_read |= SIDE_BIT(SIDE_REMOTE);
+    proxy->can_write |= SIDE_BIT(SIDE_REMOTE);
     syslog(LOG_DEBUG, "<%p> connect_callback: remote connected", proxy);
-    if(NULL == (proxy->client_read_ctx.buf = proxy->remote_write_ctx.buf = fifobuf_new(PROXY_BUFFER_SIZE)) ) {
-        syslog(LOG_ERR, "fifobuf_new failed! Cleaning up...");
+    size_t size = s_buffer_size;
+    /*  the longest CONNECT response, with a SOCKS5 reply in front of it   */
+    if(proxy->tunnel && size < HTTPTUNNEL_MAX_RESPONSE + SOCKS5_MAX_REPLY)
+        size = HTTPTUNNEL_MAX_RESPONSE + SOCKS5_MAX_REPLY;
+    if(-1 == relay_setup(loop, proxy, size)) {
+        proxy_context_delete(loop, proxy);
+        return;
+    }
+
+    if(proxy->tunnel) {
+        char request[HTTPTUNNEL_MAX_REQUEST];
+        ssize_t len = httptunnel_build_request((struct sockaddr*)&proxy->origin->dst,
+                request, sizeof(request));
+        if(-1 == len) {
+            upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+            return;
+        }
+        fifobuf_push_back(proxy->buf[SHAPER_UP], (unsigned char*)request, len);
+        state_transist(loop, proxy);
+        return;
+    }
+    upstream_ready(loop, proxy);
+}
+
+static void connecting_push(EV_P_ ProxyContext *proxy) {
+    Connecting *connecting;
+    size_t size;
+
+    if(0 >= s_connect_timeout)
+        return;
+    if(s_nconnecting == s_connecting_size) {
+        if(s_connecting_head && 2 * s_connecting_head >= s_connecting_size) {
+            /*  at least half of it is behind the head  */
+            memmove(s_connecting, s_connecting + s_connecting_head,
+                    (s_nconnecting - s_connecting_head) * sizeof(Connecting));
+            s_nconnecting -= s_connecting_head;
+            s_connecting_head = 0;
+        } else {
+            size = s_connecting_size? 2 * s_connecting_size: PROXY_SLOTS_MIN;
+            if(NULL == (connecting = (Connecting*)realloc(s_connecting, size * sizeof(Connecting))) ) {
+                syslog(LOG_ERR, "<%p> realloc failed, connect not timed", proxy);
+                return;
+            }
+            s_connecting = connecting;
+            s_connecting_size = size;
+        }
+    }
+    s_connecting[s_nconnecting].id = context_id(proxy);
+    s_connecting[s_nconnecting].since = ev_now(loop);
+    ++s_nconnecting;
+    proxy->connecting = 1;
+    if(!ev_is_active(&s_connect_timer)) {
+        ev_timer_init(&s_connect_timer, connect_timer_callback, s_connect_timeout, 0.);
+        ev_timer_start(loop, &s_connect_timer);
+    }
+}
+
+/* Fails the contexts still connecting after the timeout, then times the next one. */
+static void connect_timer_callback(EV_P_ ev_timer *watcher, int revents) {
+    ev_tstamp now = ev_now(loop);
+    ProxyContext *proxy;
+    uint64_t id;
+
+    while(s_connecting_head < s_nconnecting) {
+        ev_tstamp deadline = s_connecting[s_connecting_head].since + s_connect_timeout;
+        if(s_connect_timeout > 0 && deadline > now) {
+            ev_timer_set(watcher, deadline - now, 0.);
+            ev_timer_start(loop, watcher);
+            return;
+        }
+        id = s_connecting[s_connecting_head++].id;
+        if(NULL == (proxy = proxy_context_find(id)) || !proxy->connecting)
+            continue;
+        proxy->connecting = 0;
+        if(0 >= s_connect_timeout)
+            continue;
+        syslog(LOG_INFO, "<%p> connect: %s", proxy, strerror(ETIMEDOUT));
+        health_report(loop, proxy->health, 0);
+        proxy->health = HEALTH_NONE;
+        upstream_failed(loop, proxy, socks5_reply_code(ETIMEDOUT));
+    }
+    s_connecting_head = s_nconnecting = 0;
+}
+
+/* The upstream carries the client's bytes from now on. */
+static void upstream_ready(EV_P_ ProxyContext *proxy) {
+    if(proxy->profile && proxy->profile->proxy_protocol && -1 == send_proxy_header(proxy)) {
+        proxy_context_delete(loop, proxy);
+        return;
+    }
+    if(PROXY_REPLY_SOCKS5 == proxy->reply)
+        queue_socks5_reply(proxy);
+
+    state_transist(loop, proxy);
+}
+
+static void upstream_failed(EV_P_ ProxyContext *proxy, int socks5_rep) {
+    if(PROXY_REPLY_SOCKS5 == proxy->reply)
+        socks5_send_reply(proxy->io[SIDE_CLIENT].fd, socks5_rep, NULL);
+    proxy_context_delete(loop, proxy);
+}
+
+/* Starts the next address that can be tried, and times the one after. */
+static void race_next(EV_P_ ProxyContext *proxy) {
+    Race *race = proxy->race;
+
+    ev_timer_stop(loop, &race->timer);
+    while(race->next < race->naddrs) {
+        RaceAttempt *attempt = &race->attempts[race->next];
+        const struct sockaddr *addr = (struct sockaddr*)&race->addrs[race->next];
+        int fd;
+
+        ++race->next;
+        if(-1 == health_acquire(loop, addr, &attempt->health))
+            continue;
+        if(-1 == (fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) ) {
+            race->err = errno;
+            syslog(LOG_ERR, "<%p> socket: %m", proxy);
+            health_release(attempt->health);
+            continue;
+        }
+        admission_fd_opened(loop, 1);
+        if(proxy->profile)
+            profile_apply_sockopts(proxy->profile, fd, addr->sa_family);
+        if(-1 == connect(fd, addr, sockaddr_len(addr)) && EINPROGRESS != errno) {
+            race->err = errno;
+            syslog(LOG_INFO, "<%p> connect: %m", proxy);
+            health_report(loop, attempt->health, 0);
+            close_i(fd);
+            admission_fd_closed(loop, 1);
+            continue;
+        }
+
+        ev_io_set(&attempt->io, fd, EV_WRITE);
+        ev_io_start(loop, &attempt->io);
+        if(s_connect_timeout > 0) {
+            ev_timer_set(&attempt->timer, s_connect_timeout, 0.);
+            ev_timer_start(loop, &attempt->timer);
+        }
+        ++race->running;
+        if(race->next < race->naddrs && s_race_delay > 0) {
+            ev_timer_set(&race->timer, s_race_delay, 0.);
+            ev_timer_start(loop, &race->timer);
+        }
         return;
     }
-    if(NULL == (proxy->client_write_ctx.buf = proxy->remote_read_ctx.buf = fifobuf_new(PROXY_BUFFER_SIZE)) ) {
-        syslog(LOG_ERR, "fifobuf_new failed! Cleaning up...");
+}
+
+static void race_delete(EV_P_ ProxyContext *proxy) {
+    Race *race = proxy->race;
+    size_t i;
+
+    ev_timer_stop(loop, &race->timer);
+    for(i = 0; i < race->naddrs; ++i) {
+        RaceAttempt *attempt = &race->attempts[i];
+        if(-1 == attempt->io.fd)
+            continue;
+        ev_io_stop(loop, &attempt->io);
+        ev_timer_stop(loop, &attempt->timer);
+        close_i(attempt->io.fd);
+        admission_fd_closed(loop, 1);
+        health_release(attempt->health);
+    }
+    free(race);
+    proxy->race = NULL;
+}
+
+/* Takes the attempt's socket off the race, its connect done either way. */
+static int race_stop(EV_P_ Race *race, RaceAttempt *attempt, int ok) {
+    int fd = attempt->io.fd;
+
+    ev_io_stop(loop, &attempt->io);
+    ev_io_set(&attempt->io, -1, EV_WRITE);
+    ev_timer_stop(loop, &attempt->timer);
+    --race->running;
+    health_report(loop, attempt->health, ok);
+    return fd;
+}
+
+/* A failure starts the next address without waiting for the delay. */
+static void race_failed(EV_P_ ProxyContext *proxy, int fd, int err) {
+    Race *race = proxy->race;
+
+    syslog(LOG_INFO, "<%p> connect: %s", proxy, strerror(err));
+    race->err = err;
+    close_i(fd);
+    admission_fd_closed(loop, 1);
+    race_next(loop, proxy);
+    if(0 == race->running)
+        upstream_failed(loop, proxy, socks5_reply_code(race->err));
+}
+
+/*
+ * The winner becomes the remote socket and carries on as if it had been
+ * the only one, the losers are closed.
+ */
+static void race_callback(EV_P_ ev_io *watcher, int revents) {
+    ProxyContext *proxy = (ProxyContext*)watcher->data;
+    RaceAttempt *attempt = (RaceAttempt*)watcher;
+    Race *race = proxy->race;
+    int fd = watcher->fd;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if(-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen))
+        err = errno;
+    race_stop(loop, race, attempt, 0 == err);
+
+    if(0 == err) {
+        if(proxy->origin)
+            proxy->origin->dst = race->addrs[attempt - race->attempts];
+        race_delete(loop, proxy);
+        ev_io_set(&proxy->io[SIDE_REMOTE], fd, EV_WRITE);
+        remote_lowat(proxy);
+        if(-1 != s_edge_fd && -1 == edge_add(proxy, SIDE_REMOTE, 1)) {
+            proxy_context_delete(loop, proxy);
+            return;
+        }
+        connect_callback(loop, proxy);
         return;
     }
+    race_failed(loop, proxy, fd, err);
+}
 
-    ev_io_start(loop, &proxy->client_read_ctx.io);
-    ev_io_start(loop, &proxy->remote_read_ctx.io);
-    ev_io_stop(loop, &proxy->remote_write_ctx.io);
+static void race_timer_callback(EV_P_ ev_timer *watcher, int revents) {
+    race_next(loop, (ProxyContext*)watcher->data);
+}
+
+static void race_timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    ProxyContext *proxy = (ProxyContext*)watcher->data;
+    RaceAttempt *attempt = (RaceAttempt*)((char*)watcher - offsetof(RaceAttempt, timer));
+
+    race_failed(loop, proxy, race_stop(loop, proxy->race, attempt, 0), ETIMEDOUT);
+}
+
+/*
+ * Reads the egress proxy's response to CONNECT into the buffer meant
+ * for the client, then drops the header; whatever followed it already
+ * came from the destination.
+ */
+static void tunnel_read(EV_P_ ProxyContext *proxy) {
+    fifobuf_t *buf = proxy->buf[SHAPER_DOWN];
+    ssize_t nread, len;
+    int status;
+
+    if(fifobuf_capacity(buf) <= SOCKS5_MAX_REPLY) {
+        syslog(LOG_INFO, "<%p> tunnel: response too large", proxy);
+        upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+        return;
+    }
+    /*  leaves room to put a SOCKS5 reply in front of what was read    */
+    if(-1 == (nread = read(proxy->io[SIDE_REMOTE].fd, fifobuf_space(buf),
+                    fifobuf_capacity(buf) - SOCKS5_MAX_REPLY)) ) {
+        if(EAGAIN == errno || EWOULDBLOCK == errno) {
+            proxy->readable &= ~SIDE_BIT(SIDE_REMOTE);
+            return;
+        }
+        syslog(LOG_INFO, "<%p> tunnel: read: %m", proxy);
+        upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+        return;
+    }
+    if(0 == nread) {
+        syslog(LOG_INFO, "<%p> tunnel: proxy closed before responding", proxy);
+        upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+        return;
+    }
+    fifobuf_push_back(buf, NULL, nread);
+
+    len = httptunnel_parse_response(fifobuf_buf(buf), fifobuf_amount(buf), &status);
+    if(0 == len) {
+        state_transist(loop, proxy);
+        return;
+    }
+    if(-1 == len) {
+        syslog(LOG_INFO, "<%p> tunnel: invalid response", proxy);
+        upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+        return;
+    }
+    if(2 != status / 100) {
+        syslog(LOG_INFO, "<%p> tunnel: CONNECT refused with %d", proxy, status);
+        upstream_failed(loop, proxy, SOCKS5_REP_NOT_ALLOWED);
+        return;
+    }
+
+    fifobuf_pop_front(buf, NULL, len);
+    proxy->tunnel = 0;
+    syslog(LOG_DEBUG, "<%p> tunnel: established", proxy);
+    upstream_ready(loop, proxy);
+}
+
+/* The reply goes out ahead of anything the upstream sends. */
+static void queue_socks5_reply(ProxyContext *proxy) {
+    struct sockaddr_storage bound;
+    socklen_t len = sizeof(bound);
+    unsigned char reply[SOCKS5_MAX_REPLY];
+
+    fifobuf_t *buf = proxy->buf[SHAPER_DOWN];
+    size_t n, held = fifobuf_amount(buf);
+
+    if(-1 == getsockname(proxy->io[SIDE_REMOTE].fd, (struct sockaddr*)&bound, &len))
+        bound.ss_family = AF_UNSPEC;
+    n = socks5_build_reply(reply, SOCKS5_REP_SUCCEEDED, (struct sockaddr*)&bound);
+
+    /*  bytes that followed a CONNECT response must come after the reply   */
+    fifobuf_push_back(buf, NULL, n);
+    memmove(fifobuf_buf(buf) + n, fifobuf_buf(buf), held);
+    memcpy(fifobuf_buf(buf), reply, n);
+}
+
+/*
+ * Queues the PROXY header ahead of any client bytes. The upstream is
+ * corked so that client bytes written with the header leave in one
+ * segment, and uncorked as soon as nothing is left behind the header,
+ * so a server that speaks first doesn't wait out the kernel's 200ms
+ * cork timeout.
+ */
+static int send_proxy_header(ProxyContext *proxy) {
+    struct sockaddr_storage src, dst;
+    socklen_t srclen = sizeof(src), dstlen = sizeof(dst);
+    unsigned char header[PROXYPROTO_MAX_HEADER];
+    ssize_t len;
+    int opt = 1;
+
+    if(proxy->origin) {
+        src = proxy->origin->src;
+        dst = proxy->origin->dst;
+    } else if(-1 == getpeername(proxy->io[SIDE_CLIENT].fd, (struct sockaddr*)&src, &srclen)
+            || -1 == getpeername(proxy->io[SIDE_REMOTE].fd, (struct sockaddr*)&dst, &dstlen)) {
+        syslog(LOG_ERR, "<%p> getpeername: %m", proxy);
+        return -1;
+    }
+    if(-1 == (len = proxyproto_build(proxy->profile->proxy_protocol,
+                    (struct sockaddr*)&src, (struct sockaddr*)&dst, header, sizeof(header))) ) {
+        syslog(LOG_ERR, "<%p> couldn't build PROXY header", proxy);
+        return -1;
+    }
+
+    if(0 == setsockopt(proxy->io[SIDE_REMOTE].fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt))) {
+        proxy->corked = 1;
+        proxy->header_left = (int)len;
+    }
+    fifobuf_push_back(proxy->buf[SHAPER_UP], header, len);
+    return 0;
+}
+
+static void uncork(ProxyContext *proxy, size_t written) {
+    int opt = 0;
+
+    /*  part of the header, or all of it with client bytes still behind  */
+    if(written < (size_t)proxy->header_left
+            || (written == (size_t)proxy->header_left
+                && fifobuf_amount(proxy->buf[SHAPER_UP]))) {
+        proxy->header_left -= written;
+        return;
+    }
+    proxy->header_left = 0;
+    setsockopt(proxy->io[SIDE_REMOTE].fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    proxy->corked = 0;
 }
 
 static int proxy_context_delete(EV_P_ ProxyContext *ctx) {
-    ev_io_stop(loop, &ctx->client_read_ctx.io);
-    ev_io_stop(loop, &ctx->client_write_ctx.io);
-    ev_io_stop(loop, &ctx->remote_read_ctx.io);
-    ev_io_stop(loop, &ctx->remote_write_ctx.io);
+    int dir;
 
-    if(ctx->client_read_ctx.connected || ctx->client_write_ctx.connected) {
+    ev_io_stop(loop, &ctx->io[SIDE_CLIENT]);
+    ev_io_stop(loop, &ctx->io[SIDE_REMOTE]);
+
+    if((ctx->can_read | ctx->can_write) & SIDE_BIT(SIDE_CLIENT)) {
         syslog(LOG_DEBUG, "<%p> proxy_context_delete: closing client side...", ctx);
-        close_i(ctx->client_read_ctx.io.fd);
+        close_side(loop, ctx, SIDE_CLIENT);
     }
-    if(ctx->remote_read_ctx.connected || ctx->remote_write_ctx.connected) {
+    /*
+     * The remote socket is open from proxy_context_new() on, even while
+     * the connect is still in progress, unless a race hasn't been won.
+     */
+    if(ctx->race)
+        race_delete(loop, ctx);
+    if((((ctx->can_read | ctx->can_write) & SIDE_BIT(SIDE_REMOTE)) || NULL == ctx->buf[SHAPER_UP])
+            && -1 != ctx->io[SIDE_REMOTE].fd) {
         syslog(LOG_DEBUG, "<%p> proxy_context_delete: closing remote side...", ctx);
-        close_i(ctx->remote_read_ctx.io.fd);
+        close_side(loop, ctx, SIDE_REMOTE);
     }
 
-    if(ctx->client_read_ctx.buf) {
-        fifobuf_delete(ctx->client_read_ctx.buf);
+    for(dir = 0; dir < SHAPER_DIRECTIONS; ++dir) {
+        if(ctx->buf[dir]) {
+            admission_buffer_free(loop, PROXY_BUFFER_BYTES(ctx->buf[dir]));
+            fifobuf_delete(ctx->buf[dir]);
+        }
     }
-    if(ctx->client_write_ctx.buf) {
-        fifobuf_delete(ctx->client_write_ctx.buf);
+
+    if(ctx->shaper) {
+        ev_timer_stop(loop, &ctx->shaper->timer);
+        shaper_delete(ctx->shaper);
     }
 
+    srclimit_release(ctx->srcslot);
+    backend_release(ctx->backend);
+    health_release(ctx->health);
+    if(ctx->profile)
+        profile_release(ctx->profile);
+    lru_unlink(ctx);
+    slot_remove(ctx);
+    free(ctx->origin);
     free(ctx);
+    admission_context_closed(loop);
     return 0;
 }
 
-static void disconnect_callback(EV_P_ ev_io *watcher, int revents) {
-    ProxyContext *proxy;
-
-    if(EV_WRITE & revents) {
-        WriteContext *ctx = (WriteContext*)watcher;
-        proxy = ctx->proxy;
+/*
+ * Sockets handed to the next binary outlive the close here, so they
+ * leave the epoll set explicitly.
+ */
+static void close_side(EV_P_ ProxyContext *proxy, int side) {
+    ev_io_stop(loop, &proxy->io[side]);
+    if(SIDE_REMOTE == side && proxy->zerocopy)
+        zerocopy_close(loop, proxy);
+    if(-1 != s_edge_fd)
+        epoll_ctl(s_edge_fd, EPOLL_CTL_DEL, proxy->io[side].fd, NULL);
+    proxy->can_read &= ~SIDE_BIT(side);
+    proxy->can_write &= ~SIDE_BIT(side);
+    proxy->readable &= ~SIDE_BIT(side);
+    proxy->writable &= ~SIDE_BIT(side);
+    close_i(proxy->io[side].fd);
+    admission_fd_closed(loop, 1);
+}
 
-        ctx->connected = 0;
-    } else if (EV_READ & revents) {
-        ReadContext *ctx = (ReadContext*)watcher;
-        proxy = ctx->proxy;
+/* A side hit EOF reading, events is EV_READ, or EPIPE writing, EV_WRITE. */
+static void disconnect(EV_P_ ProxyContext *proxy, int side, int events) {
+    if(EV_WRITE & events)
+        proxy->can_write &= ~SIDE_BIT(side);
+    else
+        proxy->can_read &= ~SIDE_BIT(side);
 
-        ctx->connected = 0;
-    } else {
-        syslog(LOG_CRIT, "disconnect_callback: neither EV_WRITE nore EV_READ is set.");
-        exit(EXIT_FAILURE);
+    if(proxy->tunnel) {
+        syslog(LOG_INFO, "<%p> tunnel: proxy went away", proxy);
+        upstream_failed(loop, proxy, SOCKS5_REP_FAILURE);
+        return;
     }
 
-    int client_disconnected = !(proxy->client_read_ctx.connected && proxy->client_write_ctx.connected);
-    int remote_disconnected = !(proxy->remote_read_ctx.connected && proxy->remote_write_ctx.connected);
+    unsigned open = proxy->can_read & proxy->can_write;
+    unsigned half = (proxy->can_read | proxy->can_write) & ~open;
+    int client_disconnected = !(open & SIDE_BIT(SIDE_CLIENT));
+    int remote_disconnected = !(open & SIDE_BIT(SIDE_REMOTE));
 
-    if(client_disconnected) {
-        syslog(LOG_DEBUG, "<%p> disconnect_callback: client disconnected.", proxy);
-        proxy->client_read_ctx.connected = proxy->client_write_ctx.connected = 0;
-        close_i(proxy->client_read_ctx.io.fd);
+    /*  a side whose flags are both cleared has been closed already    */
+    if(half & SIDE_BIT(SIDE_CLIENT)) {
+        syslog(LOG_DEBUG, "<%p> disconnect: client disconnected.", proxy);
+        close_side(loop, proxy, SIDE_CLIENT);
     }
-    if(remote_disconnected) {
-        syslog(LOG_DEBUG, "<%p> disconnect_callback: remote disconnected.", proxy);
-        proxy->remote_read_ctx.connected = proxy->remote_write_ctx.connected = 0;
-        close_i(proxy->remote_read_ctx.io.fd);
+    if(half & SIDE_BIT(SIDE_REMOTE)) {
+        syslog(LOG_DEBUG, "<%p> disconnect: remote disconnected.", proxy);
+        close_side(loop, proxy, SIDE_REMOTE);
     }
 
     if(
         (client_disconnected && remote_disconnected)
-        || (client_disconnected && (0 == fifobuf_amount(proxy->remote_write_ctx.buf)))
-        || (remote_disconnected && (0 == fifobuf_amount(proxy->client_write_ctx.buf)))
+        || (client_disconnected && (0 == fifobuf_amount(proxy->buf[SHAPER_UP])))
+        || (remote_disconnected && (0 == fifobuf_amount(proxy->buf[SHAPER_DOWN])))
       ) {
-        syslog(LOG_DEBUG, "<%p> disconnect_callback: releasing proxy context.", proxy);
+        syslog(LOG_DEBUG, "<%p> disconnect: releasing proxy context.", proxy);
         proxy_context_delete(loop, proxy);
         return;
     }
@@ -251,35 +1166,732 @@ static void disconnect_callback(EV_P_ ev_io *watcher, int revents) {
     state_transist(loop, proxy);
 }
 
+/* Restarts the watcher if what it waits for changed, stops it if nothing is. */
+static void watch(EV_P_ ev_io *io, int events) {
+    if(ev_is_active(io) && (io->events & (EV_READ | EV_WRITE)) == events)
+        return;
+    ev_io_stop(loop, io);
+    if(events) {
+        ev_io_set(io, io->fd, events);
+        ev_io_start(loop, io);
+    }
+}
+
+/* EV_READ and EV_WRITE as far as buffers and state allow them. */
+static int wanted(const ProxyContext *ctx, int side) {
+    fifobuf_t *in = ctx->buf[SIDE_IN(side)];
+    int events = 0;
+
+    if(ctx->tunnel) {
+        /*  only the CONNECT exchange runs until the tunnel is up  */
+        if(SIDE_REMOTE == side) {
+            events = EV_READ;
+            if(fifobuf_amount(ctx->buf[SHAPER_UP]))
+                events |= EV_WRITE;
+        }
+        return events;
+    }
+
+    if((ctx->can_read & SIDE_BIT(side)) && (ctx->can_write & SIDE_BIT(SIDE_OTHER(side)))
+            && fifobuf_capacity(in) && !(ctx->throttled & SIDE_BIT(side))
+            && !(ctx->lowat && fifobuf_amount(in)))
+        events |= EV_READ;
+    if((ctx->can_write & SIDE_BIT(side)) && fifobuf_amount(ctx->buf[SIDE_OUT(side)]))
+        events |= EV_WRITE;
+    return events;
+}
+
+/* What epoll said a side is ready for and nothing has used up yet. */
+static int edge_ready(const ProxyContext *ctx, int side) {
+    return ((ctx->readable & SIDE_BIT(side))? EV_READ: 0)
+        | ((ctx->writable & SIDE_BIT(side))? EV_WRITE: 0);
+}
+
 static void state_transist(EV_P_ ProxyContext *ctx) {
-    if(!(ctx->client_read_ctx.connected && ctx->client_read_ctx.dst->connected)) {
-        ev_io_stop(loop, &ctx->client_read_ctx.io);
-    } else if(fifobuf_capacity(ctx->client_read_ctx.buf)) {
-        ev_io_start(loop, &ctx->client_read_ctx.io);
-    } else {
-        ev_io_stop(loop, &ctx->client_read_ctx.io);
+    int side;
+
+    if(-1 != s_edge_fd) {
+        for(side = 0; side < SIDES; ++side) {
+            if(wanted(ctx, side) & edge_ready(ctx, side)) {
+                ready_push(ctx);
+                return;
+            }
+        }
+        return;
     }
+    watch(loop, &ctx->io[SIDE_CLIENT], wanted(ctx, SIDE_CLIENT));
+    watch(loop, &ctx->io[SIDE_REMOTE], wanted(ctx, SIDE_REMOTE));
+}
 
-    if(!ctx->client_write_ctx.connected) {
-        ev_io_stop(loop, &ctx->client_write_ctx.io);
-    } else if(fifobuf_amount(ctx->client_write_ctx.buf)) {
-        ev_io_start(loop, &ctx->client_write_ctx.io);
-    } else {
-        ev_io_stop(loop, &ctx->client_write_ctx.io);
+/*
+ * Adds a side's socket to the epoll set. It is taken to be ready until
+ * a read or write says otherwise, except for a connect in progress,
+ * which reports its own edge.
+ */
+static int edge_add(ProxyContext *proxy, int side, int ready) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    /*  the id, with the side next to the slot  */
+    event.data.u64 = (uint64_t)s_slots[proxy->slot].gen << 32 | proxy->slot << 1 | side;
+    if(-1 == epoll_ctl(s_edge_fd, EPOLL_CTL_ADD, proxy->io[side].fd, &event)) {
+        syslog(LOG_ERR, "<%p> epoll_ctl: %m", proxy);
+        return -1;
+    }
+    if(ready) {
+        proxy->readable |= SIDE_BIT(side);
+        proxy->writable |= SIDE_BIT(side);
     }
+    return 0;
+}
+
+static void ready_push(ProxyContext *proxy) {
+    uint64_t *ready;
+    size_t size;
+
+    if(proxy->queued)
+        return;
+    if(s_nready == s_ready_size) {
+        size = s_ready_size? 2 * s_ready_size: PROXY_SLOTS_MIN;
+        if(NULL == (ready = (uint64_t*)realloc(s_ready, size * sizeof(uint64_t))) ) {
+            /*  no new edge would come for it  */
+            syslog(LOG_ERR, "<%p> realloc failed, rescanning", proxy);
+            s_ready_lost = 1;
+            return;
+        }
+        s_ready = ready;
+        s_ready_size = size;
+    }
+    s_ready[s_nready++] = context_id(proxy);
+    proxy->queued = 1;
+}
+
+/*
+ * Runs a step of everything a context is ready for, writes first to
+ * make room for reads. Each step queues the context again if it can
+ * get further, until reads and writes ran into EAGAIN or buffers.
+ */
+static void edge_relay(EV_P_ ProxyContext *proxy) {
+    uint64_t id = context_id(proxy);
+    int side;
+
+    if(proxy->zerocopy && proxy->zerocopy->head)
+        zerocopy_reap(loop, proxy);
+    if(NULL == proxy->buf[SHAPER_UP] && !((proxy->can_read | proxy->can_write) & SIDE_BIT(SIDE_REMOTE))) {
+        if(proxy->writable & SIDE_BIT(SIDE_REMOTE))
+            connect_callback(loop, proxy);
+        return;
+    }
+    for(side = 0; side < SIDES; ++side) {
+        if(EV_WRITE & wanted(proxy, side) & edge_ready(proxy, side)) {
+            write_ready(loop, proxy, side);
+            if(proxy != proxy_context_find(id))
+                return;
+        }
+    }
+    for(side = 0; side < SIDES; ++side) {
+        if(EV_READ & wanted(proxy, side) & edge_ready(proxy, side)) {
+            read_ready(loop, proxy, side);
+            if(proxy != proxy_context_find(id))
+                return;
+        }
+    }
+}
+
+/*
+ * One pass over what was queued so far; contexts queued meanwhile wait
+ * for the next one, so that busy connections don't hold up the loop.
+ * Ids of contexts closed since are skipped.
+ */
+static void ready_run(EV_P) {
+    size_t i, n;
+    ProxyContext *proxy;
+
+    if(s_ready_lost)
+        ready_rescan();
+    n = s_nready;
+    for(i = 0; i < n; ++i) {
+        if(NULL != (proxy = proxy_context_find(s_ready[i])) ) {
+            proxy->queued = 0;
+            edge_relay(loop, proxy);
+        }
+    }
+    s_nready -= n;
+    if(s_nready)
+        memmove(s_ready, s_ready + n, s_nready * sizeof(uint64_t));
+    if(s_nready || s_ready_lost)
+        ev_idle_start(loop, &s_edge_idle);
+    else
+        ev_idle_stop(loop, &s_edge_idle);
+}
+
+/*
+ * Queues every context epoll left readiness with, after a push failed.
+ * Those already queued stay where they are.
+ */
+static void ready_rescan(void) {
+    ProxyContext *ctx;
+    uint32_t slot;
+
+    s_ready_lost = 0;
+    for(slot = 0; slot < s_nslots; ++slot) {
+        if(NULL != (ctx = s_slots[slot].ctx) && (ctx->readable | ctx->writable))
+            ready_push(ctx);
+    }
+}
+
+static void edge_callback(EV_P_ ev_io *watcher, int revents) {
+    struct epoll_event events[PROXY_EDGE_EVENTS];
+    ProxyContext *proxy;
+    uint64_t key;
+    int i, n, side;
+
+    if(-1 == (n = epoll_wait(watcher->fd, events, PROXY_EDGE_EVENTS, 0)) ) {
+        if(EINTR != errno)
+            syslog(LOG_ERR, "epoll_wait: %m");
+        return;
+    }
+    for(i = 0; i < n; ++i) {
+        key = events[i].data.u64;
+        side = (int)(key & 1);
+        if(NULL == (proxy = proxy_context_find((key & ~(uint64_t)UINT32_MAX) | (uint32_t)key >> 1)) )
+            continue;
+        if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            proxy->readable |= SIDE_BIT(side);
+        if(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            proxy->writable |= SIDE_BIT(side);
+        ready_push(proxy);
+    }
+    ready_run(loop);
+}
+
+/* Contexts queued by timers and other watchers get relayed before the loop blocks. */
+static void edge_prepare_callback(EV_P_ ev_prepare *watcher, int revents) {
+    if(s_nready || s_ready_lost)
+        ready_run(loop);
+}
+
+static void edge_idle_callback(EV_P_ ev_idle *watcher, int revents) {
+    ready_run(loop);
+}
+
+/* Parks a reader that ran out of tokens until the buckets have refilled. */
+static void throttle(EV_P_ ProxyContext *proxy, int side, size_t want) {
+    ev_timer *timer = &proxy->shaper->timer;
+    ev_tstamp delay = shaper_delay(proxy->shaper, SIDE_IN(side), want);
+
+    proxy->throttled |= SIDE_BIT(side);
+    state_transist(loop, proxy);
+    if(ev_is_active(timer)) {
+        if(ev_timer_remaining(loop, timer) <= delay)
+            return;
+        ev_timer_stop(loop, timer);
+    }
+    ev_timer_set(timer, delay, 0.);
+    ev_timer_start(loop, timer);
+}
+
+static void throttle_callback(EV_P_ ev_timer *watcher, int revents) {
+    ProxyContext *proxy = (ProxyContext*)watcher->data;
+
+    proxy->throttled = 0;
+    state_transist(loop, proxy);
+}
+
+/*
+ * Sends what the upstream buffer holds with MSG_ZEROCOPY, pins it and
+ * moves what wasn't sent on to a fresh buffer. A plain write() stands
+ * in whenever that can't be done. Either way the buffer is left the
+ * way write() and fifobuf_pop_front() would have left it.
+ */
+static ssize_t zerocopy_send(EV_P_ ProxyContext *proxy) {
+    fifobuf_t *buf = proxy->buf[SHAPER_UP], *fresh = NULL;
+    PinnedBuffer *pin = NULL;
+    ZeroCopy *zc = proxy->zerocopy;
+    int fd = proxy->io[SIDE_REMOTE].fd, opt = 1;
+    ssize_t nwrite;
 
-    if(!(ctx->remote_read_ctx.connected && ctx->remote_read_ctx.dst->connected)) {
-        ev_io_stop(loop, &ctx->remote_read_ctx.io);
-    } else if(fifobuf_capacity(ctx->remote_read_ctx.buf)) {
-        ev_io_start(loop, &ctx->remote_read_ctx.io);
+    if(zc) {
+        zerocopy_reap(loop, proxy);
+    } else if(-1 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt))
+            || NULL == (zc = proxy->zerocopy = (ZeroCopy*)calloc(1, sizeof(ZeroCopy))) ) {
+        syslog(LOG_DEBUG, "<%p> zerocopy_send: %m, copying instead", proxy);
+        proxy->nozerocopy = 1;
     } else {
-        ev_io_stop(loop, &ctx->remote_read_ctx.io);
+        zc->tail = &zc->head;
     }
-    if(!ctx->remote_write_ctx.connected) {
-        ev_io_stop(loop, &ctx->remote_write_ctx.io);
-    } else if(fifobuf_amount(ctx->remote_write_ctx.buf)) {
-        ev_io_start(loop, &ctx->remote_write_ctx.io);
+    if(proxy->nozerocopy || zc->next - zc->done >= PROXY_ZEROCOPY_PINNED
+            || NULL == (pin = (PinnedBuffer*)malloc(sizeof(PinnedBuffer)))
+            || NULL == (fresh = fifobuf_new(buf->size)) )
+        goto copy;
+
+    if(-1 != (nwrite = send(fd, fifobuf_buf(buf), fifobuf_amount(buf), MSG_ZEROCOPY)) ) {
+        pin->next = NULL;
+        pin->buf = buf;
+        pin->id = zc->next++;
+        *zc->tail = pin;
+        zc->tail = &pin->next;
+        fifobuf_push_back(fresh, fifobuf_buf(buf) + nwrite, fifobuf_amount(buf) - nwrite);
+        proxy->buf[SHAPER_UP] = fresh;
+        /*  just active, so not shed for going over the budget    */
+        lru_touch(loop, proxy);
+        admission_buffer_alloc(loop, PROXY_BUFFER_BYTES(fresh));
+        return nwrite;
+    }
+    /*  ENOBUFS: out of option memory for the completion    */
+    if(ENOBUFS != errno) {
+        free(pin);
+        fifobuf_delete(fresh);
+        return -1;
+    }
+
+copy:
+    free(pin);
+    if(fresh)
+        fifobuf_delete(fresh);
+    if(-1 != (nwrite = write(fd, fifobuf_buf(buf), fifobuf_amount(buf))) )
+        fifobuf_pop_front(buf, NULL, nwrite);
+    return nwrite;
+}
+
+/*
+ * Reads the completions queued on the remote socket, and releases the
+ * buffers of every send up to the first one still in flight.
+ */
+static void zerocopy_reap(EV_P_ ProxyContext *proxy) {
+    ZeroCopy *zc = proxy->zerocopy;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *err;
+    PinnedBuffer *pin;
+    uint32_t bit;
+
+    for(;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(-1 == recvmsg(proxy->io[SIDE_REMOTE].fd, &msg, MSG_ERRQUEUE))
+            break;
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(!(SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type)
+                    && !(SOL_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type))
+                continue;
+            err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if(SO_EE_ORIGIN_ZEROCOPY != err->ee_origin || 0 != err->ee_errno)
+                continue;
+            /*  sends ee_info to ee_data, both included */
+            for(bit = 0; bit < 32; ++bit) {
+                if(zc->done + bit - err->ee_info <= err->ee_data - err->ee_info)
+                    zc->acked |= 1u << bit;
+            }
+            /*  e.g. over loopback, copying up front is cheaper    */
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                proxy->nozerocopy = 1;
+        }
+    }
+    while(zc->acked & 1) {
+        zc->acked >>= 1;
+        ++zc->done;
+    }
+    while(NULL != (pin = zc->head) && (int32_t)(pin->id - zc->done) < 0) {
+        if(NULL == (zc->head = pin->next))
+            zc->tail = &zc->head;
+        pinned_free(loop, pin);
+    }
+}
+
+/*
+ * Once the remote socket is closed nothing tells when the kernel is
+ * done with the buffers still pinned, they are freed after a while.
+ */
+static void zerocopy_close(EV_P_ ProxyContext *proxy) {
+    ZeroCopy *zc = proxy->zerocopy;
+    PinnedBuffer *pin;
+
+    zerocopy_reap(loop, proxy);
+    if(zc->head) {
+        for(pin = zc->head; pin; pin = pin->next)
+            pin->until = ev_now(loop) + PROXY_ZEROCOPY_LINGER;
+        *s_limbo_tail = zc->head;
+        s_limbo_tail = zc->tail;
+        if(!ev_is_active(&s_limbo_timer)) {
+            ev_timer_init(&s_limbo_timer, limbo_callback, PROXY_ZEROCOPY_LINGER, 0.);
+            ev_timer_start(loop, &s_limbo_timer);
+        }
+    }
+    free(zc);
+    proxy->zerocopy = NULL;
+    proxy->nozerocopy = 1;
+}
+
+static void pinned_free(EV_P_ PinnedBuffer *pin) {
+    admission_buffer_free(loop, PROXY_BUFFER_BYTES(pin->buf));
+    fifobuf_delete(pin->buf);
+    free(pin);
+}
+
+static void limbo_callback(EV_P_ ev_timer *watcher, int revents) {
+    PinnedBuffer *pin;
+
+    while(NULL != (pin = s_limbo) && pin->until <= ev_now(loop)) {
+        s_limbo = pin->next;
+        pinned_free(loop, pin);
+    }
+    if(NULL == s_limbo) {
+        s_limbo_tail = &s_limbo;
+        return;
+    }
+    ev_timer_set(watcher, s_limbo->until - ev_now(loop), 0.);
+    ev_timer_start(loop, watcher);
+}
+
+static int slot_insert(ProxyContext *ctx) {
+    ProxySlot *slots;
+    uint32_t i;
+
+    if(PROXY_SLOT_NONE != s_free_slot) {
+        i = s_free_slot;
+        s_free_slot = s_slots[i].next_free;
     } else {
-        ev_io_stop(loop, &ctx->remote_write_ctx.io);
+        if(s_nslots == s_capacity) {
+            uint32_t capacity = s_capacity? 2 * s_capacity: PROXY_SLOTS_MIN;
+
+            if(capacity > PROXY_SLOTS_MAX || NULL == (slots = (ProxySlot*)realloc(s_slots,
+                    capacity * sizeof(ProxySlot))) )
+                return -1;
+            s_slots = slots;
+            s_capacity = capacity;
+        }
+        i = s_nslots++;
+        s_slots[i].gen = 0;
+    }
+    s_slots[i].ctx = ctx;
+    ctx->slot = i;
+    return 0;
+}
+
+static void slot_remove(ProxyContext *ctx) {
+    ProxySlot *slot = &s_slots[ctx->slot];
+
+    slot->ctx = NULL;
+    ++slot->gen;
+    slot->next_free = s_free_slot;
+    s_free_slot = ctx->slot;
+}
+
+static void lru_unlink(ProxyContext *ctx) {
+    if(ctx->lru_prev)
+        ctx->lru_prev->lru_next = ctx->lru_next;
+    else if(s_lru_head == ctx)
+        s_lru_head = ctx->lru_next;
+    else
+        return;     /*  never linked    */
+
+    if(ctx->lru_next)
+        ctx->lru_next->lru_prev = ctx->lru_prev;
+    else
+        s_lru_tail = ctx->lru_prev;
+    ctx->lru_prev = ctx->lru_next = NULL;
+}
+
+static void lru_append(ProxyContext *ctx) {
+    ctx->lru_prev = s_lru_tail;
+    ctx->lru_next = NULL;
+    if(s_lru_tail)
+        s_lru_tail->lru_next = ctx;
+    else
+        s_lru_head = ctx;
+    s_lru_tail = ctx;
+}
+
+static void lru_touch(EV_P_ ProxyContext *ctx) {
+    ctx->last_active = ev_now(loop);
+    if(s_lru_tail != ctx) {
+        lru_unlink(ctx);
+        lru_append(ctx);
+    }
+}
+
+/*
+ * Only connections open both ways and done with their setup, that is
+ * the PROXY header, the CONNECT exchange and racing, can be moved, and
+ * none whose buffers the kernel may still send from.
+ */
+static int migratable(const ProxyContext *ctx) {
+    return SIDE_BOTH == ctx->can_read && SIDE_BOTH == ctx->can_write
+        && !ctx->tunnel && !ctx->race && !ctx->corked && 0 == ctx->header_left
+        && !(ctx->zerocopy && ctx->zerocopy->head);
+}
+
+static int migrate_send(EV_P_ int sock, ProxyContext *ctx) {
+    MigrateRecord rec;
+    struct sockaddr_storage dst;
+    socklen_t dstlen = sizeof(dst);
+    fifobuf_t *up = ctx->buf[SHAPER_UP], *down = ctx->buf[SHAPER_DOWN];
+    int fds[2] = { ctx->io[SIDE_CLIENT].fd, ctx->io[SIDE_REMOTE].fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov[4];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if(ctx->origin) {
+        dstlen = sockaddr_len((struct sockaddr*)&ctx->origin->dst);
+        memcpy(&dst, &ctx->origin->dst, dstlen);
+    } else if(-1 == getpeername(fds[1], (struct sockaddr*)&dst, &dstlen)) {
+        return -1;
+    }
+    rec.dstlen = dstlen;
+    rec.up = fifobuf_amount(up);
+    rec.down = fifobuf_amount(down);
+    rec.idle_ms = (uint32_t)((ev_now(loop) - ctx->last_active) * 1000.);
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = &dst;
+    iov[1].iov_len = dstlen;
+    iov[2].iov_base = fifobuf_buf(up);
+    iov[2].iov_len = rec.up;
+    iov[3].iov_base = fifobuf_buf(down);
+    iov[3].iov_len = rec.down;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 4;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(-1 == sendmsg(sock, &msg, MSG_NOSIGNAL))
+        return -1;
+    return 0;
+}
+
+/*
+ * Hands every connection that can be moved to the next binary over
+ * sock, which then owns its sockets; closing ours here doesn't end it.
+ * Returns 0 once none is left, -1 with EAGAIN while sock is full.
+ */
+int proxy_migrate(EV_P_ int sock) {
+    ProxyCursor cursor;
+    ProxyContext *ctx;
+    size_t moved = 0;
+    int ret = 0;
+
+    proxy_cursor_open(&cursor);
+    while(NULL != (ctx = proxy_cursor_next(&cursor)) ) {
+        if(!migratable(ctx))
+            continue;
+        if(-1 == migrate_send(loop, sock, ctx)) {
+            if(EAGAIN != errno && EWOULDBLOCK != errno)
+                syslog(LOG_ERR, "<%p> proxy_migrate: %m", ctx);
+            ret = -1;
+            break;
+        }
+        syslog(LOG_DEBUG, "<%p> proxy_migrate: handed over.", ctx);
+        proxy_context_delete(loop, ctx);
+        ++moved;
+    }
+    if(moved)
+        syslog(LOG_INFO, "migrated %zu connections", moved);
+    return ret;
+}
+
+/*
+ * Takes one connection the previous binary handed over on sock and
+ * relays it like any other, except that it counts against no source
+ * limit or upstream. Returns -1 once sock is closed or broken.
+ */
+int proxy_receive(EV_P_ int sock, const ProfileTable *profiles) {
+    static unsigned char data[sizeof(MigrateRecord) + sizeof(struct sockaddr_storage) + 2 * PROXY_BUFFER_MAX];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { data, sizeof(data) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    MigrateRecord rec;
+    struct sockaddr_storage dst;
+    ProxyContext *ctx;
+    int fds[2] = { -1, -1 };
+    size_t size;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(-1 == (n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) ) {
+        if(EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+            return 0;
+        syslog(LOG_ERR, "proxy_receive: recvmsg: %m");
+        return -1;
+    }
+    if(0 == n)
+        return -1;
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type
+                && CMSG_LEN(sizeof(fds)) == cmsg->cmsg_len)
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    if(n >= (ssize_t)sizeof(rec))
+        memcpy(&rec, data, sizeof(rec));
+    if(-1 == fds[0] || -1 == fds[1] || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+            || n < (ssize_t)sizeof(rec) || rec.dstlen > sizeof(dst)
+            || rec.up > PROXY_BUFFER_MAX || rec.down > PROXY_BUFFER_MAX
+            || (size_t)n != sizeof(rec) + rec.dstlen + rec.up + rec.down) {
+        syslog(LOG_ERR, "proxy_receive: malformed record, dropping it");
+        goto drop;
+    }
+    memcpy(&dst, data + sizeof(rec), rec.dstlen);
+
+    if(-1 == proxy_context_new(&ctx, fds[0], fds[1]))
+        goto drop;
+    ctx->can_read = ctx->can_write = SIDE_BOTH;
+    /*  the kernel's zerocopy ids went on in the previous binary   */
+    ctx->nozerocopy = 1;
+    ctx->opened = ev_now(loop);
+    ctx->last_active = ctx->opened - rec.idle_ms / 1000.;
+    lru_append(ctx);
+    admission_context_opened(loop);
+    admission_fd_opened(loop, 2);
+    if(profiles && rec.dstlen)
+        proxy_context_set_profile(ctx, profile_table_lookup(profiles, (struct sockaddr*)&dst));
+
+    size = s_buffer_size;
+    if(size < rec.up)
+        size = rec.up;
+    if(size < rec.down)
+        size = rec.down;
+    if(-1 == relay_setup(loop, ctx, size)) {
+        proxy_context_delete(loop, ctx);
+        return 0;
+    }
+    fifobuf_push_back(ctx->buf[SHAPER_UP], data + sizeof(rec) + rec.dstlen, rec.up);
+    fifobuf_push_back(ctx->buf[SHAPER_DOWN], data + sizeof(rec) + rec.dstlen + rec.up, rec.down);
+    if(s_notsent_lowat) {
+        setsockopt(fds[0], IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &s_notsent_lowat, sizeof(s_notsent_lowat));
+        ctx->lowat = 1;
+    }
+    remote_lowat(ctx);
+    if(-1 != s_edge_fd && (-1 == edge_add(ctx, SIDE_CLIENT, 1) || -1 == edge_add(ctx, SIDE_REMOTE, 1))) {
+        proxy_context_delete(loop, ctx);
+        return 0;
+    }
+    syslog(LOG_DEBUG, "<%p> proxy_receive: taken over.", ctx);
+    state_transist(loop, ctx);
+    return 0;
+
+drop:
+    if(-1 != fds[0])
+        close_i(fds[0]);
+    if(-1 != fds[1])
+        close_i(fds[1]);
+    return 0;
+}
+
+/*
+ * Cursors walk every context in slot order, and stay valid while
+ * contexts come and go between calls. None is returned twice; one
+ * opened meanwhile is returned if it got a slot ahead of the cursor.
+ */
+void proxy_cursor_open(ProxyCursor *cur) {
+    cur->slot = 0;
+}
+
+ProxyContext *proxy_cursor_next(ProxyCursor *cur) {
+    while(cur->slot < s_nslots) {
+        ProxyContext *ctx = s_slots[cur->slot++].ctx;
+        if(ctx)
+            return ctx;
+    }
+    return NULL;
+}
+
+/* Ids are the slot in the low 32 bits and its generation above them. */
+static uint64_t context_id(const ProxyContext *ctx) {
+    return (uint64_t)s_slots[ctx->slot].gen << 32 | ctx->slot;
+}
+
+ProxyContext *proxy_context_find(uint64_t id) {
+    uint32_t i = (uint32_t)id;
+
+    if(i >= s_nslots || NULL == s_slots[i].ctx || s_slots[i].gen != (uint32_t)(id >> 32))
+        return NULL;
+    return s_slots[i].ctx;
+}
+
+/* Addresses are AF_UNSPEC for a side that isn't connected. */
+void proxy_context_info(EV_P_ const ProxyContext *ctx, ProxyInfo *info) {
+    socklen_t len;
+
+    info->id = context_id(ctx);
+    len = sizeof(info->client);
+    if(-1 == getpeername(ctx->io[SIDE_CLIENT].fd, (struct sockaddr*)&info->client, &len))
+        info->client.ss_family = AF_UNSPEC;
+    len = sizeof(info->remote);
+    if(!((ctx->can_read | ctx->can_write) & SIDE_BIT(SIDE_REMOTE))
+            || -1 == getpeername(ctx->io[SIDE_REMOTE].fd, (struct sockaddr*)&info->remote, &len))
+        info->remote.ss_family = AF_UNSPEC;
+    info->bytes_up = ctx->bytes[SHAPER_UP];
+    info->bytes_down = ctx->bytes[SHAPER_DOWN];
+    info->buffered_up = ctx->buf[SHAPER_UP]? fifobuf_amount(ctx->buf[SHAPER_UP]): 0;
+    info->buffered_down = ctx->buf[SHAPER_DOWN]? fifobuf_amount(ctx->buf[SHAPER_DOWN]): 0;
+    info->age = ev_now(loop) - ctx->opened;
+    info->idle = ev_now(loop) - ctx->last_active;
+}
+
+/* Writes what the socket takes of the buffer, then sends a FIN after it. */
+static void flush_shutdown(ProxyContext *proxy, int side) {
+    fifobuf_t *buf = proxy->buf[SIDE_OUT(side)];
+
+    if(!(proxy->can_write & SIDE_BIT(side)))
+        return;
+    if(buf && fifobuf_amount(buf) && !proxy->tunnel
+            && -1 == write(proxy->io[side].fd, fifobuf_buf(buf), fifobuf_amount(buf)))
+        syslog(LOG_DEBUG, "<%p> flush_shutdown: write: %m", proxy);
+    shutdown(proxy->io[side].fd, SHUT_WR);
+}
+
+/*
+ * Ends every connection at once, for a drain that ran out of time.
+ * Peers see whatever fit into their socket and a FIN rather than a
+ * reset, unless they sent something that was never read.
+ */
+size_t proxy_close_all(EV_P) {
+    ProxyCursor cursor;
+    ProxyContext *ctx;
+    size_t closed = 0;
+
+    proxy_cursor_open(&cursor);
+    while(NULL != (ctx = proxy_cursor_next(&cursor)) ) {
+        flush_shutdown(ctx, SIDE_CLIENT);
+        flush_shutdown(ctx, SIDE_REMOTE);
+        proxy_context_delete(loop, ctx);
+        ++closed;
+    }
+    return closed;
+}
+
+void proxy_context_kill(EV_P_ ProxyContext *ctx) {
+    syslog(LOG_INFO, "<%p> proxy_context_kill: killed.", ctx);
+    proxy_context_delete(loop, ctx);
+}
+
+size_t proxy_context_shed_idle(EV_P_ size_t max, ev_tstamp min_idle) {
+    size_t shed = 0;
+    ev_tstamp deadline = ev_now(loop) - min_idle;
+
+    while(shed < max && s_lru_head && s_lru_head->last_active <= deadline) {
+        syslog(LOG_INFO, "<%p> proxy_context_shed_idle: idle for %.0fs, shedding.",
+                s_lru_head, ev_now(loop) - s_lru_head->last_active);
+        proxy_context_delete(loop, s_lru_head);
+        ++shed;
     }
+    return shed;
 }
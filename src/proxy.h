@@ -10,9 +10,74 @@
 #ifndef PROXY_H
 #define PROXY_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Addresses raced for one destination, and the delay between them. */
+#define PROXY_RACE_MAX      8
+#define PROXY_RACE_DELAY    0.25
+
+/* Upstream connects not finished by then fail. */
+#define PROXY_CONNECT_TIMEOUT   10.
+
+/* Relay buffer size, each direction has one. */
+#define PROXY_BUFFER_SIZE   2048
+#define PROXY_BUFFER_MIN    1024
+#define PROXY_BUFFER_MAX    65536
+
 typedef struct proxy_context_t ProxyContext;
+struct profile_t;
+struct profile_table_t;
+
+/* A connection as shown on the control socket. */
+typedef struct {
+    uint64_t                id;
+    struct sockaddr_storage client;
+    struct sockaddr_storage remote;
+    uint64_t                bytes_up;       /*  read from the client    */
+    uint64_t                bytes_down;     /*  read from the remote    */
+    size_t                  buffered_up;
+    size_t                  buffered_down;
+    ev_tstamp               age;
+    ev_tstamp               idle;
+} ProxyInfo;
+
+typedef struct {
+    uint32_t                slot;           /*  looked at next  */
+} ProxyCursor;
+
+/* What the client is told once the upstream connect has finished.  */
+enum { PROXY_REPLY_NONE, PROXY_REPLY_SOCKS5 };
+
+void proxy_set_notsent_lowat(int lowat);
+void proxy_set_race_delay(ev_tstamp delay);
+void proxy_set_connect_timeout(ev_tstamp timeout);
+void proxy_set_buffer_size(size_t size);
+void proxy_set_zerocopy(size_t threshold);
+void proxy_set_busy_poll(int usecs);
+int proxy_set_edge_triggered(EV_P);
 
 int proxy_context_new(ProxyContext **pctx, int clientfd, int remotefd);
+void proxy_context_set_source(ProxyContext *ctx, int srcslot);
+void proxy_context_set_backend(ProxyContext *ctx, int token);
+void proxy_context_set_health(ProxyContext *ctx, int slot);
+void proxy_context_set_profile(ProxyContext *ctx, struct profile_t *profile);
+void proxy_context_set_reply(ProxyContext *ctx, int reply);
+int proxy_context_set_origin(ProxyContext *ctx, const struct sockaddr *src, const struct sockaddr *dst);
+void proxy_context_set_tunnel(ProxyContext *ctx);
+int proxy_context_set_race(ProxyContext *ctx, const struct sockaddr_storage *addrs, size_t naddrs);
+void proxy_context_free(ProxyContext *ctx);
 int proxy_context_start(EV_P_ ProxyContext *ctx);
+size_t proxy_context_shed_idle(EV_P_ size_t max, ev_tstamp min_idle);
+void proxy_cursor_open(ProxyCursor *cur);
+ProxyContext *proxy_cursor_next(ProxyCursor *cur);
+ProxyContext *proxy_context_find(uint64_t id);
+void proxy_context_info(EV_P_ const ProxyContext *ctx, ProxyInfo *info);
+void proxy_context_kill(EV_P_ ProxyContext *ctx);
+size_t proxy_close_all(EV_P);
+int proxy_migrate(EV_P_ int sock);
+int proxy_receive(EV_P_ int sock, const struct profile_table_t *profiles);
 
 #endif  /*  PROXY_H */
@@ -0,0 +1,394 @@
+/*
+ * proxyproto.c - layer-4 proxy PROXY protocol module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "admission.h"
+#include "proxyproto.h"
+
+#define PROXYPROTO_V2_CMD_PROXY     0x21    /*  version 2, PROXY command    */
+#define PROXYPROTO_V2_TCP4          0x11
+#define PROXYPROTO_V2_TCP6          0x21
+#define PROXYPROTO_V2_UNSPEC        0x00
+#define PROXYPROTO_V2_CMD_LOCAL     0x20
+#define PROXYPROTO_V1_MAX           107     /*  including "\r\n"   */
+
+/* An accepted connection whose header has not been read in full yet. */
+typedef struct {
+    ev_io                   io;
+    ev_timer                timer;
+    proxyprotoAcceptFn      done;
+    struct sockaddr_storage peer;
+    size_t                  have;
+    unsigned char           buf[PROXYPROTO_MAX_INPUT];
+} HeaderWait;
+
+static const unsigned char s_v2_signature[12] = {
+    0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a
+};
+
+int proxyproto_parse_version(const char *str) {
+    if(0 == strcmp(str, "v1") || 0 == strcmp(str, "1"))
+        return PROXYPROTO_V1;
+    if(0 == strcmp(str, "v2") || 0 == strcmp(str, "2"))
+        return PROXYPROTO_V2;
+    return -1;
+}
+
+/*
+ * Brings both addresses to one family: v4-mapped addresses are unmapped,
+ * and if the families still differ the IPv4 one is mapped. Returns the
+ * family, or AF_UNSPEC for anything but IPv4 and IPv6.
+ */
+static int normalize(const struct sockaddr *src, const struct sockaddr *dst,
+        struct sockaddr_storage *nsrc, struct sockaddr_storage *ndst) {
+    unsigned char key[16];
+    uint16_t port;
+
+    memcpy(nsrc, src, sockaddr_len(src));
+    memcpy(ndst, dst, sockaddr_len(dst));
+    sockaddr_unmap(nsrc);
+    sockaddr_unmap(ndst);
+    if(nsrc->ss_family == ndst->ss_family)
+        return AF_INET == nsrc->ss_family || AF_INET6 == nsrc->ss_family? nsrc->ss_family: AF_UNSPEC;
+
+    struct sockaddr_storage *v4 = AF_INET == nsrc->ss_family? nsrc: ndst;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6*)v4;
+    if(-1 == sockaddr_key((struct sockaddr*)v4, key, &port))
+        return AF_UNSPEC;
+    memset(v4, 0, sizeof(*v4));
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = port;
+    memcpy(&in6->sin6_addr, key, 16);
+    return AF_INET6 == nsrc->ss_family && AF_INET6 == ndst->ss_family? AF_INET6: AF_UNSPEC;
+}
+
+static ssize_t build_v1(int family, const struct sockaddr_storage *src,
+        const struct sockaddr_storage *dst, unsigned char *buf, size_t size) {
+    char shost[INET6_ADDRSTRLEN], dhost[INET6_ADDRSTRLEN];
+    unsigned int sport, dport;
+    int len;
+
+    if(AF_INET == family) {
+        const struct sockaddr_in *s = (const struct sockaddr_in*)src;
+        const struct sockaddr_in *d = (const struct sockaddr_in*)dst;
+        inet_ntop(AF_INET, &s->sin_addr, shost, sizeof(shost));
+        inet_ntop(AF_INET, &d->sin_addr, dhost, sizeof(dhost));
+        sport = ntohs(s->sin_port);
+        dport = ntohs(d->sin_port);
+    } else if(AF_INET6 == family) {
+        const struct sockaddr_in6 *s = (const struct sockaddr_in6*)src;
+        const struct sockaddr_in6 *d = (const struct sockaddr_in6*)dst;
+        inet_ntop(AF_INET6, &s->sin6_addr, shost, sizeof(shost));
+        inet_ntop(AF_INET6, &d->sin6_addr, dhost, sizeof(dhost));
+        sport = ntohs(s->sin6_port);
+        dport = ntohs(d->sin6_port);
+    } else {
+        len = snprintf((char*)buf, size, "PROXY UNKNOWN\r\n");
+        return len < 0 || (size_t)len >= size? -1: len;
+    }
+
+    len = snprintf((char*)buf, size, "PROXY %s %s %s %u %u\r\n",
+            AF_INET == family? "TCP4": "TCP6", shost, dhost, sport, dport);
+    return len < 0 || (size_t)len >= size? -1: len;
+}
+
+static ssize_t build_v2(int family, const struct sockaddr_storage *src,
+        const struct sockaddr_storage *dst, unsigned char *buf, size_t size) {
+    size_t addrlen = AF_INET == family? 12: AF_INET6 == family? 36: 0;
+    unsigned char *p = buf + 16;
+
+    if(size < 16 + addrlen)
+        return -1;
+    memcpy(buf, s_v2_signature, sizeof(s_v2_signature));
+    buf[12] = PROXYPROTO_V2_CMD_PROXY;
+    buf[13] = AF_INET == family? PROXYPROTO_V2_TCP4:
+        AF_INET6 == family? PROXYPROTO_V2_TCP6: PROXYPROTO_V2_UNSPEC;
+    buf[14] = (unsigned char)(addrlen >> 8);
+    buf[15] = (unsigned char)addrlen;
+
+    /*  addresses and ports are already in network order   */
+    if(AF_INET == family) {
+        const struct sockaddr_in *s = (const struct sockaddr_in*)src;
+        const struct sockaddr_in *d = (const struct sockaddr_in*)dst;
+        memcpy(p, &s->sin_addr, 4);
+        memcpy(p + 4, &d->sin_addr, 4);
+        memcpy(p + 8, &s->sin_port, 2);
+        memcpy(p + 10, &d->sin_port, 2);
+    } else if(AF_INET6 == family) {
+        const struct sockaddr_in6 *s = (const struct sockaddr_in6*)src;
+        const struct sockaddr_in6 *d = (const struct sockaddr_in6*)dst;
+        memcpy(p, &s->sin6_addr, 16);
+        memcpy(p + 16, &d->sin6_addr, 16);
+        memcpy(p + 32, &s->sin6_port, 2);
+        memcpy(p + 34, &d->sin6_port, 2);
+    }
+    return 16 + addrlen;
+}
+
+/*
+ * Builds the header announcing a TCP connection from src to dst into
+ * buf. Returns its length, or -1 if it does not fit.
+ */
+ssize_t proxyproto_build(int version, const struct sockaddr *src, const struct sockaddr *dst,
+        unsigned char *buf, size_t size) {
+    struct sockaddr_storage nsrc, ndst;
+    int family = normalize(src, dst, &nsrc, &ndst);
+
+    switch(version) {
+        case PROXYPROTO_V1:     return build_v1(family, &nsrc, &ndst, buf, size);
+        case PROXYPROTO_V2:     return build_v2(family, &nsrc, &ndst, buf, size);
+        default:                return -1;
+    }
+}
+
+static int parse_v1_addr(int family, char *host, char *port, struct sockaddr_storage *addr) {
+    char *end;
+    unsigned long p;
+
+    errno = 0;
+    p = strtoul(port, &end, 10);
+    if(errno || end == port || '\0' != *end || p > 65535 || ('0' == port[0] && port[1]))
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    if(AF_INET == family) {
+        struct sockaddr_in *in = (struct sockaddr_in*)addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)p);
+        return 1 == inet_pton(AF_INET, host, &in->sin_addr)? 0: -1;
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t)p);
+        return 1 == inet_pton(AF_INET6, host, &in6->sin6_addr)? 0: -1;
+    }
+}
+
+static ssize_t parse_v1(const unsigned char *buf, size_t len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    char line[PROXYPROTO_V1_MAX];
+    char *field[6], *save;
+    const unsigned char *eol;
+    size_t n, i;
+    int family;
+
+    if(len > PROXYPROTO_V1_MAX)
+        len = PROXYPROTO_V1_MAX;
+    if(NULL == (eol = (const unsigned char*)memchr(buf, '\n', len)) )
+        return PROXYPROTO_V1_MAX == len? -1: 0;
+    n = eol - buf;
+    if(n < 1 || '\r' != buf[n - 1])
+        return -1;
+    memcpy(line, buf, n - 1);
+    line[n - 1] = '\0';
+
+    for(i = 0; i < 6; ++i) {
+        if(NULL == (field[i] = strtok_r(i? NULL: line, " ", &save)) )
+            break;
+    }
+    if(i < 2 || 0 != strcmp(field[0], "PROXY"))
+        return -1;
+    if(0 == strcmp(field[1], "UNKNOWN")) {
+        src->ss_family = dst->ss_family = AF_UNSPEC;
+        return n + 1;
+    }
+    if(0 == strcmp(field[1], "TCP4"))
+        family = AF_INET;
+    else if(0 == strcmp(field[1], "TCP6"))
+        family = AF_INET6;
+    else
+        return -1;
+    if(6 != i || NULL != strtok_r(NULL, " ", &save)
+            || -1 == parse_v1_addr(family, field[2], field[4], src)
+            || -1 == parse_v1_addr(family, field[3], field[5], dst))
+        return -1;
+    return n + 1;
+}
+
+static ssize_t parse_v2(const unsigned char *buf, size_t len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    const unsigned char *p = buf + 16;
+    size_t addrlen, total;
+
+    if(len < 16)
+        return 0;
+    addrlen = (size_t)buf[14] << 8 | buf[15];
+    total = 16 + addrlen;
+    if(total > PROXYPROTO_MAX_INPUT)
+        return -1;
+    if(len < total)
+        return 0;
+
+    src->ss_family = dst->ss_family = AF_UNSPEC;
+    if(PROXYPROTO_V2_CMD_LOCAL == buf[12])
+        return total;
+    if(PROXYPROTO_V2_CMD_PROXY != buf[12])
+        return -1;
+
+    /*  only the address block is read, TLVs after it are skipped  */
+    if(PROXYPROTO_V2_TCP4 == buf[13]) {
+        struct sockaddr_in *s = (struct sockaddr_in*)src, *d = (struct sockaddr_in*)dst;
+        if(addrlen < 12)
+            return -1;
+        memset(src, 0, sizeof(*src));
+        memset(dst, 0, sizeof(*dst));
+        s->sin_family = d->sin_family = AF_INET;
+        memcpy(&s->sin_addr, p, 4);
+        memcpy(&d->sin_addr, p + 4, 4);
+        memcpy(&s->sin_port, p + 8, 2);
+        memcpy(&d->sin_port, p + 10, 2);
+    } else if(PROXYPROTO_V2_TCP6 == buf[13]) {
+        struct sockaddr_in6 *s = (struct sockaddr_in6*)src, *d = (struct sockaddr_in6*)dst;
+        if(addrlen < 36)
+            return -1;
+        memset(src, 0, sizeof(*src));
+        memset(dst, 0, sizeof(*dst));
+        s->sin6_family = d->sin6_family = AF_INET6;
+        memcpy(&s->sin6_addr, p, 16);
+        memcpy(&d->sin6_addr, p + 16, 16);
+        memcpy(&s->sin6_port, p + 32, 2);
+        memcpy(&d->sin6_port, p + 34, 2);
+    }
+    /*  other families and UDP are accepted and carry no address   */
+    return total;
+}
+
+/*
+ * Parses a v1 or v2 header at the start of buf without allocating.
+ * Returns the header length once it is complete, 0 while more bytes are
+ * needed and -1 for anything else. src and dst are AF_UNSPEC for
+ * headers that carry no addresses.
+ */
+ssize_t proxyproto_parse(const unsigned char *buf, size_t len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    size_t n = len < sizeof(s_v2_signature)? len: sizeof(s_v2_signature);
+
+    if(0 == len)
+        return 0;
+    if(0 == memcmp(buf, s_v2_signature, n))
+        return n < sizeof(s_v2_signature)? 0: parse_v2(buf, len, src, dst);
+    n = len < 6? len: 6;
+    if(0 == memcmp(buf, "PROXY ", n))
+        return n < 6? 0: parse_v1(buf, len, src, dst);
+    return -1;
+}
+
+static void header_wait_delete(EV_P_ HeaderWait *wait, int close_fd) {
+    ev_io_stop(loop, &wait->io);
+    ev_timer_stop(loop, &wait->timer);
+    if(close_fd) {
+        close_rst(wait->io.fd);
+        admission_fd_closed(loop, 1);
+    }
+    free(wait);
+}
+
+/*
+ * Peeks at what has arrived and consumes only the bytes that belong to
+ * the header, so the payload behind it stays queued in the socket for
+ * the relay.
+ */
+static void header_read_callback(EV_P_ ev_io *watcher, int revents) {
+    HeaderWait *wait = (HeaderWait*)watcher;
+    struct sockaddr_storage src, dst;
+    ssize_t n, len;
+    size_t take;
+    char peer[SOCKADDR_STRLEN];
+
+    n = recv(wait->io.fd, wait->buf + wait->have, sizeof(wait->buf) - wait->have, MSG_PEEK);
+    if(-1 == n) {
+        if(EAGAIN == errno || EWOULDBLOCK == errno)
+            return;
+        syslog(LOG_INFO, "proxyproto: recv: %m");
+        header_wait_delete(loop, wait, 1);
+        return;
+    }
+    if(0 == n) {
+        header_wait_delete(loop, wait, 1);
+        return;
+    }
+
+    if(-1 == (len = proxyproto_parse(wait->buf, wait->have + n, &src, &dst)) ) {
+        syslog(LOG_INFO, "proxyproto: invalid header from %s",
+                sockaddr_ntop((struct sockaddr*)&wait->peer, peer, sizeof(peer)));
+        header_wait_delete(loop, wait, 1);
+        return;
+    }
+    take = len? len - wait->have: (size_t)n;
+    if(-1 == read(wait->io.fd, wait->buf + wait->have, take)) {
+        header_wait_delete(loop, wait, 1);
+        return;
+    }
+    wait->have += take;
+    if(0 == len) {
+        if(wait->have == sizeof(wait->buf)) {
+            syslog(LOG_INFO, "proxyproto: oversized header from %s",
+                    sockaddr_ntop((struct sockaddr*)&wait->peer, peer, sizeof(peer)));
+            header_wait_delete(loop, wait, 1);
+        }
+        return;
+    }
+
+    int fd = wait->io.fd;
+    proxyprotoAcceptFn done = wait->done;
+    struct sockaddr_storage from = wait->peer;
+    header_wait_delete(loop, wait, 0);
+    if(AF_UNSPEC == src.ss_family)
+        (*done)(loop, fd, (struct sockaddr*)&from, NULL, NULL);
+    else
+        (*done)(loop, fd, (struct sockaddr*)&from, (struct sockaddr*)&src, (struct sockaddr*)&dst);
+}
+
+static void header_timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    HeaderWait *wait = (HeaderWait*)watcher->data;
+    char peer[SOCKADDR_STRLEN];
+
+    syslog(LOG_INFO, "proxyproto: no header from %s in time",
+            sockaddr_ntop((struct sockaddr*)&wait->peer, peer, sizeof(peer)));
+    header_wait_delete(loop, wait, 1);
+}
+
+/*
+ * Reads the header of a freshly accepted connection, then hands it to
+ * done. Connections that send anything else, more than
+ * PROXYPROTO_MAX_INPUT bytes of header or take longer than timeout are
+ * reset.
+ */
+int proxyproto_accept(EV_P_ int fd, const struct sockaddr *peer, ev_tstamp timeout,
+        proxyprotoAcceptFn done) {
+    HeaderWait *wait = (HeaderWait*)malloc(sizeof(HeaderWait));
+    if(NULL == wait) {
+        syslog(LOG_ERR, "proxyproto: malloc: %m");
+        return -1;
+    }
+    wait->done = done;
+    wait->have = 0;
+    memcpy(&wait->peer, peer, sockaddr_len(peer));
+
+    ev_io_init(&wait->io, header_read_callback, fd, EV_READ);
+    ev_timer_init(&wait->timer, header_timeout_callback, timeout, 0.);
+    wait->timer.data = wait;
+    ev_io_start(loop, &wait->io);
+    ev_timer_start(loop, &wait->timer);
+    return 0;
+}
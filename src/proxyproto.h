@@ -0,0 +1,41 @@
+/*
+ * proxyproto.h - layer-4 proxy PROXY protocol module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef PROXYPROTO_H
+#define PROXYPROTO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Versions of the HAProxy PROXY protocol header.   */
+enum { PROXYPROTO_NONE, PROXYPROTO_V1, PROXYPROTO_V2 };
+
+/* Longest header built: v1 with two IPv6 addresses is 104 bytes.    */
+#define PROXYPROTO_MAX_HEADER   108
+
+/* Largest header accepted, as the specification suggests for v2 with TLVs. */
+#define PROXYPROTO_MAX_INPUT    536
+
+int proxyproto_parse_version(const char *str);
+ssize_t proxyproto_build(int version, const struct sockaddr *src, const struct sockaddr *dst,
+        unsigned char *buf, size_t size);
+ssize_t proxyproto_parse(const unsigned char *buf, size_t len,
+        struct sockaddr_storage *src, struct sockaddr_storage *dst);
+
+/*
+ * Called once the header of an accepted connection has been read. The
+ * addresses are NULL for LOCAL or UNKNOWN headers, which carry none.
+ */
+typedef void (*proxyprotoAcceptFn)(EV_P_ int fd, const struct sockaddr *peer,
+        const struct sockaddr *src, const struct sockaddr *dst);
+int proxyproto_accept(EV_P_ int fd, const struct sockaddr *peer, ev_tstamp timeout,
+        proxyprotoAcceptFn done);
+
+#endif  /*  PROXYPROTO_H    */
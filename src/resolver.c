@@ -0,0 +1,764 @@
+/*
+ * resolver.c - layer-4 proxy asynchronous resolver module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "admission.h"
+#include "resolver.h"
+
+#define RESOLVER_PORT           53
+#define RESOLVER_CONF           "/etc/resolv.conf"
+#define RESOLVER_HOSTS          "/etc/hosts"
+#define RESOLVER_BUCKETS        1024
+#define RESOLVER_MAX_ENTRIES    4096
+#define RESOLVER_MAX_TTL        86400
+#define RESOLVER_NEGATIVE_TTL   30      /*  without an SOA to go by         */
+#define RESOLVER_MAX_NEGATIVE   300
+#define RESOLVER_FAILED_TTL     5
+#define RESOLVER_TIMEOUT        1.      /*  doubled on each retransmission  */
+#define RESOLVER_ATTEMPTS       3
+#define RESOLVER_PAYLOAD        1232    /*  EDNS0 UDP payload advertised    */
+
+#define DNS_HEADER      12
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_TC     0x0200
+#define DNS_FLAG_RD     0x0100
+#define DNS_RCODE_MASK  0x000f
+#define DNS_NOERROR     0
+#define DNS_NXDOMAIN    3
+#define DNS_TYPE_A      1
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_OPT    41
+#define DNS_CLASS_IN    1
+
+/* A and AAAA are asked for together, the AAAA query with id + 1. */
+enum { QUERY_A, QUERY_AAAA, QUERY_TYPES };
+
+static const uint16_t s_qtype[QUERY_TYPES] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+static const size_t s_rdlen[QUERY_TYPES] = {4, 16};
+
+typedef struct {
+    unsigned char           family;
+    unsigned char           addr[16];
+} CachedAddr;
+
+typedef struct cache_entry_t CacheEntry;
+typedef struct lookup_t Lookup;
+
+struct resolver_query_t {
+    ResolverQuery           *next;
+    CacheEntry              *entry;
+    resolverFn              done;
+    void                    *data;
+};
+
+struct cache_entry_t {
+    CacheEntry              *next;          /*  in its bucket   */
+    CacheEntry              *lru_prev;      /*  answered entries, least recently used first */
+    CacheEntry              *lru_next;
+    int                     in_lru;
+    int                     permanent;      /*  from /etc/hosts */
+    int                     status;
+    size_t                  naddrs;
+    CachedAddr              addrs[RESOLVER_MAX_ADDRS];
+    ev_tstamp               expires;
+    Lookup                  *lookup;        /*  while queries are outstanding   */
+    ResolverQuery           *waiters;
+    ResolverQuery           *delivering;    /*  waiters being called back   */
+    char                    name[];
+};
+
+/*
+ * The queries for one name, shared by everyone waiting for it. They
+ * are sent from a socket of their own, so a spoofed answer has to hit
+ * a random source port as well as the id and the case of the name.
+ */
+struct lookup_t {
+    ev_timer                timer;
+    ev_io                   io;
+    int                     family;         /*  of the socket   */
+    CacheEntry              *entry;
+    uint16_t                id;
+    int                     answered;       /*  1 << QUERY_*    */
+    int                     attempt;
+    size_t                  server;
+    int                     status[QUERY_TYPES];
+    uint32_t                ttl[QUERY_TYPES];
+    size_t                  naddrs[QUERY_TYPES];
+    CachedAddr              addrs[QUERY_TYPES][RESOLVER_MAX_ADDRS];
+    size_t                  qlen;
+    unsigned char           qname[256];     /*  in wire format, case randomized */
+};
+
+static struct sockaddr_storage s_servers[RESOLVER_MAX_SERVERS];
+static size_t s_nservers;
+
+static CacheEntry *s_cache[RESOLVER_BUCKETS];
+static CacheEntry *s_lru_head;
+static CacheEntry *s_lru_tail;
+static size_t s_entries;
+static uint64_t s_seed[2];
+static uint64_t s_counter;
+
+static inline uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline unsigned char *put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+    return p + 2;
+}
+
+static int parse_addr(const char *s, CachedAddr *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if(1 == inet_pton(AF_INET, s, addr->addr))
+        addr->family = AF_INET;
+    else if(1 == inet_pton(AF_INET6, s, addr->addr))
+        addr->family = AF_INET6;
+    else
+        return -1;
+    return 0;
+}
+
+static void addr_to_storage(const CachedAddr *addr, struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+    ss->ss_family = addr->family;
+    if(AF_INET == addr->family)
+        memcpy(&((struct sockaddr_in*)ss)->sin_addr, addr->addr, 4);
+    else
+        memcpy(&((struct sockaddr_in6*)ss)->sin6_addr, addr->addr, 16);
+}
+
+/*
+ * Lowercases name into key and encodes it as a question name. Only
+ * letters, digits, '-' and '_' are accepted in labels.
+ */
+static int normalize_name(const char *name, char *key, unsigned char *qname, size_t *qlen) {
+    size_t len = strlen(name), i, label = 0, pos = 1;
+    unsigned char *lenp = qname;
+
+    if(len && '.' == name[len - 1])
+        --len;
+    if(0 == len || len > 253)
+        return -1;
+    for(i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)tolower((unsigned char)name[i]);
+        if('.' == c) {
+            if(0 == label)
+                return -1;
+            *lenp = (unsigned char)label;
+            lenp = qname + pos++;
+            label = 0;
+        } else {
+            if(!(isalnum(c) || '-' == c || '_' == c) || ++label > 63)
+                return -1;
+            qname[pos++] = c;
+        }
+        key[i] = (char)c;
+    }
+    if(0 == label)
+        return -1;
+    *lenp = (unsigned char)label;
+    qname[pos++] = 0;
+    key[len] = '\0';
+    *qlen = pos;
+    return 0;
+}
+
+static size_t name_hash(const char *name) {
+    uint64_t h = s_seed[0];
+
+    while(*name)
+        h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+    return (size_t)hash_mix64(h ^ s_seed[1]) % RESOLVER_BUCKETS;
+}
+
+static void lru_unlink(CacheEntry *entry) {
+    if(!entry->in_lru)
+        return;
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        s_lru_head = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        s_lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+    entry->in_lru = 0;
+}
+
+static void lru_append(CacheEntry *entry) {
+    entry->lru_prev = s_lru_tail;
+    entry->lru_next = NULL;
+    if(s_lru_tail)
+        s_lru_tail->lru_next = entry;
+    else
+        s_lru_head = entry;
+    s_lru_tail = entry;
+    entry->in_lru = 1;
+}
+
+static CacheEntry *entry_find(const char *key) {
+    CacheEntry *entry = s_cache[name_hash(key)];
+
+    while(entry && 0 != strcmp(entry->name, key))
+        entry = entry->next;
+    return entry;
+}
+
+static void entry_free(CacheEntry *entry) {
+    CacheEntry **pp = &s_cache[name_hash(entry->name)];
+
+    while(*pp != entry)
+        pp = &(*pp)->next;
+    *pp = entry->next;
+    lru_unlink(entry);
+    --s_entries;
+    free(entry);
+}
+
+/* Only answered entries are on the LRU list, so no waiter is evicted. */
+static CacheEntry *entry_new(const char *key) {
+    size_t len = strlen(key), bucket = name_hash(key);
+    CacheEntry *entry;
+
+    if(s_entries >= RESOLVER_MAX_ENTRIES && s_lru_head)
+        entry_free(s_lru_head);
+    if(NULL == (entry = (CacheEntry*)calloc(1, sizeof(CacheEntry) + len + 1)) ) {
+        syslog(LOG_ERR, "resolver: malloc: %m");
+        return NULL;
+    }
+    memcpy(entry->name, key, len + 1);
+    entry->next = s_cache[bucket];
+    s_cache[bucket] = entry;
+    ++s_entries;
+    return entry;
+}
+
+/* Keeps IPv4 addresses ahead of IPv6 ones. */
+static void entry_add_addr(CacheEntry *entry, const CachedAddr *addr) {
+    size_t i = entry->naddrs;
+
+    if(RESOLVER_MAX_ADDRS == entry->naddrs)
+        return;
+    if(AF_INET == addr->family) {
+        while(i > 0 && AF_INET6 == entry->addrs[i - 1].family) {
+            entry->addrs[i] = entry->addrs[i - 1];
+            --i;
+        }
+    }
+    entry->addrs[i] = *addr;
+    ++entry->naddrs;
+}
+
+static size_t entry_addrs(const CacheEntry *entry, struct sockaddr_storage *addrs) {
+    size_t i;
+
+    for(i = 0; i < entry->naddrs; ++i)
+        addr_to_storage(&entry->addrs[i], &addrs[i]);
+    return entry->naddrs;
+}
+
+/* Even, and not guessable from earlier ones. */
+static uint16_t new_id(void) {
+    return (uint16_t)hash_mix64(s_seed[0] ^ ++s_counter) & ~1;
+}
+
+/*
+ * DNS 0x20: letters get a random case that the answer has to echo.
+ * Label lengths stay below 'A', so only the name's letters change.
+ */
+static void randomize_case(unsigned char *qname, size_t qlen) {
+    uint64_t bits = 0;
+    size_t i, n = 0;
+
+    for(i = 0; i < qlen; ++i) {
+        if(!isalpha(qname[i]))
+            continue;
+        if(0 == n % 64)
+            bits = hash_mix64(s_seed[1] ^ ++s_counter);
+        if(bits >> (n++ % 64) & 1)
+            qname[i] = (unsigned char)toupper(qname[i]);
+    }
+}
+
+static int from_server(const struct sockaddr *from) {
+    unsigned char a[16], b[16];
+    uint16_t pa, pb;
+    size_t i;
+
+    if(-1 == sockaddr_key(from, a, &pa))
+        return 0;
+    for(i = 0; i < s_nservers; ++i) {
+        if(0 == sockaddr_key((struct sockaddr*)&s_servers[i], b, &pb)
+                && pa == pb && 0 == memcmp(a, b, 16))
+            return 1;
+    }
+    return 0;
+}
+
+static ssize_t skip_name(const unsigned char *pkt, size_t len, size_t off) {
+    while(off < len) {
+        if(0 == pkt[off])
+            return off + 1;
+        if(0xc0 == (pkt[off] & 0xc0))
+            return off + 2 <= len? (ssize_t)(off + 2): -1;
+        off += 1 + pkt[off];
+    }
+    return -1;
+}
+
+static void read_callback(EV_P_ ev_io *watcher, int revents);
+static void timeout_callback(EV_P_ ev_timer *watcher, int revents);
+
+static void lookup_close(EV_P_ Lookup *l) {
+    if(-1 == l->io.fd)
+        return;
+    ev_io_stop(loop, &l->io);
+    close_i(l->io.fd);
+    admission_fd_closed(loop, 1);
+    ev_io_set(&l->io, -1, EV_READ);
+}
+
+/* The kernel picks a random ephemeral port, kept until the server family changes. */
+static int lookup_socket(EV_P_ Lookup *l, int family) {
+    int fd;
+
+    if(-1 != l->io.fd && family == l->family)
+        return l->io.fd;
+    lookup_close(loop, l);
+    if(-1 == (fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, 0)) ) {
+        syslog(LOG_ERR, "resolver: socket: %m");
+        return -1;
+    }
+    admission_fd_opened(loop, 1);
+    l->family = family;
+    ev_io_set(&l->io, fd, EV_READ);
+    ev_io_start(loop, &l->io);
+    return fd;
+}
+
+static void send_query(EV_P_ Lookup *l, int type) {
+    unsigned char pkt[DNS_HEADER + sizeof(l->qname) + 4 + 11];
+    const struct sockaddr *server = (struct sockaddr*)&s_servers[l->server];
+    unsigned char *p = pkt;
+    int fd;
+
+    if(-1 == (fd = lookup_socket(loop, l, server->sa_family)) )
+        return;
+
+    p = put16(p, l->id + type);
+    p = put16(p, DNS_FLAG_RD);
+    p = put16(p, 1);                /*  QDCOUNT */
+    p = put16(p, 0);
+    p = put16(p, 0);
+    p = put16(p, 1);                /*  ARCOUNT, the OPT record */
+    memcpy(p, l->qname, l->qlen);
+    p += l->qlen;
+    p = put16(p, s_qtype[type]);
+    p = put16(p, DNS_CLASS_IN);
+
+    /*  EDNS0, so that answers with many addresses aren't truncated    */
+    *p++ = 0;
+    p = put16(p, DNS_TYPE_OPT);
+    p = put16(p, RESOLVER_PAYLOAD);
+    p = put16(p, 0);
+    p = put16(p, 0);
+    p = put16(p, 0);
+
+    if(-1 == sendto(fd, pkt, p - pkt, 0, server, sockaddr_len(server)))
+        syslog(LOG_DEBUG, "resolver: sendto: %m");
+}
+
+/*
+ * Hands the result to everyone waiting. The list is detached first, so
+ * that a callback asking for the same name again waits for a new lookup.
+ */
+static void deliver(EV_P_ CacheEntry *entry) {
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    size_t naddrs = entry_addrs(entry, addrs);
+    ResolverQuery *query;
+
+    entry->delivering = entry->waiters;
+    entry->waiters = NULL;
+    while(NULL != (query = entry->delivering)) {
+        resolverFn done = query->done;
+        void *data = query->data;
+        entry->delivering = query->next;
+        free(query);
+        (*done)(loop, data, entry->status, addrs, naddrs);
+    }
+}
+
+static void lookup_finish(EV_P_ Lookup *l) {
+    CacheEntry *entry = l->entry;
+    uint32_t ttl = RESOLVER_MAX_TTL;
+    int type;
+    size_t i;
+
+    entry->naddrs = 0;
+    for(type = 0; type < QUERY_TYPES; ++type) {
+        for(i = 0; i < l->naddrs[type]; ++i)
+            entry_add_addr(entry, &l->addrs[type][i]);
+        if(l->naddrs[type] && l->ttl[type] < ttl)
+            ttl = l->ttl[type];
+    }
+    if(entry->naddrs) {
+        entry->status = RESOLVER_OK;
+    } else if(RESOLVER_FAILED == l->status[QUERY_A] || RESOLVER_FAILED == l->status[QUERY_AAAA]) {
+        entry->status = RESOLVER_FAILED;
+        ttl = RESOLVER_FAILED_TTL;
+    } else {
+        entry->status = RESOLVER_NOTFOUND;
+        ttl = l->ttl[QUERY_A] < l->ttl[QUERY_AAAA]? l->ttl[QUERY_A]: l->ttl[QUERY_AAAA];
+        if(ttl > RESOLVER_MAX_NEGATIVE)
+            ttl = RESOLVER_MAX_NEGATIVE;
+    }
+    entry->expires = ev_now(loop) + ttl;
+    syslog(LOG_DEBUG, "resolver: %s: status %d, %zu addresses, ttl %u",
+            entry->name, entry->status, entry->naddrs, ttl);
+
+    ev_timer_stop(loop, &l->timer);
+    lookup_close(loop, l);
+    entry->lookup = NULL;
+    free(l);
+
+    deliver(loop, entry);
+    if(NULL == entry->lookup)
+        lru_append(entry);
+}
+
+static void answer(EV_P_ Lookup *l, int type, int status, uint32_t ttl) {
+    l->status[type] = status;
+    l->ttl[type] = ttl;
+    l->answered |= 1 << type;
+    if((1 << QUERY_TYPES) - 1 == l->answered)
+        lookup_finish(loop, l);
+}
+
+/*
+ * Accepts a response only from a configured server, for the lookup's
+ * id, with its question in it, case included. Negative answers are
+ * cached for as long as the zone's SOA allows (RFC 2308). A truncated
+ * one proves nothing and fails instead.
+ */
+static void handle_response(EV_P_ Lookup *l, const unsigned char *pkt, size_t len,
+        const struct sockaddr *from) {
+    uint16_t id, flags, ancount, nscount, rtype, rclass, rdlen;
+    unsigned int i;
+    uint32_t rttl, ttl = RESOLVER_MAX_TTL, negative = RESOLVER_NEGATIVE_TTL;
+    ssize_t off = DNS_HEADER;
+    int type;
+
+    if(len < DNS_HEADER || !from_server(from))
+        return;
+    id = get16(pkt);
+    flags = get16(pkt + 2);
+    ancount = get16(pkt + 6);
+    nscount = get16(pkt + 8);
+    type = id & 1;
+    if(!(flags & DNS_FLAG_QR) || 1 != get16(pkt + 4)
+            || l->id != (id & ~1) || (l->answered & (1 << type)))
+        return;
+    if(len < DNS_HEADER + l->qlen + 4 || 0 != memcmp(pkt + off, l->qname, l->qlen)
+            || s_qtype[type] != get16(pkt + off + l->qlen)
+            || DNS_CLASS_IN != get16(pkt + off + l->qlen + 2))
+        return;
+    off += l->qlen + 4;
+
+    switch(flags & DNS_RCODE_MASK) {
+        case DNS_NOERROR:
+        case DNS_NXDOMAIN:
+            break;
+        default:
+            syslog(LOG_DEBUG, "resolver: %s: rcode %d", l->entry->name, flags & DNS_RCODE_MASK);
+            answer(loop, l, type, RESOLVER_FAILED, 0);
+            return;
+    }
+
+    for(i = 0; i < ancount + nscount; ++i) {
+        if(-1 == (off = skip_name(pkt, len, off)) || len < (size_t)off + 10)
+            break;
+        rtype = get16(pkt + off);
+        rclass = get16(pkt + off + 2);
+        rttl = get32(pkt + off + 4);
+        rdlen = get16(pkt + off + 8);
+        off += 10;
+        if(len < (size_t)off + rdlen)
+            break;
+        if(i < ancount) {
+            /*  CNAMEs are followed by the server, only the addresses count   */
+            if(DNS_CLASS_IN == rclass && s_qtype[type] == rtype && s_rdlen[type] == rdlen
+                    && l->naddrs[type] < RESOLVER_MAX_ADDRS) {
+                CachedAddr *addr = &l->addrs[type][l->naddrs[type]++];
+                addr->family = QUERY_A == type? AF_INET: AF_INET6;
+                memcpy(addr->addr, pkt + off, rdlen);
+                if(rttl < ttl)
+                    ttl = rttl;
+            }
+        } else if(DNS_TYPE_SOA == rtype && rdlen >= 20) {
+            uint32_t minimum = get32(pkt + off + rdlen - 4);
+            negative = rttl < minimum? rttl: minimum;
+        }
+        off += rdlen;
+    }
+
+    if(l->naddrs[type]) {
+        answer(loop, l, type, RESOLVER_OK, ttl);
+    } else if(flags & DNS_FLAG_TC) {
+        syslog(LOG_DEBUG, "resolver: %s: truncated answer", l->entry->name);
+        answer(loop, l, type, RESOLVER_FAILED, 0);
+    } else {
+        answer(loop, l, type, RESOLVER_NOTFOUND, negative);
+    }
+}
+
+/* One datagram at a time, an answer may finish and free the lookup. */
+static void read_callback(EV_P_ ev_io *watcher, int revents) {
+    static unsigned char pkt[4096];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n;
+
+    n = recvfrom(watcher->fd, pkt, sizeof(pkt), 0, (struct sockaddr*)&from, &fromlen);
+    if(-1 == n) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno)
+            syslog(LOG_DEBUG, "resolver: recvfrom: %m");
+        return;
+    }
+    handle_response(loop, (Lookup*)watcher->data, pkt, n, (struct sockaddr*)&from);
+}
+
+/* Retransmits what is unanswered to the next server, then gives up. */
+static void timeout_callback(EV_P_ ev_timer *watcher, int revents) {
+    Lookup *l = (Lookup*)watcher->data;
+    int type;
+
+    if(RESOLVER_ATTEMPTS == ++l->attempt) {
+        syslog(LOG_INFO, "resolver: %s: no answer", l->entry->name);
+        for(type = 0; type < QUERY_TYPES; ++type) {
+            if(!(l->answered & (1 << type)))
+                l->status[type] = RESOLVER_FAILED;
+        }
+        lookup_finish(loop, l);
+        return;
+    }
+
+    l->server = (l->server + 1) % s_nservers;
+    for(type = 0; type < QUERY_TYPES; ++type) {
+        if(!(l->answered & (1 << type)))
+            send_query(loop, l, type);
+    }
+    ev_timer_set(&l->timer, RESOLVER_TIMEOUT * (1 << l->attempt), 0.);
+    ev_timer_start(loop, &l->timer);
+}
+
+static int lookup_start(EV_P_ CacheEntry *entry, const unsigned char *qname, size_t qlen) {
+    Lookup *l = (Lookup*)calloc(1, sizeof(Lookup));
+
+    if(NULL == l) {
+        syslog(LOG_ERR, "resolver: malloc: %m");
+        return -1;
+    }
+    l->entry = entry;
+    l->id = new_id();
+    l->qlen = qlen;
+    memcpy(l->qname, qname, qlen);
+    randomize_case(l->qname, l->qlen);
+
+    lru_unlink(entry);
+    entry->lookup = l;
+
+    ev_io_init(&l->io, read_callback, -1, EV_READ);
+    l->io.data = l;
+    ev_timer_init(&l->timer, timeout_callback, RESOLVER_TIMEOUT, 0.);
+    l->timer.data = l;
+    ev_timer_start(loop, &l->timer);
+    send_query(loop, l, QUERY_A);
+    send_query(loop, l, QUERY_AAAA);
+    return 0;
+}
+
+/*
+ * Looks name up, answering from /etc/hosts or the cache right away.
+ * Concurrent lookups of a name share one pair of A and AAAA queries.
+ * done may run before this returns, which then returns NULL; otherwise
+ * the query can be cancelled until done runs.
+ */
+ResolverQuery *resolver_resolve(EV_P_ const char *name, resolverFn done, void *data) {
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    unsigned char qname[256];
+    char key[256];
+    size_t qlen;
+    CachedAddr literal;
+    CacheEntry *entry;
+    ResolverQuery *query;
+    int created = 0;
+
+    if(0 == parse_addr(name, &literal)) {
+        addr_to_storage(&literal, &addrs[0]);
+        (*done)(loop, data, RESOLVER_OK, addrs, 1);
+        return NULL;
+    }
+    if(-1 == normalize_name(name, key, qname, &qlen)) {
+        (*done)(loop, data, RESOLVER_NOTFOUND, NULL, 0);
+        return NULL;
+    }
+
+    entry = entry_find(key);
+    if(entry && NULL == entry->lookup && (entry->permanent || ev_now(loop) < entry->expires)) {
+        if(entry->in_lru) {
+            lru_unlink(entry);
+            lru_append(entry);
+        }
+        (*done)(loop, data, entry->status, addrs, entry_addrs(entry, addrs));
+        return NULL;
+    }
+
+    if(NULL == entry) {
+        if(NULL == (entry = entry_new(key)) )
+            goto fail;
+        created = 1;
+    }
+    if(NULL == entry->lookup && -1 == lookup_start(loop, entry, qname, qlen)) {
+        if(created)
+            entry_free(entry);
+        goto fail;
+    }
+    if(NULL == (query = (ResolverQuery*)malloc(sizeof(ResolverQuery))) ) {
+        syslog(LOG_ERR, "resolver: malloc: %m");
+        goto fail;
+    }
+    query->entry = entry;
+    query->done = done;
+    query->data = data;
+    query->next = entry->waiters;
+    entry->waiters = query;
+    return query;
+
+fail:
+    (*done)(loop, data, RESOLVER_FAILED, NULL, 0);
+    return NULL;
+}
+
+/* The lookup goes on, its answer is still cached. */
+void resolver_cancel(ResolverQuery *query) {
+    CacheEntry *entry = query->entry;
+    ResolverQuery **pp = &entry->waiters;
+
+    while(*pp && *pp != query)
+        pp = &(*pp)->next;
+    if(NULL == *pp) {
+        pp = &entry->delivering;
+        while(*pp && *pp != query)
+            pp = &(*pp)->next;
+    }
+    if(*pp) {
+        *pp = query->next;
+        free(query);
+    }
+}
+
+/* ADDR, or ADDR:PORT with IPv6 addresses in brackets. */
+int resolver_add_server(const char *server) {
+    struct sockaddr_storage *addr = &s_servers[s_nservers];
+    CachedAddr literal;
+
+    if(RESOLVER_MAX_SERVERS == s_nservers)
+        return -1;
+    if(0 == parse_addr(server, &literal)) {
+        addr_to_storage(&literal, addr);
+        if(AF_INET == literal.family)
+            ((struct sockaddr_in*)addr)->sin_port = htons(RESOLVER_PORT);
+        else
+            ((struct sockaddr_in6*)addr)->sin6_port = htons(RESOLVER_PORT);
+    } else if(-1 == sockaddr_resolve(server, SOCK_DGRAM, addr)) {
+        return -1;
+    }
+    ++s_nservers;
+    return 0;
+}
+
+static void load_hosts(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[1024], key[256], *p, *tok, *save;
+    unsigned char qname[256];
+    size_t qlen;
+    CachedAddr addr;
+    CacheEntry *entry;
+
+    if(NULL == fp)
+        return;
+    while(fgets(line, sizeof(line), fp)) {
+        p = line_strip(line);
+        if(NULL == (tok = strtok_r(p, " \t", &save)) || -1 == parse_addr(tok, &addr))
+            continue;
+        while(NULL != (tok = strtok_r(NULL, " \t", &save)) ) {
+            if(-1 == normalize_name(tok, key, qname, &qlen))
+                continue;
+            if(NULL == (entry = entry_find(key)) ) {
+                if(NULL == (entry = entry_new(key)) )
+                    break;
+                entry->permanent = 1;
+                entry->status = RESOLVER_OK;
+            }
+            entry_add_addr(entry, &addr);
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * Takes the servers from /etc/resolv.conf unless some were given, and
+ * the names in /etc/hosts. Search domains are not applied, names are
+ * always looked up as they are.
+ */
+int resolver_init(void) {
+    FILE *fp;
+    char line[256], *p;
+
+    hash_seed(s_seed);
+    if(0 == s_nservers && NULL != (fp = fopen(RESOLVER_CONF, "r")) ) {
+        while(fgets(line, sizeof(line), fp)) {
+            p = line_strip(line);
+            if(0 != strncmp(p, "nameserver", 10) || !(' ' == p[10] || '\t' == p[10]))
+                continue;
+            for(p += 10; ' ' == *p || '\t' == *p; ++p)
+                ;
+            if(s_nservers < RESOLVER_MAX_SERVERS && -1 == resolver_add_server(p))
+                syslog(LOG_WARNING, "resolver: ignoring nameserver %s", p);
+        }
+        fclose(fp);
+    }
+    if(0 == s_nservers && -1 == resolver_add_server("127.0.0.1"))
+        return -1;
+    load_hosts(RESOLVER_HOSTS);
+    return 0;
+}
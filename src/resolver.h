@@ -0,0 +1,41 @@
+/*
+ * resolver.h - layer-4 proxy asynchronous resolver module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define RESOLVER_MAX_ADDRS      8
+#define RESOLVER_MAX_SERVERS    3
+
+enum {
+    RESOLVER_OK,
+    RESOLVER_NOTFOUND,      /*  NXDOMAIN, or no address records    */
+    RESOLVER_FAILED,        /*  no usable answer from any server   */
+};
+
+typedef struct resolver_query_t ResolverQuery;
+
+/*
+ * Called once with the addresses a name has, IPv4 first and ports
+ * zero, or with naddrs 0 and the reason in status.
+ */
+typedef void (*resolverFn)(EV_P_ void *data, int status,
+        const struct sockaddr_storage *addrs, size_t naddrs);
+
+int resolver_add_server(const char *server);
+int resolver_init(void);
+
+ResolverQuery *resolver_resolve(EV_P_ const char *name, resolverFn done, void *data);
+void resolver_cancel(ResolverQuery *query);
+
+#endif  /*  RESOLVER_H  */
@@ -0,0 +1,183 @@
+/*
+ * shaper.c - layer-4 proxy bandwidth shaping module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "shaper.h"
+#include "profile.h"
+
+#define SHAPER_MIN_BURST    16384.
+#define SHAPER_MIN_DELAY    0.001
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE  47
+#endif
+
+/* Shared by every connection of the loop.  */
+static TokenBucket s_global[SHAPER_DIRECTIONS];
+
+static int parse_rate(const char *str, char **end, double *value) {
+    errno = 0;
+    *value = strtod(str, end);
+    if(errno || *end == str || *value < 0)
+        return -1;
+
+    switch(**end) {
+        case 'g': case 'G':     *value *= 1e9;  ++*end; break;
+        case 'm': case 'M':     *value *= 1e6;  ++*end; break;
+        case 'k': case 'K':     *value *= 1e3;  ++*end; break;
+        default:                break;
+    }
+    return 0;
+}
+
+/* Parses "RATE[:BURST]" in bytes per second, with optional k/M/G suffixes. */
+int shaper_parse_rate(const char *str, double *rate, double *burst) {
+    char *end;
+
+    if(-1 == parse_rate(str, &end, rate))
+        return -1;
+    if(':' == *end) {
+        if(-1 == parse_rate(end + 1, &end, burst))
+            return -1;
+    } else {
+        *burst = 0;
+    }
+    return '\0' == *end? 0: -1;
+}
+
+/* A zero burst holds a tenth of a second worth of tokens. */
+void token_bucket_init(TokenBucket *bucket, double rate, double burst) {
+    if(burst <= 0)
+        burst = rate / 10;
+    if(burst < SHAPER_MIN_BURST)
+        burst = SHAPER_MIN_BURST;
+
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->stamp = 0;
+}
+
+void shaper_global_init(double rate, double burst) {
+    int dir;
+
+    for(dir = 0; dir < SHAPER_DIRECTIONS; ++dir)
+        token_bucket_init(&s_global[dir], rate, burst);
+}
+
+static void set_pacing_rate(int fd, double rate) {
+    unsigned int r = rate >= UINT32_MAX? UINT32_MAX - 1: (unsigned int)rate;
+    if(-1 == setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r)))
+        syslog(LOG_WARNING, "setsockopt(SO_MAX_PACING_RATE): %m");
+}
+
+/*
+ * Sets *pshaper to NULL for connections nothing applies to. With hard
+ * pacing the per-flow limit is left to the kernel on the sending sockets,
+ * so only the shared buckets are enforced here.
+ */
+int shaper_new(EV_P_ Shaper **pshaper, Profile *profile, int clientfd, int remotefd) {
+    int flow = profile && profile->rate > 0;
+    int klass = profile && profile->klass[SHAPER_UP].rate > 0;
+    int dir;
+
+    *pshaper = NULL;
+    if(flow && profile->pacing_hard) {
+        set_pacing_rate(remotefd, profile->rate);
+        set_pacing_rate(clientfd, profile->rate);
+        flow = 0;
+    }
+    if(!flow && !klass && s_global[SHAPER_UP].rate <= 0)
+        return 0;
+
+    Shaper *shaper = (Shaper*)calloc(1, sizeof(Shaper));
+    if(NULL == shaper) {
+        syslog(LOG_ERR, "shaper: calloc: %m");
+        return -1;
+    }
+    for(dir = 0; dir < SHAPER_DIRECTIONS; ++dir) {
+        if(flow) {
+            token_bucket_init(&shaper->flow[dir], profile->rate, profile->burst);
+            shaper->flow[dir].stamp = ev_now(loop);
+        }
+        shaper->klass[dir] = klass? &profile->klass[dir]: NULL;
+    }
+    *pshaper = shaper;
+    return 0;
+}
+
+static inline double bucket_refill(TokenBucket *bucket, ev_tstamp now) {
+    if(bucket->rate <= 0)
+        return -1;
+    if(now > bucket->stamp) {
+        double tokens = bucket->tokens + (now - bucket->stamp) * bucket->rate;
+        bucket->tokens = tokens > bucket->burst? bucket->burst: tokens;
+        bucket->stamp = now;
+    }
+    return bucket->tokens;
+}
+
+static inline size_t clamp(size_t want, double tokens) {
+    if(tokens < 0)
+        return want;
+    return tokens < want? (size_t)tokens: want;
+}
+
+/* Bytes the direction may move now, at most want. */
+size_t shaper_allowance(EV_P_ Shaper *shaper, int dir, size_t want) {
+    ev_tstamp now = ev_now(loop);
+
+    want = clamp(want, bucket_refill(&shaper->flow[dir], now));
+    if(shaper->klass[dir])
+        want = clamp(want, bucket_refill(shaper->klass[dir], now));
+    return clamp(want, bucket_refill(&s_global[dir], now));
+}
+
+void shaper_consume(Shaper *shaper, int dir, size_t amount) {
+    if(shaper->flow[dir].rate > 0)
+        shaper->flow[dir].tokens -= amount;
+    if(shaper->klass[dir])
+        shaper->klass[dir]->tokens -= amount;
+    if(s_global[dir].rate > 0)
+        s_global[dir].tokens -= amount;
+}
+
+static inline ev_tstamp bucket_delay(const TokenBucket *bucket, size_t want) {
+    if(bucket->rate <= 0)
+        return 0;
+
+    /*  wake for a few milliseconds worth at a time, not every packet */
+    double need = bucket->rate * 0.005;
+    if(need > want)
+        need = want;
+    if(need > bucket->burst)
+        need = bucket->burst;
+    return need > bucket->tokens? (need - bucket->tokens) / bucket->rate: 0;
+}
+
+/* Time until the direction may move a worthwhile part of want. */
+ev_tstamp shaper_delay(Shaper *shaper, int dir, size_t want) {
+    ev_tstamp delay = bucket_delay(&shaper->flow[dir], want), d;
+
+    if(shaper->klass[dir] && (d = bucket_delay(shaper->klass[dir], want)) > delay)
+        delay = d;
+    if((d = bucket_delay(&s_global[dir], want)) > delay)
+        delay = d;
+    return delay < SHAPER_MIN_DELAY? SHAPER_MIN_DELAY: delay;
+}
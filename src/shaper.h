@@ -0,0 +1,49 @@
+/*
+ * shaper.h - layer-4 proxy bandwidth shaping module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stddef.h>
+
+/* Directions, client to remote and remote to client.  */
+enum { SHAPER_UP, SHAPER_DOWN, SHAPER_DIRECTIONS };
+
+typedef struct {
+    double          rate;       /*  bytes per second, 0 = unlimited */
+    double          burst;      /*  bucket depth in bytes           */
+    double          tokens;
+    ev_tstamp       stamp;
+} TokenBucket;
+
+/*
+ * Per-connection shaping state, only allocated for connections that are
+ * shaped at all. Reads are limited by the flow, class and global buckets
+ * in that order; proxy.c owns the timer that resumes a throttled reader.
+ */
+typedef struct {
+    TokenBucket     flow[SHAPER_DIRECTIONS];
+    TokenBucket     *klass[SHAPER_DIRECTIONS];
+    ev_timer        timer;
+} Shaper;
+
+struct profile_t;
+
+int shaper_parse_rate(const char *str, double *rate, double *burst);
+void token_bucket_init(TokenBucket *bucket, double rate, double burst);
+void shaper_global_init(double rate, double burst);
+
+int shaper_new(EV_P_ Shaper **pshaper, struct profile_t *profile, int clientfd, int remotefd);
+#define shaper_delete(shaper)   (free(shaper))
+
+size_t shaper_allowance(EV_P_ Shaper *shaper, int dir, size_t want);
+void shaper_consume(Shaper *shaper, int dir, size_t amount);
+ev_tstamp shaper_delay(Shaper *shaper, int dir, size_t want);
+
+#endif  /*  SHAPER_H    */
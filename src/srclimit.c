@@ -0,0 +1,191 @@
+/*
+ * srclimit.c - layer-4 proxy per-source connection limiting module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "srclimit.h"
+
+#define SRCLIMIT_DEFAULT_SLOTS  65536
+#define SRCLIMIT_MAX_PROBE      16
+
+/*
+ * One slot per source address, IPv4 sources are stored v4-mapped. A slot
+ * with no connections and a full bucket is idle and may be taken over by
+ * another address; slots never become empty again once used, which keeps
+ * linear probing correct without tombstones.
+ */
+typedef struct {
+    unsigned char   addr[16];
+    uint32_t        conns;
+    float           tokens;
+    ev_tstamp       stamp;
+} SrcSlot;
+
+static SrcLimits s_limits;
+static SrcSlot *s_slots;
+static size_t s_mask;
+static uint64_t s_seed[2];
+static ev_tstamp s_full_logged;
+
+static const unsigned char s_unused[16];
+
+/* Seeded so remote peers cannot aim their addresses at one probe chain. */
+static inline size_t slot_hash(const unsigned char addr[16]) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr, 8);
+    memcpy(&lo, addr + 8, 8);
+    return (size_t)hash_mix64(hash_mix64(hi ^ s_seed[0]) ^ lo ^ s_seed[1]);
+}
+
+static void slot_refill(SrcSlot *slot, ev_tstamp now) {
+    if(s_limits.rate <= 0)
+        return;
+
+    double tokens = slot->tokens + (now - slot->stamp) * s_limits.rate;
+    slot->tokens = tokens > s_limits.burst? s_limits.burst: tokens;
+    slot->stamp = now;
+}
+
+static int slot_idle(SrcSlot *slot, ev_tstamp now) {
+    if(slot->conns)
+        return 0;
+    slot_refill(slot, now);
+    return s_limits.rate <= 0 || slot->tokens >= s_limits.burst;
+}
+
+void srclimit_limits_default(SrcLimits *limits) {
+    memset(limits, 0, sizeof(SrcLimits));
+    limits->slots = SRCLIMIT_DEFAULT_SLOTS;
+}
+
+/* Parses "RATE[:BURST]"; BURST defaults to RATE, and at least one. */
+int srclimit_parse_rate(SrcLimits *limits, const char *str) {
+    char *end;
+
+    errno = 0;
+    limits->rate = strtod(str, &end);
+    if(errno || end == str || limits->rate < 0)
+        return -1;
+    if(':' == *end) {
+        str = end + 1;
+        limits->burst = strtod(str, &end);
+        if(errno || end == str || limits->burst < 0)
+            return -1;
+    } else {
+        limits->burst = 0;
+    }
+    return '\0' == *end? 0: -1;
+}
+
+/*
+ * May be called again to change the limits. The table is allocated once
+ * some limit is set, and keeps the size it got then.
+ */
+int srclimit_init(const SrcLimits *limits) {
+    s_limits = *limits;
+    if(0 == s_limits.max_conns && s_limits.rate <= 0)
+        return 0;
+
+    if(s_limits.burst <= 0)
+        s_limits.burst = s_limits.rate;
+    if(s_limits.burst < 1)
+        s_limits.burst = 1;
+    if(s_slots)
+        return 0;
+
+    size_t size = 1;
+    while(size < s_limits.slots)
+        size <<= 1;
+    if(NULL == (s_slots = (SrcSlot*)calloc(size, sizeof(SrcSlot))) ) {
+        syslog(LOG_ERR, "srclimit: calloc: %m");
+        return -1;
+    }
+    s_mask = size - 1;
+    hash_seed(s_seed);
+    return 0;
+}
+
+/*
+ * Looks up the source within a bounded probe window, reusing the first
+ * idle slot when the address has none. Returns 0 when the connection is
+ * admitted, -1 when the source is over one of its limits. Sources that
+ * find the window full are admitted untracked rather than refused.
+ */
+int srclimit_acquire(EV_P_ const struct sockaddr *addr, int *slot) {
+    unsigned char key[16];
+    SrcSlot *found = NULL, *reuse = NULL;
+    ev_tstamp now = ev_now(loop);
+    size_t i, pos;
+
+    *slot = SRCLIMIT_NONE;
+    if(NULL == s_slots || -1 == sockaddr_key(addr, key, NULL))
+        return 0;
+
+    pos = slot_hash(key) & s_mask;
+    for(i = 0; i < SRCLIMIT_MAX_PROBE; ++i, pos = (pos + 1) & s_mask) {
+        SrcSlot *cur = &s_slots[pos];
+        if(0 == memcmp(cur->addr, key, 16)) {
+            found = cur;
+            break;
+        }
+        if(0 == memcmp(cur->addr, s_unused, 16)) {
+            if(NULL == reuse)
+                reuse = cur;
+            break;
+        }
+        if(NULL == reuse && slot_idle(cur, now))
+            reuse = cur;
+    }
+
+    if(NULL == found) {
+        if(NULL == reuse) {
+            if(now - s_full_logged >= 1.) {
+                syslog(LOG_WARNING, "srclimit: probe window full, admitting untracked");
+                s_full_logged = now;
+            }
+            return 0;
+        }
+        found = reuse;
+        memcpy(found->addr, key, 16);
+        found->conns = 0;
+        found->tokens = s_limits.burst;
+        found->stamp = now;
+    }
+
+    if(s_limits.max_conns && found->conns >= s_limits.max_conns)
+        return -1;
+    if(s_limits.rate > 0) {
+        slot_refill(found, now);
+        if(found->tokens < 1)
+            return -1;
+        found->tokens -= 1;
+    }
+
+    ++found->conns;
+    *slot = (int)(found - s_slots);
+    return 0;
+}
+
+void srclimit_release(int slot) {
+    if(SRCLIMIT_NONE == slot)
+        return;
+
+    --s_slots[slot].conns;
+}
@@ -0,0 +1,34 @@
+/*
+ * srclimit.h - layer-4 proxy per-source connection limiting module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef SRCLIMIT_H
+#define SRCLIMIT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Returned in *slot for connections that are not tracked.  */
+#define SRCLIMIT_NONE   (-1)
+
+typedef struct {
+    unsigned int    max_conns;  /*  concurrent connections per source, 0 = unlimited    */
+    double          rate;       /*  new connections per second, 0 = unlimited           */
+    double          burst;      /*  token bucket depth, defaults to rate                */
+    size_t          slots;      /*  hash table size, rounded up to a power of 2         */
+} SrcLimits;
+
+void srclimit_limits_default(SrcLimits *limits);
+int srclimit_parse_rate(SrcLimits *limits, const char *str);
+int srclimit_init(const SrcLimits *limits);
+
+int srclimit_acquire(EV_P_ const struct sockaddr *addr, int *slot);
+void srclimit_release(int slot);
+
+#endif  /*  SRCLIMIT_H  */
@@ -0,0 +1,571 @@
+/*
+ * udprelay.c - layer-4 proxy UDP relay module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "netutil.h"
+#include "admission.h"
+#include "acl.h"
+#include "udprelay.h"
+
+#define UDP_BATCH           32
+#define UDP_SLOT_SIZE       65536   /*  a full datagram or GRO train    */
+#define UDP_ROUNDS          8       /*  batches per callback            */
+#define UDP_CONTROL_SIZE    (CMSG_SPACE(sizeof(struct sockaddr_in6)) + CMSG_SPACE(sizeof(int)))
+#define UDP_SEGMENT_SIZE    CMSG_SPACE(sizeof(uint16_t))
+
+#ifndef SOL_UDP
+#define SOL_UDP             17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT         103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO             104
+#endif
+#ifndef IP_TRANSPARENT
+#define IP_TRANSPARENT      19
+#endif
+#ifndef IP_RECVORIGDSTADDR
+#define IP_RECVORIGDSTADDR  20
+#endif
+#ifndef IP_ORIGDSTADDR
+#define IP_ORIGDSTADDR      IP_RECVORIGDSTADDR
+#endif
+#ifndef IPV6_TRANSPARENT
+#define IPV6_TRANSPARENT    75
+#endif
+#ifndef IPV6_RECVORIGDSTADDR
+#define IPV6_RECVORIGDSTADDR 74
+#endif
+#ifndef IPV6_ORIGDSTADDR
+#define IPV6_ORIGDSTADDR    IPV6_RECVORIGDSTADDR
+#endif
+
+/* The protocol is always UDP, so the rest of the 5-tuple is the key. */
+typedef struct {
+    unsigned char   src[16];
+    unsigned char   dst[16];
+    uint16_t        sport;
+    uint16_t        dport;
+} FlowKey;
+
+typedef struct udp_flow_t UdpFlow;
+
+/*
+ * The upstream socket is connected to the destination. In transparent
+ * mode the reply socket is bound to the original destination and
+ * connected to the client; being more specific than the listener it also
+ * receives the client's later datagrams, so it is read as well.
+ */
+struct udp_flow_t {
+    ev_io                   up;
+    ev_io                   down;       /*  fd -1 if replies use the listener */
+    FlowKey                 key;
+    UdpFlow                 *hash_next;
+    UdpFlow                 *lru_prev;
+    UdpFlow                 *lru_next;
+    ev_tstamp               last_active;
+    struct sockaddr_storage client;
+};
+
+static UdpRelayConfig s_config;
+static ev_io s_listener;
+static FlowKey s_local;          /*  dst half: the listener's own address  */
+static int s_local_any;
+static ev_timer s_sweep;
+
+static UdpFlow **s_buckets;
+static size_t s_mask;
+static size_t s_nflows;
+static uint64_t s_seed[2];
+static UdpFlow *s_lru_head;
+static UdpFlow *s_lru_tail;
+static int s_segment_warned;
+
+/* One set of batch buffers, the loop never runs two batches at once. */
+static unsigned char s_bufs[UDP_BATCH][UDP_SLOT_SIZE];
+static struct mmsghdr s_in[UDP_BATCH];
+static struct iovec s_in_iovs[UDP_BATCH];
+static struct sockaddr_storage s_in_names[UDP_BATCH];
+static char s_in_controls[UDP_BATCH][UDP_CONTROL_SIZE];
+static struct mmsghdr s_out[UDP_BATCH];
+static struct iovec s_out_iovs[UDP_BATCH];
+static char s_out_controls[UDP_BATCH][UDP_SEGMENT_SIZE];
+static UdpFlow *s_out_flows[UDP_BATCH];
+
+static void listener_callback(EV_P_ ev_io *watcher, int revents);
+static void upstream_callback(EV_P_ ev_io *watcher, int revents);
+static void downstream_callback(EV_P_ ev_io *watcher, int revents);
+static void sweep_callback(EV_P_ ev_timer *watcher, int revents);
+
+void udp_relay_config_default(UdpRelayConfig *config) {
+    memset(config, 0, sizeof(UdpRelayConfig));
+    config->idle_timeout = 30.;
+    config->max_flows = 65536;
+}
+
+static inline size_t flow_hash(const FlowKey *key) {
+    uint64_t w[4];
+    uint64_t h;
+
+    memcpy(w, key->src, 16);
+    memcpy(w + 2, key->dst, 16);
+    h = hash_mix64(w[0] ^ s_seed[0]);
+    h = hash_mix64(h ^ w[1]);
+    h = hash_mix64(h ^ w[2]);
+    h = hash_mix64(h ^ w[3] ^ s_seed[1]);
+    return (size_t)hash_mix64(h ^ ((uint64_t)key->sport << 16 | key->dport));
+}
+
+static void lru_unlink(UdpFlow *flow) {
+    if(flow->lru_prev)
+        flow->lru_prev->lru_next = flow->lru_next;
+    else
+        s_lru_head = flow->lru_next;
+    if(flow->lru_next)
+        flow->lru_next->lru_prev = flow->lru_prev;
+    else
+        s_lru_tail = flow->lru_prev;
+    flow->lru_prev = flow->lru_next = NULL;
+}
+
+static void lru_append(UdpFlow *flow) {
+    flow->lru_prev = s_lru_tail;
+    flow->lru_next = NULL;
+    if(s_lru_tail)
+        s_lru_tail->lru_next = flow;
+    else
+        s_lru_head = flow;
+    s_lru_tail = flow;
+}
+
+static void flow_touch(EV_P_ UdpFlow *flow) {
+    flow->last_active = ev_now(loop);
+    if(s_lru_tail != flow) {
+        lru_unlink(flow);
+        lru_append(flow);
+    }
+}
+
+static void flow_delete(EV_P_ UdpFlow *flow) {
+    UdpFlow **pp = &s_buckets[flow_hash(&flow->key) & s_mask];
+    int fds = 1;
+
+    while(*pp != flow)
+        pp = &(*pp)->hash_next;
+    *pp = flow->hash_next;
+    lru_unlink(flow);
+
+    ev_io_stop(loop, &flow->up);
+    close_i(flow->up.fd);
+    if(-1 != flow->down.fd) {
+        ev_io_stop(loop, &flow->down);
+        close_i(flow->down.fd);
+        ++fds;
+    }
+    admission_fd_closed(loop, fds);
+    free(flow);
+    --s_nflows;
+}
+
+static int open_upstream(const struct sockaddr_storage *dst) {
+    int fd = socket(dst->ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int opt = 1;
+
+    if(-1 == fd) {
+        syslog(LOG_ERR, "udprelay: socket: %m");
+        return -1;
+    }
+    if(s_config.gro)
+        setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+    if(-1 == connect(fd, (const struct sockaddr*)dst, sockaddr_len((const struct sockaddr*)dst))) {
+        syslog(LOG_ERR, "udprelay: connect: %m");
+        close_i(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Speaks from the original destination's address, which needs CAP_NET_ADMIN. */
+static int open_reply(const struct sockaddr_storage *origdst, const struct sockaddr_storage *client) {
+    int fd = socket(origdst->ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int opt = 1;
+
+    if(-1 == fd) {
+        syslog(LOG_ERR, "udprelay: socket: %m");
+        return -1;
+    }
+    if(AF_INET6 == origdst->ss_family)
+        setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &opt, sizeof(opt));
+    else
+        setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if(s_config.gro)
+        setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+
+    if(-1 == bind(fd, (const struct sockaddr*)origdst, sockaddr_len((const struct sockaddr*)origdst))) {
+        syslog(LOG_ERR, "udprelay: bind: %m");
+        goto error;
+    }
+    if(-1 == connect(fd, (const struct sockaddr*)client, sockaddr_len((const struct sockaddr*)client))) {
+        syslog(LOG_ERR, "udprelay: connect: %m");
+        goto error;
+    }
+    return fd;
+
+error:
+    close_i(fd);
+    return -1;
+}
+
+/*
+ * Creates the flow for a datagram no flow matched. The least recently
+ * active flow makes room when the table is full.
+ */
+static UdpFlow *flow_new(EV_P_ const FlowKey *key, struct sockaddr_storage *client,
+        struct sockaddr_storage *dst) {
+    UdpFlow *flow;
+    int fds = 1;
+
+    if(admission_overloaded())
+        return NULL;
+    sockaddr_unmap(dst);
+    if(s_config.acl && -1 == acl_check(s_config.acl, (struct sockaddr*)dst))
+        return NULL;
+    if(s_nflows >= s_config.max_flows) {
+        /*  flows of the batch in hand were touched now and must stay  */
+        if(NULL == s_lru_head || s_lru_head->last_active >= ev_now(loop))
+            return NULL;
+        flow_delete(loop, s_lru_head);
+    }
+
+    if(NULL == (flow = (UdpFlow*)calloc(1, sizeof(UdpFlow))) ) {
+        syslog(LOG_ERR, "udprelay: calloc: %m");
+        return NULL;
+    }
+    flow->key = *key;
+    flow->client = *client;     /*  as the listener sees it, for its replies    */
+
+    int upfd = open_upstream(dst);
+    if(-1 == upfd) {
+        free(flow);
+        return NULL;
+    }
+    int downfd = -1;
+    if(!s_config.has_upstream) {
+        sockaddr_unmap(client);
+        if(client->ss_family != dst->ss_family || -1 == (downfd = open_reply(dst, client)) ) {
+            close_i(upfd);
+            free(flow);
+            return NULL;
+        }
+        ++fds;
+    }
+    admission_fd_opened(loop, fds);
+
+    ev_io_init(&flow->up, upstream_callback, upfd, EV_READ);
+    flow->up.data = flow;
+    ev_io_start(loop, &flow->up);
+    ev_io_init(&flow->down, downstream_callback, downfd, EV_READ);
+    flow->down.data = flow;
+    if(-1 != downfd)
+        ev_io_start(loop, &flow->down);
+
+    size_t bucket = flow_hash(key) & s_mask;
+    flow->hash_next = s_buckets[bucket];
+    s_buckets[bucket] = flow;
+    flow->last_active = ev_now(loop);
+    lru_append(flow);
+    ++s_nflows;
+    return flow;
+}
+
+static UdpFlow *flow_find(const FlowKey *key) {
+    UdpFlow *flow = s_buckets[flow_hash(key) & s_mask];
+
+    while(flow && 0 != memcmp(&flow->key, key, sizeof(FlowKey)))
+        flow = flow->hash_next;
+    return flow;
+}
+
+static void prepare_recv(int want_names) {
+    int i;
+
+    for(i = 0; i < UDP_BATCH; ++i) {
+        struct msghdr *hdr = &s_in[i].msg_hdr;
+        s_in_iovs[i].iov_base = s_bufs[i];
+        s_in_iovs[i].iov_len = UDP_SLOT_SIZE;
+        hdr->msg_iov = &s_in_iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_name = want_names? &s_in_names[i]: NULL;
+        hdr->msg_namelen = want_names? sizeof(struct sockaddr_storage): 0;
+        hdr->msg_control = s_in_controls[i];
+        hdr->msg_controllen = UDP_CONTROL_SIZE;
+        hdr->msg_flags = 0;
+    }
+}
+
+/* Picks the original destination and the GRO segment size, if any. */
+static void parse_control(struct msghdr *hdr, struct sockaddr_storage *origdst, int *gso) {
+    struct cmsghdr *cmsg;
+
+    *gso = 0;
+    for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if(SOL_IP == cmsg->cmsg_level && IP_ORIGDSTADDR == cmsg->cmsg_type)
+            memcpy(origdst, CMSG_DATA(cmsg), sizeof(struct sockaddr_in));
+        else if(SOL_IPV6 == cmsg->cmsg_level && IPV6_ORIGDSTADDR == cmsg->cmsg_type)
+            memcpy(origdst, CMSG_DATA(cmsg), sizeof(struct sockaddr_in6));
+        else if(SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type)
+            memcpy(gso, CMSG_DATA(cmsg), sizeof(int));
+    }
+}
+
+/*
+ * Fills out[k] to send the n bytes received in slot i, splitting a GRO
+ * train back into its segments with UDP_SEGMENT.
+ */
+static void prepare_send(int k, int i, size_t len, int gso, const struct sockaddr_storage *name) {
+    struct msghdr *hdr = &s_out[k].msg_hdr;
+
+    memset(hdr, 0, sizeof(struct msghdr));
+    s_out_iovs[k].iov_base = s_bufs[i];
+    s_out_iovs[k].iov_len = len;
+    hdr->msg_iov = &s_out_iovs[k];
+    hdr->msg_iovlen = 1;
+    if(name) {
+        hdr->msg_name = (void*)name;
+        hdr->msg_namelen = sockaddr_len((const struct sockaddr*)name);
+    }
+    if(gso > 0 && len > (size_t)gso) {
+        uint16_t segment = (uint16_t)gso;
+        struct cmsghdr *cmsg;
+
+        hdr->msg_control = s_out_controls[k];
+        hdr->msg_controllen = UDP_SEGMENT_SIZE;
+        cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(uint16_t));
+    }
+}
+
+/* Datagrams that do not fit the socket buffer are dropped, as UDP would. */
+static void send_batch(int fd, struct mmsghdr *msgs, int n) {
+    while(n > 0) {
+        int sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+        if(-1 == sent) {
+            if(EIO == errno || EINVAL == errno) {
+                if(!s_segment_warned) {
+                    syslog(LOG_WARNING, "udprelay: sendmmsg: %m, is UDP_SEGMENT supported?");
+                    s_segment_warned = 1;
+                }
+            } else if(EAGAIN != errno && EWOULDBLOCK != errno && ECONNREFUSED != errno) {
+                syslog(LOG_DEBUG, "udprelay: sendmmsg: %m");
+            }
+            /*  skip the datagram that failed, keep the rest of the batch  */
+            sent = 1;
+        }
+        msgs += sent;
+        n -= sent;
+    }
+}
+
+static void listener_callback(EV_P_ ev_io *watcher, int revents) {
+    int round, got, i, k, n;
+
+    for(round = 0; round < UDP_ROUNDS; ++round) {
+        prepare_recv(1);
+        if(-1 == (got = recvmmsg(watcher->fd, s_in, UDP_BATCH, MSG_DONTWAIT, NULL)) ) {
+            if(EAGAIN != errno && EWOULDBLOCK != errno)
+                syslog(LOG_ERR, "udprelay: recvmmsg: %m");
+            return;
+        }
+
+        for(i = 0, k = 0; i < got; ++i) {
+            struct msghdr *hdr = &s_in[i].msg_hdr;
+            struct sockaddr_storage dst = s_config.upstream;
+            FlowKey key;
+            UdpFlow *flow;
+            int gso;
+
+            if(hdr->msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+                continue;
+            parse_control(hdr, &dst, &gso);
+            if(-1 == sockaddr_key((struct sockaddr*)&s_in_names[i], key.src, &key.sport)
+                    || -1 == sockaddr_key((struct sockaddr*)&dst, key.dst, &key.dport))
+                continue;
+
+            if(!s_config.has_upstream && key.dport == s_local.dport
+                    && (s_local_any || 0 == memcmp(key.dst, s_local.dst, 16)))
+                continue;       /*  not redirected, relaying it would loop  */
+            if(NULL == (flow = flow_find(&key))
+                    && NULL == (flow = flow_new(loop, &key, &s_in_names[i], &dst)) )
+                continue;
+            flow_touch(loop, flow);
+            s_out_flows[k] = flow;
+            prepare_send(k++, i, s_in[i].msg_len, gso, NULL);
+        }
+
+        /*  consecutive datagrams of one flow go out in one sendmmsg()  */
+        for(i = 0; i < k; i = n) {
+            UdpFlow *flow = s_out_flows[i];
+            for(n = i + 1; n < k && s_out_flows[n] == flow; ++n)
+                ;
+            send_batch(flow->up.fd, &s_out[i], n - i);
+        }
+
+        if(got < UDP_BATCH)
+            return;
+    }
+}
+
+/* Moves a batch from a flow socket to the peer behind tofd. */
+static int relay(EV_P_ UdpFlow *flow, int fromfd, int tofd, const struct sockaddr_storage *name) {
+    int n, i, k, gso;
+    struct sockaddr_storage unused;
+
+    prepare_recv(0);
+    if(-1 == (n = recvmmsg(fromfd, s_in, UDP_BATCH, MSG_DONTWAIT, NULL)) ) {
+        if(EAGAIN != errno && EWOULDBLOCK != errno)
+            syslog(LOG_DEBUG, "udprelay: recvmmsg: %m");
+        return 0;
+    }
+    for(i = 0, k = 0; i < n; ++i) {
+        if(s_in[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+            continue;
+        parse_control(&s_in[i].msg_hdr, &unused, &gso);
+        prepare_send(k++, i, s_in[i].msg_len, gso, name);
+    }
+    flow_touch(loop, flow);
+    send_batch(tofd, s_out, k);
+    return n;
+}
+
+static void upstream_callback(EV_P_ ev_io *watcher, int revents) {
+    UdpFlow *flow = (UdpFlow*)watcher->data;
+    int round;
+
+    for(round = 0; round < UDP_ROUNDS; ++round) {
+        int n = -1 == flow->down.fd?
+            relay(loop, flow, flow->up.fd, s_listener.fd, &flow->client):
+            relay(loop, flow, flow->up.fd, flow->down.fd, NULL);
+        if(n < UDP_BATCH)
+            return;
+    }
+}
+
+static void downstream_callback(EV_P_ ev_io *watcher, int revents) {
+    UdpFlow *flow = (UdpFlow*)watcher->data;
+    int round;
+
+    for(round = 0; round < UDP_ROUNDS; ++round) {
+        if(relay(loop, flow, flow->down.fd, flow->up.fd, NULL) < UDP_BATCH)
+            return;
+    }
+}
+
+static void sweep_callback(EV_P_ ev_timer *watcher, int revents) {
+    ev_tstamp deadline = ev_now(loop) - s_config.idle_timeout;
+
+    while(s_lru_head && s_lru_head->last_active <= deadline)
+        flow_delete(loop, s_lru_head);
+}
+
+size_t udp_relay_flows(void) {
+    return s_nflows;
+}
+
+/* Checked for new flows from now on. */
+void udp_relay_set_acl(const struct acl_t *acl) {
+    s_config.acl = acl;
+}
+
+/*
+ * Stops taking datagrams, the socket stays open so that replies of the
+ * flows there are still go out until they expire.
+ */
+void udp_relay_stop(EV_P) {
+    ev_io_stop(loop, &s_listener);
+}
+
+int udp_relay_start(EV_P_ int fd, const UdpRelayConfig *config) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int opt = 1;
+
+    s_config = *config;
+    if(0 == s_config.max_flows)
+        s_config.max_flows = 1;
+
+    size_t size = 1;
+    while(size < s_config.max_flows)
+        size <<= 1;
+    if(NULL == (s_buckets = (UdpFlow**)calloc(size, sizeof(UdpFlow*))) ) {
+        syslog(LOG_ERR, "udprelay: calloc: %m");
+        return -1;
+    }
+    s_mask = size - 1;
+    hash_seed(s_seed);
+
+    if(-1 == getsockname(fd, (struct sockaddr*)&addr, &len)) {
+        syslog(LOG_ERR, "udprelay: getsockname: %m");
+        return -1;
+    }
+    sockaddr_key((struct sockaddr*)&addr, s_local.dst, &s_local.dport);
+    s_local_any = AF_INET6 == addr.ss_family?
+        IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*)&addr)->sin6_addr):
+        INADDR_ANY == ((struct sockaddr_in*)&addr)->sin_addr.s_addr;
+    if(!s_config.has_upstream) {
+        /*  an AF_INET6 socket also gets IPv4 datagrams, set both   */
+        if(AF_INET6 == addr.ss_family) {
+            setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &opt, sizeof(opt));
+            if(-1 == setsockopt(fd, SOL_IPV6, IPV6_RECVORIGDSTADDR, &opt, sizeof(opt))) {
+                syslog(LOG_ERR, "udprelay: setsockopt(IPV6_RECVORIGDSTADDR): %m");
+                return -1;
+            }
+        }
+        if(-1 == setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt)))
+            syslog(LOG_WARNING, "udprelay: setsockopt(IP_TRANSPARENT): %m");
+        if(-1 == setsockopt(fd, SOL_IP, IP_RECVORIGDSTADDR, &opt, sizeof(opt))
+                && AF_INET == addr.ss_family) {
+            syslog(LOG_ERR, "udprelay: setsockopt(IP_RECVORIGDSTADDR): %m");
+            return -1;
+        }
+    }
+    if(s_config.gro && -1 == setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt))) {
+        syslog(LOG_WARNING, "udprelay: setsockopt(UDP_GRO): %m, continuing without");
+        s_config.gro = 0;
+    }
+
+    ev_io_init(&s_listener, listener_callback, fd, EV_READ);
+    ev_io_start(loop, &s_listener);
+
+    ev_tstamp period = s_config.idle_timeout / 4;
+    ev_timer_init(&s_sweep, sweep_callback, period < 1.? 1.: period, period < 1.? 1.: period);
+    ev_timer_start(loop, &s_sweep);
+
+    syslog(LOG_INFO, "udprelay: %s mode, up to %zu flows",
+            s_config.has_upstream? "upstream": "transparent", s_config.max_flows);
+    return 0;
+}
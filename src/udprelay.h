@@ -0,0 +1,40 @@
+/*
+ * udprelay.h - layer-4 proxy UDP relay module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef UDPRELAY_H
+#define UDPRELAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct acl_t;
+
+/*
+ * Without an upstream the relay runs transparently: datagrams are taken
+ * from a TPROXY rule and relayed to their original destination, replies
+ * are sent from that destination's address. With an upstream every flow
+ * goes there and replies leave through the listening socket.
+ */
+typedef struct {
+    int                     has_upstream;
+    struct sockaddr_storage upstream;
+    double                  idle_timeout;   /*  seconds             */
+    size_t                  max_flows;      /*  oldest is evicted   */
+    int                     gro;            /*  UDP_GRO/UDP_SEGMENT */
+    const struct acl_t      *acl;
+} UdpRelayConfig;
+
+void udp_relay_config_default(UdpRelayConfig *config);
+int udp_relay_start(EV_P_ int fd, const UdpRelayConfig *config);
+void udp_relay_stop(EV_P);
+void udp_relay_set_acl(const struct acl_t *acl);
+size_t udp_relay_flows(void);
+
+#endif  /*  UDPRELAY_H  */
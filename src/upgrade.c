@@ -0,0 +1,350 @@
+/*
+ * upgrade.c - layer-4 proxy binary upgrade module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+
+#include "utils.h"
+#include "upgrade.h"
+
+#define UPGRADE_MAX_FDS     8
+#define UPGRADE_NAME_LEN    128
+
+/* Inherited descriptors and the readiness pipe, both cleared once read. */
+#define UPGRADE_ENV_FDS     "L4PROXY_FDS"
+#define UPGRADE_ENV_READY   "L4PROXY_READY_FD"
+#define UPGRADE_ENV_MIGRATE "L4PROXY_MIGRATE_FD"
+
+typedef struct {
+    char            name[UPGRADE_NAME_LEN];
+    int             fd;
+    int             claimed;
+} NamedFd;
+
+static char *s_path;
+static char **s_argv;
+
+static NamedFd s_inherited[UPGRADE_MAX_FDS];    /*  from the previous binary    */
+static size_t s_ninherited;
+static int s_ready_fd = -1;
+static int s_migrate_fd = -1;                   /*  to the other binary, until taken    */
+
+static NamedFd s_passed[UPGRADE_MAX_FDS];       /*  for the next one            */
+static size_t s_npassed;
+
+static upgradeFn s_notify;
+static ev_signal s_signal;
+static ev_io s_ready;
+static ev_child s_child;
+static pid_t s_pid;                             /*  of the new binary, while it starts  */
+static int s_held;
+static int s_deferred;                          /*  SIGUSR2 while held  */
+
+static void signal_callback(EV_P_ ev_signal *watcher, int revents);
+static void ready_callback(EV_P_ ev_io *watcher, int revents);
+static void child_callback(EV_P_ ev_child *watcher, int revents);
+
+/* "NAME=FD,NAME=FD...", names must not contain '=' or ','. */
+static void parse_inherited(const char *env) {
+    char buf[UPGRADE_MAX_FDS * (UPGRADE_NAME_LEN + 16)], *item, *save, *eq, *end;
+
+    if(strlen(env) >= sizeof(buf))
+        return;
+    strcpy(buf, env);
+    for(item = strtok_r(buf, ",", &save); item && s_ninherited < UPGRADE_MAX_FDS;
+            item = strtok_r(NULL, ",", &save)) {
+        NamedFd *nfd = &s_inherited[s_ninherited];
+        long fd;
+
+        if(NULL == (eq = strchr(item, '=')) || (size_t)(eq - item) >= UPGRADE_NAME_LEN)
+            continue;
+        fd = strtol(eq + 1, &end, 10);
+        if(end == eq + 1 || '\0' != *end || fd < 0 || fd > INT_MAX
+                || -1 == fcntl((int)fd, F_SETFD, FD_CLOEXEC))
+            continue;
+        memcpy(nfd->name, item, eq - item);
+        nfd->name[eq - item] = '\0';
+        nfd->fd = (int)fd;
+        nfd->claimed = 0;
+        ++s_ninherited;
+    }
+}
+
+/*
+ * Remembers how this binary was started, so that a new one can be
+ * started the same way. Relative paths are made absolute now, before
+ * daemonizing changes the directory; symlinks are kept, so that the new
+ * binary is whatever the path points to by then.
+ */
+void upgrade_init(char *argv[]) {
+    char cwd[PATH_MAX];
+    const char *env;
+
+    s_argv = argv;
+    if('/' != argv[0][0] && strchr(argv[0], '/') && NULL != getcwd(cwd, sizeof(cwd))
+            && NULL != (s_path = (char*)malloc(strlen(cwd) + strlen(argv[0]) + 2)) )
+        sprintf(s_path, "%s/%s", cwd, argv[0]);
+    else
+        s_path = argv[0];
+
+    if(NULL != (env = getenv(UPGRADE_ENV_FDS)) )
+        parse_inherited(env);
+    if(NULL != (env = getenv(UPGRADE_ENV_READY)) ) {
+        s_ready_fd = atoi(env);
+        fcntl(s_ready_fd, F_SETFD, FD_CLOEXEC);
+    }
+    if(NULL != (env = getenv(UPGRADE_ENV_MIGRATE)) ) {
+        s_migrate_fd = atoi(env);
+        fcntl(s_migrate_fd, F_SETFD, FD_CLOEXEC);
+    }
+    unsetenv(UPGRADE_ENV_FDS);
+    unsetenv(UPGRADE_ENV_READY);
+    unsetenv(UPGRADE_ENV_MIGRATE);
+}
+
+/* The descriptor the previous binary passed under name, or -1. */
+int upgrade_inherit(const char *name) {
+    size_t i;
+
+    for(i = 0; i < s_ninherited; ++i) {
+        if(!s_inherited[i].claimed && 0 == strcmp(name, s_inherited[i].name)) {
+            s_inherited[i].claimed = 1;
+            return s_inherited[i].fd;
+        }
+    }
+    return -1;
+}
+
+/* Passes fd on to the next binary under name. */
+int upgrade_pass(const char *name, int fd) {
+    NamedFd *nfd = &s_passed[s_npassed];
+
+    if(UPGRADE_MAX_FDS == s_npassed || strlen(name) >= UPGRADE_NAME_LEN
+            || strpbrk(name, "=,"))
+        return -1;
+    strcpy(nfd->name, name);
+    nfd->fd = fd;
+    ++s_npassed;
+    return 0;
+}
+
+/*
+ * Tells the previous binary that this one accepts now. Descriptors it
+ * passed that nobody claimed, because the configuration changed, are
+ * closed.
+ */
+void upgrade_ready(void) {
+    size_t i;
+    char c = 1;
+
+    for(i = 0; i < s_ninherited; ++i) {
+        if(!s_inherited[i].claimed) {
+            syslog(LOG_INFO, "upgrade: closing unused %s", s_inherited[i].name);
+            close_i(s_inherited[i].fd);
+        }
+    }
+    s_ninherited = 0;
+    if(-1 != s_ready_fd) {
+        if(1 != write(s_ready_fd, &c, 1))
+            syslog(LOG_WARNING, "upgrade: couldn't tell the previous binary: %m");
+        close_i(s_ready_fd);
+        s_ready_fd = -1;
+    }
+}
+
+/*
+ * The nonblocking SOCK_SEQPACKET socket connecting this binary to the
+ * other one of an upgrade, or -1. The previous binary migrates its
+ * connections over it while it drains, the new one receives them until
+ * it is closed. The caller takes the socket over.
+ */
+int upgrade_migrate_fd(void) {
+    int fd = s_migrate_fd;
+
+    s_migrate_fd = -1;
+    return fd;
+}
+
+void upgrade_start(EV_P_ upgradeFn notify) {
+    s_notify = notify;
+    ev_signal_init(&s_signal, signal_callback, SIGUSR2);
+    ev_signal_start(loop, &s_signal);
+}
+
+/*
+ * The child runs opendir(), setenv() and syslog() before exec, which may
+ * deadlock on a lock another thread held during fork(). While threads
+ * run the upgrade is held, and a SIGUSR2 meanwhile starts it on release.
+ */
+void upgrade_hold(EV_P_ int hold) {
+    s_held = hold;
+    if(!hold && s_deferred) {
+        s_deferred = 0;
+        signal_callback(loop, &s_signal, EV_SIGNAL);
+    }
+}
+
+static void migrate_close(int sockfd[2]) {
+    if(-1 != sockfd[0]) {
+        close_i(sockfd[0]);
+        close_i(sockfd[1]);
+    }
+}
+
+static int is_passed(int fd) {
+    size_t i;
+
+    for(i = 0; i < s_npassed; ++i) {
+        if(fd == s_passed[i].fd)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * In the child: everything but the passed descriptors, the write end
+ * of the readiness pipe and the migration socket is closed on exec, so
+ * client sockets aren't held open by the new binary.
+ */
+static void exec_new(int readyfd, int migratefd) {
+    char fds[sizeof(s_passed)], ready[16], migrate[16];
+    size_t i, len = 0;
+    sigset_t none;
+    DIR *dir;
+    struct dirent *entry;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    if(NULL != (dir = opendir("/proc/self/fd")) ) {
+        while(NULL != (entry = readdir(dir)) ) {
+            int fd = atoi(entry->d_name);
+            if(fd > STDERR_FILENO && fd != dirfd(dir) && fd != readyfd && fd != migratefd
+                    && !is_passed(fd))
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        closedir(dir);
+    }
+
+    for(i = 0; i < s_npassed; ++i) {
+        fcntl(s_passed[i].fd, F_SETFD, 0);
+        len += snprintf(fds + len, sizeof(fds) - len, "%s%s=%d",
+                len? ",": "", s_passed[i].name, s_passed[i].fd);
+    }
+    fcntl(readyfd, F_SETFD, 0);
+    snprintf(ready, sizeof(ready), "%d", readyfd);
+    setenv(UPGRADE_ENV_FDS, fds, 1);
+    setenv(UPGRADE_ENV_READY, ready, 1);
+    if(-1 != migratefd) {
+        fcntl(migratefd, F_SETFD, 0);
+        snprintf(migrate, sizeof(migrate), "%d", migratefd);
+        setenv(UPGRADE_ENV_MIGRATE, migrate, 1);
+    }
+
+    if(strchr(s_path, '/'))
+        execv(s_path, s_argv);
+    else
+        execvp(s_path, s_argv);
+    syslog(LOG_ERR, "upgrade: exec %s: %m", s_path);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * SIGUSR2 starts the binary at the original path with the original
+ * arguments. It finds the listeners already open, and once it accepts
+ * on them it says so over a pipe. If it exits before that, it has
+ * failed and this process carries on as before.
+ */
+static void signal_callback(EV_P_ ev_signal *watcher, int revents) {
+    int pipefd[2], sockfd[2];
+    pid_t pid;
+
+    if(s_pid) {
+        syslog(LOG_WARNING, "upgrade: already started");
+        return;
+    }
+    if(s_held) {
+        syslog(LOG_NOTICE, "upgrade: deferred until other threads finished");
+        s_deferred = 1;
+        return;
+    }
+    if(-1 == pipe2(pipefd, O_CLOEXEC)) {
+        syslog(LOG_ERR, "upgrade: pipe: %m");
+        return;
+    }
+    /*  without it connections just drain    */
+    if(-1 == socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sockfd)) {
+        syslog(LOG_WARNING, "upgrade: socketpair: %m");
+        sockfd[0] = sockfd[1] = -1;
+    }
+
+    (*s_notify)(loop, UPGRADE_EXEC);
+    if(-1 == (pid = fork()) ) {
+        syslog(LOG_ERR, "upgrade: fork: %m");
+        close_i(pipefd[0]);
+        close_i(pipefd[1]);
+        migrate_close(sockfd);
+        (*s_notify)(loop, UPGRADE_FAILED);
+        return;
+    }
+    if(0 == pid)
+        exec_new(pipefd[1], sockfd[1]);
+
+    close_i(pipefd[1]);
+    if(-1 != sockfd[1]) {
+        close_i(sockfd[1]);
+        s_migrate_fd = sockfd[0];
+    }
+    s_pid = pid;
+    syslog(LOG_NOTICE, "upgrade: started %s as %d", s_path, (int)pid);
+    ev_io_init(&s_ready, ready_callback, pipefd[0], EV_READ);
+    ev_io_start(loop, &s_ready);
+    ev_child_init(&s_child, child_callback, pid, 0);
+    ev_child_start(loop, &s_child);
+}
+
+static void ready_callback(EV_P_ ev_io *watcher, int revents) {
+    char c;
+    ssize_t n = read(watcher->fd, &c, 1);
+
+    if(-1 == n && EINTR == errno)
+        return;
+    ev_io_stop(loop, watcher);
+    close_i(watcher->fd);
+    if(1 == n) {
+        syslog(LOG_NOTICE, "upgrade: new binary accepts now");
+        (*s_notify)(loop, UPGRADE_DONE);
+    } else {
+        syslog(LOG_ERR, "upgrade: new binary went away before it was up");
+        s_pid = 0;
+        if(-1 != s_migrate_fd) {
+            close_i(s_migrate_fd);
+            s_migrate_fd = -1;
+        }
+        (*s_notify)(loop, UPGRADE_FAILED);
+    }
+}
+
+/* Reaps the child, which is the new binary unless it daemonized. */
+static void child_callback(EV_P_ ev_child *watcher, int revents) {
+    ev_child_stop(loop, watcher);
+    syslog(LOG_DEBUG, "upgrade: %d exited with status %d", watcher->rpid, watcher->rstatus);
+}
@@ -0,0 +1,30 @@
+/*
+ * upgrade.h - layer-4 proxy binary upgrade module
+ *
+ * Copyright (c) 2015 Yang Li. All rights reserved.
+ *
+ * This program may be distributed according to the terms of the GNU
+ * General Public License, version 3 or (at your option) any later version.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* What the old process is told about an upgrade it started.  */
+enum {
+    UPGRADE_EXEC,       /*  about to start the new binary   */
+    UPGRADE_FAILED,     /*  it went away before it was up   */
+    UPGRADE_DONE,       /*  it accepts now, time to drain   */
+};
+
+typedef void (*upgradeFn)(EV_P_ int event);
+
+void upgrade_init(char *argv[]);
+int upgrade_inherit(const char *name);
+int upgrade_pass(const char *name, int fd);
+int upgrade_migrate_fd(void);
+void upgrade_start(EV_P_ upgradeFn notify);
+void upgrade_hold(EV_P_ int hold);
+void upgrade_ready(void);
+
+#endif  /*  UPGRADE_H   */
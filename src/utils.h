@@ -8,11 +8,64 @@
  */
 
 #ifndef UTILS_H
-#define UTILS_h
+#define UTILS_H
 
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT   25
+#endif
 
 /* A close(2) failed with EINTR should not be restarted in linux.   */
 #define close_i(fd)     (close(fd))
 
+/* Closes a socket with a RST, skipping FIN_WAIT/TIME_WAIT entirely.    */
+static inline int close_rst(int fd) {
+    struct linger lg = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    return close_i(fd);
+}
+
+/* 64-bit finalizer from MurmurHash3.  */
+static inline uint64_t hash_mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Random hash keys, so remote peers cannot aim at one hash chain. */
+static inline void hash_seed(uint64_t seed[2]) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(-1 == fd || 2 * sizeof(uint64_t) != read(fd, seed, 2 * sizeof(uint64_t))) {
+        seed[0] = (uint64_t)getpid() * 0x9e3779b97f4a7c15ULL;
+        seed[1] = (uint64_t)(uintptr_t)seed ^ (uint64_t)time(NULL);
+    }
+    if(-1 != fd)
+        close_i(fd);
+}
+
+/* Strips a '#' comment and surrounding blanks from a config line in place. */
+static inline char *line_strip(char *line) {
+    char *end;
+
+    if(NULL != (end = strchr(line, '#')) )
+        *end = '\0';
+    end = line + strlen(line);
+    while(end > line && strchr(" \t\r\n", end[-1]))
+        *--end = '\0';
+    while(' ' == *line || '\t' == *line)
+        ++line;
+    return line;
+}
+
 #endif  /*  UTILS_H */